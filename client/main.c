@@ -12,19 +12,29 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <pthread.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <ncurses.h>
 #include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+
+#include "framing.h"
+#include "protocol.h"
 
 
 /**
  * DEFINITIONS
  */
-#define WORLD_WIDTH 101         // Game map maximum sizes
+#define WORLD_WIDTH 101         // Game map window sizes, larger maps are scrolled
 #define WORLD_HEIGHT 101
+#define VIEW_WIDTH (WORLD_WIDTH - 2)   // Visible map tiles inside the window border
+#define VIEW_HEIGHT (WORLD_HEIGHT - 2)
 #define CONNECTION_WIDTH 40     // Connection window maximum sizes
 #define CONNECTION_HEIGHT 20
 #define ERROR_WIDTH 40          // Error window maximum sizes
@@ -40,11 +50,26 @@
 #define YELLOW_PAIR 3
 #define BLUE_PAIR 4
 #define WHITE_PAIR 5
+#define MAX_PLAYER_ID 256       // Player IDs outside of 0..MAX_PLAYER_ID-1 are ignored
+#define CLIENT_CAPABILITIES (CAP_COMPACT_MAP | CAP_MAP_CACHE | CAP_AREA_OF_INTEREST) // Capabilities (protocol.h) the client asks for in JOIN
+#define MAP_CACHE_DIR "lsp_p1"  // Map cache directory inside $XDG_CACHE_HOME (or ~/.cache)
+#define PREDICTION_HISTORY 128  // Predicted ticks kept until the server acknowledges them (6.4 s)
+#define SNAPSHOT_BUFFER 8       // PLAYERS snapshots kept for interpolation (jitter buffer)
+#define INTERPOLATION_DELAY (2 * TICK_FREQUENCY) // Players are drawn this many miliseconds behind the server
+#define INTERPOLATION_MAX_DISTANCE 2.0f // Players which moved further between snapshots are not interpolated
+#define RENDER_INTERVAL 25      // Miliseconds between frames, at most one frame is rendered per interval
+#define MOVE_KEEPALIVE 1000     // Miliseconds after which an unchanged direction is sent again
+#define SPECTATOR_SCROLL 10     // Tiles the camera moves per key press when spectating
+#define CHAT_MESSAGE_SIZE 200   // Maximum length of a typed chat message
+#define RESUME_TIMEOUT 10000    // Miliseconds spent reconnecting after the connection drops (server keeps the session as long)
+#define RESUME_RETRY 500        // Miliseconds between reconnection attempts
 
 /**
  * GLOBAL VARIABLES
  */
 int sock;                       // Global socket
+struct sockaddr_in server;      // Server address, kept for resuming the session
+uint64_t resumeToken;           // Token from ACK which lets a new connection take over our session, 0 if none
 WINDOW *mainWindow;             // Main game map window
 WINDOW *scoreBoardWindow;       // Scoreboard window on the right
 WINDOW *notificationWindow;     // Notification/chat window on the left
@@ -54,65 +79,107 @@ WINDOW *sendMessageWindow;      // Message writing window
 int mapW;                       // Game map width
 int mapH;                       // Game map height
 int notificationCounter;        // Count how many lines of notifications/chat have been written
-int myId;                       // Current client ID
-char playerList[256][21];       // List of all players that have JOINED packet sent about them
-char myName[21] = {0};          // Current client name
+int myId;                       // Current client ID, -1 when spectating
+int spectating;                 // Joined with -s: only watches the game (CAP_SPECTATOR), keys move the camera
+char playerList[MAX_PLAYER_ID][MAX_NICK_SIZE + 1]; // List of all players that have JOINED packet sent about them
+char myName[MAX_NICK_SIZE + 1] = {0}; // Current client name
+frameStream_t serverStream;     // Reassembly buffer for frames received from the server
+uint32_t capabilities;          // Capabilities agreed with the server in JOIN/ACK
+char *gameMap;                  // Current map tiles (row-major, mapW*mapH), allocated on START
+int cameraX;                    // Map tile shown in the top left corner of the game window
+int cameraY;
+int protocolVersion;            // Protocol version agreed with the server in JOIN/ACK
+uint64_t gameMapHash;           // Map hash from the START packet
+uint32_t mapBytesReceived;      // MAP_CHUNK bytes received when the map wasn't cached
+int predicting;                 // Own movement is predicted (server speaks PROTOCOL_VERSION_MOVE_SEQUENCE)
+int predictedAlive;             // Own character is alive, dead ones don't move
+float predictedX;               // Own position predicted from the last PLAYERS packet and the unacknowledged moves
+float predictedY;
+enum clientMovement_t predictedDirection; // Direction of the last MOVE sent
+uint32_t moveSequence;          // Sequence of the last MOVE sent
+struct {
+    uint32_t sequence;          // MOVE in effect during the tick
+    enum clientMovement_t direction;
+} predictionHistory[PREDICTION_HISTORY]; // Ring buffer of predicted ticks, oldest at historyStart
+int historyStart;
+int historyCount;
+uint64_t nextPredictionTime;    // Time (clockMs) the next predicted tick is due
+uint64_t nextKeepaliveTime;     // Time (clockMs) the current direction is sent again if it hasn't changed
+struct snapshot {
+    uint32_t tick;              // Server tick of the positions
+    uint64_t time;              // Server time of the tick
+    int playerCount;
+    playerEntry_t players[MAX_PLAYER_ID];
+} snapshots[SNAPSHOT_BUFFER];   // Ring buffer of PLAYERS snapshots, newest at snapshotLast
+int snapshotLast;
+int snapshotCount;
+int64_t serverClockOffset;      // Server clock minus ours, measured on the fastest snapshot
+int rendering;                  // Event loop runs (after START), windows are updated by its doupdate once per frame
+uint64_t nextRenderTime;        // Time (clockMs) the next frame is due
+int chatting;                   // Keys are typed into sendMessageWindow instead of moving the character
+char chatMessage[CHAT_MESSAGE_SIZE + 1]; // Chat message being typed
+int chatLength;
+chtype frameCells[VIEW_HEIGHT][VIEW_WIDTH];  // Frame being composed: map tiles under the camera and players
+chtype screenCells[VIEW_HEIGHT][VIEW_WIDTH]; // Cells mainWindow shows, only cells which differ are drawn again
+int screenValid;                // screenCells matches mainWindow, cleared when the window has been erased
 
 /**
  * ENUMS
+ * Packet, map object, player and movement enumerations are shared with the server (protocol.h)
  */
-// Packet type enumerations
-enum packet_t {
-    JOIN, ACK, START, END, MAP, PLAYERS, SCORES, MOVE, MESSAGE, QUIT, JOINED, PLAYER_DISCONNECTED
-};
-
-// Connection error type enumerations
-enum connectionError_t {
-    ERROR_NAME_IN_USE = -1, ERROR_SERVER_FULL = -2, ERROR_OTHER = -3
-};
-
-//Map object enumerations
-enum mapObjecT_t {
-    None, Dot, Wall, PowerPellet, Invincibility, Score
-};
-
-// Player state enumerations
-enum playerState_t {
-    PS_NORMAL, PS_DEAD, PS_PowerPellet, PS_Invincibility, PS_Other
-};
-
-// Player type enumerations
-enum playerType_t {
-    Pacman, Ghost
-};
-
-// Client movement enumerations
-enum clientMovement_t {
-    UP, DOWN, RIGHT, LEFT
-};
 
 /**
  * METHOD DECLARATIONS
  */
-void *listenToServer(void*);
-void *listenToInput(void*);
+void runEventLoop();
+void handleServerPacket(char*, size_t);
+ssize_t receivePacket(char**);
+void sendPacket(char*, size_t);
+void handleKey(int);
+void handleChatKey(int);
+void handleSpectatorKey(int);
+void drawChatInput();
+void predictTick();
+void sendMove();
+void predictStep(enum clientMovement_t);
+void reconcilePrediction(playerEntry_t*, moveAck_t*);
 void sendJoinRequest();
 void receiveJoinResponse();
+int resumeSession();
+int connectBefore(uint64_t);
+int waitForPacket(uint64_t);
+void resumeGame(char*, size_t);
 void initCurses();
 void deleteAllWindows();
 void connectionDialog(char*, char*);
 void writeToWindow(WINDOW*, int, int, char[], int, int);
+void updateWindow(WINDOW*);
 void windowDeleteAction(WINDOW*);
 void waitForStartPacket(int*, int*);
-void drawMap(char*);
+void drawMap(char*, size_t);
+void composeMapTiles();
+chtype tileCell(int);
+void flushFrame();
+int moveCamera(int, int);
+void loadMap();
+int mapCachePath(char*, size_t, int);
+int loadCachedMap();
+void saveCachedMap();
+void handleMapChunk(char*, size_t);
+void handleMapDelta(char*, size_t);
 void exitWithMessage(char[]);
-void drawPlayers(char*);
-void drawScoreTable(char*);
-void handleMessage(char*);
-void playerJoinedEvent(char*);
-void playerDisconnectedEvent(char*);
+void storeSnapshot(char*, size_t);
+void renderFrame();
+void composePlayer(playerEntry_t*);
+uint64_t clockMs();
+void drawScoreTable(char*, size_t);
+void handleMessage(char*, size_t);
+void answerPing(char*, size_t);
+void playerJoinedEvent(char*, size_t);
+void playerDisconnectedEvent(char*, size_t);
 void createNotificationWindow();
 void createScoreBoardWindow();
+void openChatInput();
 void sendChatMessage();
 void endGame();
 void exitGame();
@@ -123,22 +190,29 @@ void exitGame();
  * ====================================================================================== */
 
 /**
- * Entry point. Handle the main game flow, transitions and thread creation
+ * Entry point. Handle the main game flow, transitions and the event loop
+ * With -s the client joins as a spectator
  *
+ * @param argc
+ * @param argv
  * @return
  */
-int main() {
+int main(int argc, char *argv[]) {
     // Initialize variables
-    struct sockaddr_in server;
     char serverAddress[16], serverPort[6];
     int startX, startY;
     mapW = 0;
     mapH = 0;
     notificationCounter = 1;
     myId = 0;
-
-    for (int i = 0; i < 256; ++i) {
-        for (int j = 0; j < 21; ++j) {
+    spectating = argc > 1 && strcmp(argv[1], "-s") == 0;
+    resumeToken = 0;
+    // A write to a dropped connection fails instead of killing the client, so the session can be resumed
+    signal(SIGPIPE, SIG_IGN);
+    frameStreamInit(&serverStream, FRAME_MAX_PAYLOAD_SIZE);
+
+    for (int i = 0; i < MAX_PLAYER_ID; ++i) {
+        for (int j = 0; j < MAX_NICK_SIZE + 1; ++j) {
             playerList[i][j] = '\0';
         }
     }
@@ -176,27 +250,37 @@ int main() {
     // Continuous waiting for the START packet
     waitForStartPacket(&startX, &startY);
 
+    // Take the map from the cache or ask the server for it
+    loadMap();
+
     // Create lefthand notification/chat window
     createNotificationWindow();
 
     // Create righthand scoreboard window
     createScoreBoardWindow();
 
-    // Start a new thread to listen to the server
-    pthread_t serverThreadId;
-    if (pthread_create(&serverThreadId, NULL, listenToServer, (void *) &sock) < 0) {
-        exitWithMessage("Error: Could not create a thread");
-    }
-
-    // Start a new thread to listen to the user input
-    pthread_t inputThreadId;
-    if (pthread_create(&inputThreadId, NULL, listenToInput, (void *) &sock) < 0) {
-        exitWithMessage("Error: Could not create a thread");
-    }
-
-    // Join the threads so that our main thread waits for them to be over
-    pthread_join(serverThreadId, NULL);
-    pthread_join(inputThreadId, NULL);
+    // Own movement is simulated locally from the START position, servers without MOVE sequences can't be reconciled
+    predicting = !spectating && protocolVersion >= PROTOCOL_VERSION_MOVE_SEQUENCE;
+    predictedAlive = 1;
+    predictedX = (float)startX;
+    predictedY = (float)startY;
+    predictedDirection = UP;
+    moveSequence = 0;
+    historyStart = 0;
+    historyCount = 0;
+
+    // Players are drawn from buffered snapshots once the game runs
+    snapshotLast = 0;
+    snapshotCount = 0;
+    nextRenderTime = clockMs();
+    nextPredictionTime = nextRenderTime + TICK_FREQUENCY;
+    nextKeepaliveTime = nextRenderTime + MOVE_KEEPALIVE;
+    screenValid = 0;
+    chatting = 0;
+    rendering = 1;
+
+    // Server packets, key presses, predicted ticks and frames are all handled by one thread
+    runEventLoop();
 
     close(sock);
 
@@ -248,50 +332,97 @@ void deleteAllWindows() {
 void windowDeleteAction(WINDOW *w) {
     wborder(w, ' ', ' ', ' ',' ',' ',' ',' ',' ');
     werase(w);
-    wrefresh(w);
+    updateWindow(w);
     delwin(w);
 }
 
 /**
- * Opens up a chat input window and sends the message to the server
+ * Opens up the chat input window, the following keys are typed into it (handleChatKey)
  */
-void sendChatMessage() {
-    char msg[MAX_PACKET_SIZE] = {0};
-
-    // Create and prepare the chat input window
+void openChatInput() {
     sendMessageWindow = newwin(5, NOTIFICATION_WIDTH, NOTIFICATION_HEIGHT + 3, NOTIFICATION_OFFSET);
-    box(sendMessageWindow, 0, 0);
-    scrollok(sendMessageWindow, TRUE);
-    writeToWindow(sendMessageWindow, 0, 0, "Write your message ", 1, 0);
-    echo();
-    curs_set(TRUE);
-    cbreak();
-    refresh();
+    chatLength = 0;
+    chatMessage[0] = '\0';
+    chatting = 1;
+    drawChatInput();
+}
+
+/**
+ * Acts on a key typed into the chat input window: Enter sends the message, Escape cancels it
+ *
+ * @param ch
+ */
+void handleChatKey(int ch) {
+    switch(ch) {
+        case '\n':
+        case KEY_ENTER:
+            sendChatMessage();
+            break;
+        case 27:
+            break;
+        case 127:
+        case 8:
+        case KEY_BACKSPACE:
+            if(chatLength > 0) {
+                chatMessage[--chatLength] = '\0';
+            }
+            drawChatInput();
+            return;
+        default:
+            if(ch >= ' ' && ch < 127 && chatLength < CHAT_MESSAGE_SIZE) {
+                chatMessage[chatLength++] = (char)ch;
+                chatMessage[chatLength] = '\0';
+                drawChatInput();
+            }
+            return;
+    }
+
+    // Message was sent or cancelled
+    chatting = 0;
+    windowDeleteAction(sendMessageWindow);
+}
 
-    // Move the cursor in the window and listen for the message
-    wmove(sendMessageWindow, 1, 1);
-    wgetstr(sendMessageWindow, msg);
+/**
+ * Draws the chat input window with the end of the message which fits in it
+ */
+void drawChatInput() {
+    int visible = NOTIFICATION_WIDTH - 3;
+    int start = chatLength > visible ? chatLength - visible : 0;
 
-    int l = strlen(msg);
+    werase(sendMessageWindow);
+    box(sendMessageWindow, 0, 0);
+    mvwprintw(sendMessageWindow, 0, 0, "Write your message ");
+    mvwprintw(sendMessageWindow, 1, 1, "%s_", chatMessage + start);
+    updateWindow(sendMessageWindow);
+}
 
+/**
+ * Sends the typed chat message to the server
+ */
+void sendChatMessage() {
     // Prepare the message packet
-    char packet[1 + sizeof(int) + sizeof(int) + l];
-    memset(packet, '\0', sizeof(packet));
-    memset(packet, MESSAGE, 1);
-    memcpy(packet+1, &myId, sizeof(int));
-    memcpy(packet+1+sizeof(int), &l, sizeof(int));
-    strcpy(packet+1+sizeof(int)+sizeof(int), msg);
+    char packet[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    messagePacket_t message = {myId, chatLength, chatMessage};
+    packetWriterInit(&writer, packet, sizeof(packet));
 
     // Send the message
-    if(send(sock, packet, sizeof(packet) , 0) < 0) {
-        exitWithMessage("Join request has failed. Please check your internet connection and try again.");
+    if(chatLength > 0 && encodeMessage(&writer, &message)) {
+        sendPacket(packet, writer.length);
     }
+}
 
-    // Restore previous terminal state and delete chat input window
-    cbreak();
-    noecho();
-    curs_set(FALSE);
-    windowDeleteAction(sendMessageWindow);
+/**
+ * Marks the window for the next screen update. During the game the event loop writes all windows
+ * out with one doupdate per frame, before that the screen is updated right away
+ *
+ * @param w
+ */
+void updateWindow(WINDOW *w) {
+    wnoutrefresh(w);
+    if(!rendering) {
+        doupdate();
+    }
 }
 
 /**
@@ -314,8 +445,8 @@ void writeToWindow(WINDOW* window, int y, int x, char text[], int lc, int increa
     }
 
     // Print the actual text
-    mvwprintw(window, y, x, text);
-    wrefresh(window);
+    mvwprintw(window, y, x, "%s", text);
+    updateWindow(window);
 
     // We need this check so that we do not get trashed with useless empty lines in case of positioned text output
     // For example, "Messages" or "Scoreboard" should not increase the counter
@@ -362,39 +493,46 @@ void connectionDialog(char *address, char *port) {
  */
 void sendJoinRequest() {
     writeToWindow(connectionWindow, 9, 4, "Sending request to join the game", 1, 0);
-    char packet[21];
+    char packet[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    joinPacket_t join;
 
-    memset(packet, '\0', sizeof(packet));
     memset(myName, '\0', sizeof(myName));
 
     // Get the name from the user
     writeToWindow(connectionWindow, 11, 4, "Enter your name: ", 1, 0);
     wmove(connectionWindow, 12, 6);
-    wgetstr(connectionWindow, myName);
+    wgetnstr(connectionWindow, myName, MAX_NICK_SIZE);
 
-    // Prepare the request packet
-    memset(packet, JOIN, 1);
-    strcpy(packet+1, myName);
+    // Prepare the request packet, announcing what this client supports
+    strcpy(join.name, myName);
+    join.version = PROTOCOL_VERSION;
+    join.capabilities = spectating ? (CAP_SPECTATOR | CAP_COMPACT_MAP) : CLIENT_CAPABILITIES;
+    join.resumeToken = 0;
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeJoin(&writer, &join);
 
     // Send join request packet
-    if(send(sock, packet, sizeof(packet) , 0) < 0) {
-        exitWithMessage("Join request has failed. Please check your internet connection and try again.");
-    }
+    sendPacket(packet, writer.length);
 }
 
 /**
  * Receive join response from the server
  */
 void receiveJoinResponse() {
-    char response[sizeof(int) + 1] = {0};
+    char *response;
+    ssize_t readSize;
     int responseCode;
+    packetReader_t reader;
+    ackPacket_t ack;
 
     // Check the response that we received to JOIN packet
-    if(recv(sock, response, sizeof(int) + 1, 0)) {
-        if(response[0] != ACK) {
+    if((readSize = receivePacket(&response)) > 0) {
+        packetReaderInit(&reader, response, (size_t)readSize);
+        if(!decodeAck(&reader, &ack)) {
             exitWithMessage("Server rejected the connection. Please try again.");
         }
-        memcpy((void *) &responseCode, (void *) &response+1, sizeof(responseCode));
+        responseCode = ack.id;
 
         if(responseCode == ERROR_NAME_IN_USE) {
             exitWithMessage("Name is in use! Disconnecting...");
@@ -408,9 +546,21 @@ void receiveJoinResponse() {
             exitWithMessage("Something went wrong! Please try again later.");
         }
 
-        // Save client's character ID and name
+        // Save client's character ID, name and the features the server agreed to
         myId = responseCode;
-        strcpy(playerList[myId], myName);
+        capabilities = ack.capabilities;
+        protocolVersion = ack.version;
+        resumeToken = ack.resumeToken;
+        if(spectating) {
+            // Server which can't stream to spectators has taken us as a player
+            if(!(capabilities & CAP_SPECTATOR)) {
+                exitWithMessage("Server doesn't support spectators!");
+            }
+            myId = -1;
+        }
+        if(myId >= 0 && myId < MAX_PLAYER_ID) {
+            strcpy(playerList[myId], myName);
+        }
 
         // Delete the connection popup window
         windowDeleteAction(connectionWindow);
@@ -418,6 +568,147 @@ void receiveJoinResponse() {
     }
 }
 
+/**
+ * Reconnects after the connection dropped and takes our session over with the token from ACK
+ * The server keeps our character, score and ID for a while, so the game continues where it was
+ *
+ * @return 1 if the session was resumed, 0 if it can't be (spectating, old server, session expired)
+ */
+int resumeSession() {
+    char packet[MAX_PACKET_SIZE];
+    char *response;
+    packetWriter_t writer;
+    packetReader_t reader;
+    joinPacket_t join;
+    ackPacket_t ack;
+
+    if(spectating || resumeToken == 0) {
+        return 0;
+    }
+    writeToWindow(notificationWindow, notificationCounter, 1, "Connection lost, reconnecting...", 1, 1);
+    doupdate();
+
+    uint64_t deadline = clockMs() + RESUME_TIMEOUT;
+    while (clockMs() < deadline) {
+        close(sock);
+        frameStreamFree(&serverStream);
+        if((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            return 0;
+        }
+        if(!connectBefore(deadline)) {
+            usleep(RESUME_RETRY * 1000);
+            continue;
+        }
+
+        strcpy(join.name, myName);
+        join.version = PROTOCOL_VERSION;
+        join.capabilities = CLIENT_CAPABILITIES;
+        join.resumeToken = resumeToken;
+        packetWriterInit(&writer, packet, sizeof(packet));
+        encodeJoin(&writer, &join);
+        ssize_t readSize = frameSend(sock, packet, writer.length);
+        if(readSize >= 0) {
+            readSize = waitForPacket(deadline) ? receivePacket(&response) : -1;
+        }
+        if(readSize <= 0) {
+            usleep(RESUME_RETRY * 1000);
+            continue;
+        }
+        packetReaderInit(&reader, response, (size_t)readSize);
+        if(!decodeAck(&reader, &ack) || ack.id != myId) {
+            // ERROR_SESSION_EXPIRED: the server has already removed our character
+            return 0;
+        }
+        capabilities = ack.capabilities;
+        protocolVersion = ack.version;
+        resumeToken = ack.resumeToken;
+        writeToWindow(notificationWindow, notificationCounter, 1, "Reconnected!", 1, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Connects sock to the server without blocking past the deadline, the socket is left blocking
+ *
+ * @param deadline clockMs time
+ * @return 1 if connected, 0 on failure or timeout
+ */
+int connectBefore(uint64_t deadline) {
+    int flags = fcntl(sock, F_GETFL);
+    if(flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return 0;
+    }
+    int connected = connect(sock, (struct sockaddr *)&server, sizeof(server)) == 0;
+    if(!connected && errno == EINPROGRESS) {
+        struct pollfd fd = {sock, POLLOUT, 0};
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        uint64_t now = clockMs();
+        connected = now < deadline && poll(&fd, 1, (int)(deadline - now)) > 0 &&
+                    getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorLength) == 0 && error == 0;
+    }
+    return fcntl(sock, F_SETFL, flags) == 0 && connected;
+}
+
+/**
+ * Reads from the server until a whole packet is buffered, without waiting past the deadline
+ *
+ * @param deadline clockMs time
+ * @return 1 if receivePacket won't block, 0 on timeout or a closed connection
+ */
+int waitForPacket(uint64_t deadline) {
+    while(!frameStreamReady(&serverStream)) {
+        struct pollfd fd = {sock, POLLIN, 0};
+        uint64_t now = clockMs();
+        if(now >= deadline) {
+            return 0;
+        }
+        int ready = poll(&fd, 1, (int)(deadline - now));
+        if(ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ready <= 0 || frameStreamRead(&serverStream, sock) <= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Handle START received during the game, the server sends it after the session was resumed
+ * A START of another map means the game we were in has ended meanwhile
+ *
+ * @param packet
+ * @param length
+ */
+void resumeGame(char *packet, size_t length) {
+    packetReader_t reader;
+    startPacket_t start;
+
+    packetReaderInit(&reader, packet, length);
+    if(!decodeStart(&reader, &start, protocolVersion)) {
+        return;
+    }
+    if(start.width != mapW || start.height != mapH || start.mapHash != gameMapHash) {
+        endGame();
+    }
+
+    // Map changes are sent again from the first one, the full map without CAP_MAP_CACHE
+    if(capabilities & CAP_MAP_CACHE) {
+        loadCachedMap();
+    }
+    predictedAlive = 1;
+    predictedX = (float)start.x;
+    predictedY = (float)start.y;
+    historyStart = 0;
+    historyCount = 0;
+    snapshotLast = 0;
+    snapshotCount = 0;
+    moveCamera(start.x, start.y);
+    screenValid = 0;
+}
+
 /**
  * Continuously for the START packet
  *
@@ -430,27 +721,37 @@ void waitForStartPacket(int *startX, int *startY) {
     writeToWindow(mainWindow, 2, 3, "Connected and waiting for the game to start...", 1, 0);
 
     ssize_t readSize;
-    char packet[MAX_PACKET_SIZE];
+    char *packet;
 
-    while ((readSize = recv(sock, packet, MAX_PACKET_SIZE, 0)) > 0) {
+    while ((readSize = receivePacket(&packet)) > 0) {
         // If we are receiving packets from the server, add the loading dots
         waddch(mainWindow, '.');
         wrefresh(mainWindow);
 
-        if(packet[0] == START) {
+        int packetKind = packetType(packet, (size_t)readSize);
+        if(packetKind == START) {
             // Start packet received, save the needed information and break the loop
-            mapW = (int)packet[1];
-            mapH = (int)packet[2];
-            *startX = (int)packet[3];
-            *startY = (int)packet[4];
+            packetReader_t reader;
+            startPacket_t start;
+            packetReaderInit(&reader, packet, (size_t)readSize);
+            if(!decodeStart(&reader, &start, protocolVersion) || start.width <= 0 || start.height <= 0) {
+                continue;
+            }
+            mapW = start.width;
+            mapH = start.height;
+            gameMapHash = start.mapHash;
+            free(gameMap);
+            if((gameMap = calloc((size_t)mapW, (size_t)mapH)) == NULL) {
+                exitWithMessage("Map is too large!");
+            }
+            moveCamera(start.x, start.y);
+            *startX = start.x;
+            *startY = start.y;
             break;
-        } else if (packet[0] == JOINED) {
+        } else if (packetKind == JOINED) {
             // We are in the "lobby" but received a JOINED packet. Save the joined player
-            playerJoinedEvent(packet);
+            playerJoinedEvent(packet, (size_t)readSize);
         }
-
-        // Clear the message buffer
-        memset(packet, 0, MAX_PACKET_SIZE);
     }
 
     // Exceptions
@@ -492,124 +793,337 @@ void createScoreBoardWindow() {
 
 
 /**
- * Continuously listen to the game server and act on packets
+ * Game event loop: waits for the server socket, the keyboard or the next deadline with one poll,
+ * applies everything which arrived to the client state, then moves the predicted character and
+ * renders a frame when they are due. A burst of packets only updates the state, frames are capped
+ * at one per RENDER_INTERVAL and every frame ends with a single doupdate
+ */
+void runEventLoop() {
+    struct pollfd fds[2] = {{sock, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+    char *payload;
+    size_t payloadLength;
+    int frameState;
+    int ch;
+
+    // Keys are read only when poll says there are some
+    nodelay(stdscr, TRUE);
+
+    while (1) {
+        // Apply every packet which has been reassembled so far
+        while ((frameState = frameStreamNext(&serverStream, &payload, &payloadLength)) > 0) {
+            handleServerPacket(payload, payloadLength);
+        }
+        if(frameState < 0) {
+            exitWithMessage("Failed to communicate with the server!");
+        }
+
+        // Sleep until there is input or something is due
+        uint64_t now = clockMs();
+        fds[0].fd = sock;   // Replaced when the session is resumed
+        uint64_t due = predicting && nextPredictionTime < nextRenderTime ? nextPredictionTime : nextRenderTime;
+        if(poll(fds, 2, due > now ? (int)(due - now) : 0) < 0 && errno != EINTR) {
+            exitWithMessage("Failed to communicate with the server!");
+        }
+
+        if(fds[0].revents) {
+            ssize_t readSize = frameStreamRead(&serverStream, sock);
+            if (readSize <= 0 && resumeSession()) {
+                continue;
+            } else if (readSize == 0) {
+                exitWithMessage("Server went offline");
+            } else if (readSize < 0) {
+                exitWithMessage("Failed to communicate with the server!");
+            }
+        }
+        if(fds[1].revents) {
+            while ((ch = getch()) != ERR) {
+                handleKey(ch);
+            }
+        }
+
+        // Deadlines are absolute, so the predicted ticks keep the server's rate
+        now = clockMs();
+        while (predicting && now >= nextPredictionTime) {
+            predictTick();
+            nextPredictionTime += TICK_FREQUENCY;
+        }
+        if(now >= nextRenderTime) {
+            renderFrame();
+            nextRenderTime = now + RENDER_INTERVAL;
+        }
+        // Frames wake the loop often enough for the keepalive
+        if(!spectating && protocolVersion >= PROTOCOL_VERSION_MOVE_TIME && now >= nextKeepaliveTime) {
+            sendMove();
+        }
+    }
+}
+
+/**
+ * Acts on a packet received during the game
  *
- * @param conn
- * @return
+ * @param message
+ * @param length
  */
-void *listenToServer(void *conn) {
-    int sock = *(int *) conn;
-    ssize_t readSize;
-    char message[MAX_PACKET_SIZE];
-
-    // Wait for all incoming packets
-    while ((readSize = recv(sock, message, MAX_PACKET_SIZE, 0)) > 0) {
-        int packetType = (int)message[0];
-
-        // Decide what to do based on the packet type
-        switch (packetType) {
-            case JOINED:
-                playerJoinedEvent(message);
-                break;
-            case PLAYER_DISCONNECTED:
-                playerDisconnectedEvent(message);
-                break;
-            case END:
-                endGame();
-                break;
-            case MAP:
-                drawMap(message);
-                break;
-            case PLAYERS:
-                drawPlayers(message);
-                break;
-            case SCORES:
-                drawScoreTable(message);
-                break;
-            case MESSAGE:
-                handleMessage(message);
-                break;
-            default:
-                break;
-        }
-
-        // Clear the message buffer
-        memset(message, 0, MAX_PACKET_SIZE);
+void handleServerPacket(char *message, size_t length) {
+    // Decide what to do based on the packet type
+    switch (packetType(message, length)) {
+        case JOINED:
+            playerJoinedEvent(message, length);
+            break;
+        case PLAYER_DISCONNECTED:
+            playerDisconnectedEvent(message, length);
+            break;
+        case END:
+            endGame();
+            break;
+        case START:
+            resumeGame(message, length);
+            break;
+        case MAP:
+            drawMap(message, length);
+            break;
+        case MAP_CHUNK:
+            handleMapChunk(message, length);
+            break;
+        case MAP_DELTA:
+            handleMapDelta(message, length);
+            break;
+        case PLAYERS:
+            storeSnapshot(message, length);
+            break;
+        case SCORE:
+            drawScoreTable(message, length);
+            break;
+        case MESSAGE:
+            handleMessage(message, length);
+            break;
+        case PING:
+            answerPing(message, length);
+            break;
+        default:
+            break;
     }
+}
 
-    // Exceptions
-    if (readSize == 0) {
-        exitWithMessage("Server went offline");
-    } else if (readSize == -1) {
-        exitWithMessage("Failed to communicate with the server!");
+/**
+ * Receives the next frame from the server, packet points into the reassembly buffer until the next call
+ * Frames are reassembled from the stream, so a single recv may hold several packets or only a part of one
+ *
+ * @param packet
+ * @return payload length, 0 if the server closed the connection, -1 on error
+ */
+ssize_t receivePacket(char **packet) {
+    char *payload;
+    size_t payloadLength;
+    int frameState;
+
+    while ((frameState = frameStreamNext(&serverStream, &payload, &payloadLength)) == 0) {
+        ssize_t readSize = frameStreamRead(&serverStream, sock);
+        if (readSize <= 0) {
+            return readSize;
+        }
+    }
+    if (frameState < 0) {
+        return -1;
     }
 
-    return 0;
+    // Full MAP packets of large maps don't fit in a fixed buffer, handlers decode straight from the stream
+    *packet = payload;
+
+    // Empty frames are not valid packets, but must not be mistaken for a closed connection
+    return payloadLength > 0 ? (ssize_t)payloadLength : 1;
 }
 
 /**
- * Listen to the user input and send commands to the server
+ * Sends a length prefixed packet to the server
  *
- * @param conn
- * @return
+ * @param packet
+ * @param length
+ */
+void sendPacket(char *packet, size_t length) {
+    if(frameSend(sock, packet, length) < 0 && !resumeSession()) {
+        exitWithMessage("Request has failed. Please check your internet connection and try again.");
+    }
+}
+
+/**
+ * Acts on a key press: changes the direction, opens the chat input or quits
+ *
+ * @param ch
  */
-void *listenToInput(void *conn) {
-    int ch, sendPacket;
+void handleKey(int ch) {
     enum clientMovement_t direction;
-    int i = 0;
 
-    // Continuously listen to the keypresses
-    while ((ch = getch())) {
-        if(ch != ERR) {
-            sendPacket = 1;
+    if(chatting) {
+        handleChatKey(ch);
+        return;
+    }
+    if(spectating) {
+        handleSpectatorKey(ch);
+        return;
+    }
+
+    // Change direction/act on special key presses
+    switch(ch) {
+        case (int)'w':
             direction = UP;
+            break;
+        case (int)'s':
+            direction = DOWN;
+            break;
+        case (int)'d':
+            direction = RIGHT;
+            break;
+        case (int)'a':
+            direction = LEFT;
+            break;
+        case (int)'y':
+            openChatInput();
+            return;
+        case (int)'q':
+            exitGame();
+            return;
+        default:
+            // Do not send the packet if it was anything unrecognized
+            return;
+    }
 
-            // Change direction/act on special key presses
-            switch(ch) {
-                case (int)'w':
-                    direction = UP;
-                    break;
-                case (int)'s':
-                    direction = DOWN;
-                    break;
-                case (int)'d':
-                    direction = RIGHT;
-                    break;
-                case (int)'a':
-                    direction = LEFT;
-                    break;
-                case (int)'y':
-                    sendPacket = 0;
-                    sendChatMessage();
-                    break;
-                case (int)'q':
-                    sendPacket = 0;
-                    exitGame();
-                    break;
-                default:
-                    sendPacket = 0;
-                    break;
-            }
+    // Key repeat of the current direction changes nothing, the server already has it
+    if(direction == predictedDirection) {
+        return;
+    }
 
-            // Do not send the packet if it was a special keypress or anything unrecognized
-            if(sendPacket) {
-                // Prepare the direction change command packet
-                char packet[1 + sizeof(int) + 1];
+    // The new direction is predicted from the next tick on, without waiting for the server
+    predictedDirection = direction;
+    sendMove();
+}
 
-                memset(packet, '\0', sizeof(packet));
-                memset(packet, MOVE, 1);
-                memcpy(packet+1, &ch, sizeof(int));
-                memset(packet+1+sizeof(int), direction, 1);
+/**
+ * Acts on a key press of a spectator: moves the camera or quits
+ *
+ * @param ch
+ */
+void handleSpectatorKey(int ch) {
+    // Camera position is its top left corner, moveCamera takes the center
+    int centerX = cameraX + VIEW_WIDTH / 2;
+    int centerY = cameraY + VIEW_HEIGHT / 2;
+
+    switch(ch) {
+        case (int)'w':
+            moveCamera(centerX, centerY - SPECTATOR_SCROLL);
+            break;
+        case (int)'s':
+            moveCamera(centerX, centerY + SPECTATOR_SCROLL);
+            break;
+        case (int)'d':
+            moveCamera(centerX + SPECTATOR_SCROLL, centerY);
+            break;
+        case (int)'a':
+            moveCamera(centerX - SPECTATOR_SCROLL, centerY);
+            break;
+        case (int)'q':
+            exitGame();
+            break;
+        default:
+            break;
+    }
+}
 
-                // Send direction change
-                if(send(sock, packet, sizeof(packet) , 0) < 0) {
-                    exitWithMessage("Request has failed. Please check your internet connection and try again.");
-                }
-            }
+/**
+ * Sends the current direction as a new MOVE, stamped with our estimate of the server clock
+ * so the server can measure the input lag
+ */
+void sendMove() {
+    uint64_t now = clockMs();
+    moveSequence++;
+    nextKeepaliveTime = now + MOVE_KEEPALIVE;
+
+    // Prepare the direction change command packet
+    char packet[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    movePacket_t move = {myId, predictedDirection, moveSequence, 0};
+    if(snapshotCount > 0 && protocolVersion >= PROTOCOL_VERSION_SNAPSHOT_TIME) {
+        move.time = (uint32_t)(now + serverClockOffset);
+    }
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeMove(&writer, &move, protocolVersion);
+
+    // Send direction change
+    sendPacket(packet, writer.length);
+}
+
+/**
+ * Moves our own character by one tick like the server does and remembers the move of every tick,
+ * so that the ticks the server hasn't seen yet can be replayed on top of its position (reconcilePrediction)
+ */
+void predictTick() {
+    if(!predictedAlive) {
+        return;
+    }
+    predictStep(predictedDirection);
+    if(historyCount == PREDICTION_HISTORY) {
+        // Server hasn't answered for a long time, forget the oldest tick
+        historyStart = (historyStart + 1) % PREDICTION_HISTORY;
+        historyCount--;
+    }
+    int last = (historyStart + historyCount++) % PREDICTION_HISTORY;
+    predictionHistory[last].sequence = moveSequence;
+    predictionHistory[last].direction = predictedDirection;
+}
+
+/**
+ * Moves the predicted position by one tick with the server's rules: TICK_MOVEMENT per tick,
+ * moves into a wall or outside of the map are undone
+ *
+ * @param direction
+ */
+void predictStep(enum clientMovement_t direction) {
+    float x = predictedX + movementStepX[direction & 3];
+    float y = predictedY + movementStepY[direction & 3];
+    unsigned int tileX = (unsigned int)(int)x;
+    unsigned int tileY = (unsigned int)(int)y;
+
+    if(tileX >= (unsigned int)mapW || tileY >= (unsigned int)mapH || gameMap[tileY * mapW + tileX] == Wall) {
+        return;
+    }
+    predictedX = x;
+    predictedY = y;
+}
+
+/**
+ * Takes our position from the PLAYERS packet and replays the predicted ticks which it doesn't include yet:
+ * ticks of MOVE packets older than the acknowledged one and the first ack->ticks ticks of the acknowledged one
+ * The player entry receives the predicted position
+ *
+ * @param player
+ * @param ack
+ */
+void reconcilePrediction(playerEntry_t *player, moveAck_t *ack) {
+    uint32_t skip = ack->ticks;
+
+    while (historyCount > 0) {
+        int32_t age = (int32_t)(predictionHistory[historyStart].sequence - ack->sequence);
+        if(age > 0 || (age == 0 && skip == 0)) {
+            break;
         }
+        if(age == 0) {
+            skip--;
+        }
+        historyStart = (historyStart + 1) % PREDICTION_HISTORY;
+        historyCount--;
     }
 
-    return 0;
+    predictedAlive = player->playerState != DEAD;
+    predictedX = player->x;
+    predictedY = player->y;
+    if(!predictedAlive) {
+        historyCount = 0;
+    }
+    for (int i = 0; i < historyCount; ++i) {
+        predictStep(predictionHistory[(historyStart + i) % PREDICTION_HISTORY].direction);
+    }
+    player->x = predictedX;
+    player->y = predictedY;
 }
 
 /**
@@ -617,16 +1131,14 @@ void *listenToInput(void *conn) {
  */
 void exitGame() {
     // Prepare QUIT packet
-    char packet[1 + sizeof(int)];
-
-    memset(packet, '\0', sizeof(packet));
-    memset(packet, QUIT, 1);
-    memcpy(packet+1, &myId, sizeof(int));
+    char packet[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    playerIdPacket_t quit = {myId};
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodePlayerId(&writer, QUIT, &quit);
 
     // Send the QUIT packet
-    if(send(sock, packet, sizeof(packet) , 0) < 0) {
-        exitWithMessage("Join request has failed. Please check your internet connection and try again.");
-    }
+    sendPacket(packet, writer.length);
 
     // Exit the game
     exitWithMessage("Goodbye!");
@@ -682,77 +1194,301 @@ void initCurses() {
 }
 
 /**
- * Main method for static map object drawing
+ * Handle full MAP packet - save the tiles
+ *
+ * @param packet
+ * @param length
+ */
+void drawMap(char *packet, size_t length) {
+    packetReader_t reader;
+    char *map;
+
+    // Map size is known from the START packet
+    packetReaderInit(&reader, packet, length);
+    if(capabilities & CAP_COMPACT_MAP) {
+        if(!decodeCompactMap(&reader, mapW, mapH, gameMap)) {
+            return;
+        }
+    } else if(decodeMap(&reader, mapW, mapH, &map)) {
+        memcpy(gameMap, map, (size_t)(mapW * mapH));
+    } else {
+        return;
+    }
+
+    // Tiles are drawn with the next frame (renderFrame)
+}
+
+/**
+ * Writes the map tiles under the camera into the frame, cells past the map edge are blank
  * note: map[i][j] == *((map+j)+i*mapW)
+ */
+void composeMapTiles() {
+    for (int i = 0; i < VIEW_HEIGHT; ++i) {
+        int y = cameraY + i;
+        for (int j = 0; j < VIEW_WIDTH; ++j) {
+            int x = cameraX + j;
+            frameCells[i][j] = x < mapW && y < mapH ? tileCell(gameMap[y * mapW + x]) : ' ';
+        }
+    }
+}
+
+/**
+ * Returns the character with attributes which represents the map object
  *
- * @param mapH
- * @param mapW
- * @param map
- */
-void drawMap(char *map) {
-    // Move the map pointer by one to skip packet type
-    map++;
-
-    // Main loop for drawing the map
-    for (int i = 0; i < mapH; ++i) {
-        for (int j = 0; j < mapW; ++j) {
-            // +1 to the positions is needed so that graphics do not overlap the world box
-            // Get the block type to draw
-            int blockType = (int)*((map+j)+i*mapW);
-
-            switch (blockType) {
-                case None:
-                    mvwaddch(mainWindow, i+1, j+1, ' ');
-                    break;
-                case Wall:
-                    mvwaddch(mainWindow, i+1, j+1, 97 | A_ALTCHARSET);
-                    break;
-                case Dot:
-                    wattron(mainWindow, COLOR_PAIR(WHITE_PAIR)|A_BOLD);
-                    mvwaddch(mainWindow, i+1, j+1, '.');
-                    wattroff(mainWindow, COLOR_PAIR(WHITE_PAIR)|A_BOLD);
-                    break;
-                case PowerPellet:
-                    mvwaddch(mainWindow, i+1, j+1, ACS_DIAMOND);
-                    break;
-                case Invincibility:
-                    mvwaddch(mainWindow, i+1, j+1, 'X');
-                    break;
-                case Score:
-                    mvwaddch(mainWindow, i+1, j+1, ACS_PLUS);
-                    break;
-                default:
-                    break;
+ * @param blockType
+ * @return
+ */
+chtype tileCell(int blockType) {
+    switch (blockType) {
+        case Wall:
+            return 97 | A_ALTCHARSET;
+        case Dot:
+            return '.' | COLOR_PAIR(WHITE_PAIR) | A_BOLD;
+        case PowerPellet:
+            return ACS_DIAMOND;
+        case Invincibility:
+            return 'X';
+        case Score:
+            return ACS_PLUS;
+        default:
+            return ' ';
+    }
+}
+
+/**
+ * Draws the cells of the frame which differ from what mainWindow already shows and refreshes it once
+ * +1 to the positions is needed so that graphics do not overlap the world box
+ */
+void flushFrame() {
+    for (int i = 0; i < VIEW_HEIGHT; ++i) {
+        for (int j = 0; j < VIEW_WIDTH; ++j) {
+            if(!screenValid || frameCells[i][j] != screenCells[i][j]) {
+                mvwaddch(mainWindow, i+1, j+1, frameCells[i][j]);
+                screenCells[i][j] = frameCells[i][j];
             }
         }
     }
+    screenValid = 1;
+
+    // Windows changed since the last frame (chat, scoreboard) are written out together with the map
+    wnoutrefresh(mainWindow);
+    doupdate();
 }
 
 /**
- * Handle player joined event - write a notification and save the player
+ * Centers the camera on the given map tile, clamped so the view stays inside the map
+ *
+ * @param x
+ * @param y
+ * @return 1 if the camera moved
+ */
+int moveCamera(int x, int y) {
+    int newX = x - VIEW_WIDTH / 2;
+    int newY = y - VIEW_HEIGHT / 2;
+
+    if(newX > mapW - VIEW_WIDTH) newX = mapW - VIEW_WIDTH;
+    if(newY > mapH - VIEW_HEIGHT) newY = mapH - VIEW_HEIGHT;
+    if(newX < 0) newX = 0;
+    if(newY < 0) newY = 0;
+
+    if(newX == cameraX && newY == cameraY) {
+        return 0;
+    }
+    cameraX = newX;
+    cameraY = newY;
+    return 1;
+}
+
+/**
+ * Loads the START map from the local cache, on a cache miss the server is asked for a chunked transfer
+ * Only used when the server agreed to CAP_MAP_CACHE, otherwise full MAP packets are sent every tick
+ */
+void loadMap() {
+    mapBytesReceived = 0;
+    if(!(capabilities & CAP_MAP_CACHE)) {
+        return;
+    }
+    if(loadCachedMap()) {
+        return;
+    }
+
+    char packet[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    mapRequestPacket_t request = {gameMapHash};
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeMapRequest(&writer, &request);
+    sendPacket(packet, writer.length);
+}
+
+/**
+ * Writes path of the cache file for the current map hash, creates the cache directory if asked to
+ *
+ * @param path
+ * @param size
+ * @param create
+ * @return 1 on success, 0 if there is no usable cache directory
+ */
+int mapCachePath(char *path, size_t size, int create) {
+    char *base = getenv("XDG_CACHE_HOME");
+    char dir[FILENAME_MAX];
+
+    if(base != NULL && base[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", base);
+    } else if((base = getenv("HOME")) != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache", base);
+    } else {
+        return 0;
+    }
+
+    if(create) {
+        if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            return 0;
+        }
+        strncat(dir, "/" MAP_CACHE_DIR, sizeof(dir) - strlen(dir) - 1);
+        if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            return 0;
+        }
+    } else {
+        strncat(dir, "/" MAP_CACHE_DIR, sizeof(dir) - strlen(dir) - 1);
+    }
+
+    snprintf(path, size, "%s/%016llx.map", dir, (unsigned long long)gameMapHash);
+    return 1;
+}
+
+/**
+ * Reads the map with the START hash from the cache into gameMap
+ * Cache file: width(4), height(4), width*height tiles
+ *
+ * @return 1 if the map was found and its contents match the hash
+ */
+int loadCachedMap() {
+    char path[FILENAME_MAX];
+    char *tiles;
+    uint32_t size[2];
+
+    if(!mapCachePath(path, sizeof(path), 0)) {
+        return 0;
+    }
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) {
+        return 0;
+    }
+    if((tiles = malloc((size_t)mapW * mapH)) == NULL) {
+        fclose(file);
+        return 0;
+    }
+
+    int found = fread(size, sizeof(uint32_t), 2, file) == 2 &&
+                size[0] == (uint32_t)mapW && size[1] == (uint32_t)mapH &&
+                fread(tiles, 1, (size_t)(mapW * mapH), file) == (size_t)(mapW * mapH) &&
+                mapHash(tiles, mapW, mapH, mapW) == gameMapHash;
+    fclose(file);
+
+    if(found) {
+        memcpy(gameMap, tiles, (size_t)(mapW * mapH));
+    }
+    free(tiles);
+    return found;
+}
+
+/**
+ * Stores gameMap in the cache, failures are ignored since the map can always be requested again
+ */
+void saveCachedMap() {
+    char path[FILENAME_MAX];
+    char tmpPath[FILENAME_MAX + 4];
+    uint32_t size[2] = {(uint32_t)mapW, (uint32_t)mapH};
+
+    if(!mapCachePath(path, sizeof(path), 1)) {
+        return;
+    }
+
+    // Write to a temporary file first so other clients never read a half written map
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+    FILE *file = fopen(tmpPath, "wb");
+    if(file == NULL) {
+        return;
+    }
+    int written = fwrite(size, sizeof(uint32_t), 2, file) == 2 &&
+                  fwrite(gameMap, 1, (size_t)(mapW * mapH), file) == (size_t)(mapW * mapH);
+    if(fclose(file) == 0 && written) {
+        rename(tmpPath, path);
+    } else {
+        unlink(tmpPath);
+    }
+}
+
+/**
+ * Handle MAP_CHUNK - part of the map requested after a cache miss
  *
- * @param mapH
- * @param mapW
- * @param map
+ * @param packet
+ * @param length
  */
-void playerJoinedEvent(char *event) {
-    // Move pointer beyond packet type
-    event++;
+void handleMapChunk(char *packet, size_t length) {
+    packetReader_t reader;
+    mapChunkPacket_t chunk;
+
+    packetReaderInit(&reader, packet, length);
+    if(!decodeMapChunk(&reader, &chunk) || chunk.mapHash != gameMapHash ||
+       chunk.totalSize != (uint32_t)(mapW * mapH) || chunk.offset + (uint32_t)chunk.length > chunk.totalSize) {
+        return;
+    }
 
-    int playerId;
-    // Save player ID and move pointer beyond it
-    memcpy((void *) &playerId, (void *) *&event, sizeof(playerId));
-    event += sizeof(playerId);
+    memcpy(gameMap + chunk.offset, chunk.tiles, (size_t)chunk.length);
+    mapBytesReceived += chunk.length;
 
-    // Save player name
-    char name[21] = {0};
-    memcpy(name, *&event, 20);
+    // Whole map received, keep it for the next time this map is played
+    if(mapBytesReceived == chunk.totalSize && mapHash(gameMap, mapW, mapH, mapW) == gameMapHash) {
+        saveCachedMap();
+    }
+}
+
+/**
+ * Handle MAP_DELTA - apply changed tiles to the map
+ *
+ * @param packet
+ * @param length
+ */
+void handleMapDelta(char *packet, size_t length) {
+    packetReader_t reader;
+    tileChange_t change;
+    int changeCount;
+
+    packetReaderInit(&reader, packet, length);
+    if(!decodeMapDeltaBegin(&reader, &changeCount)) {
+        return;
+    }
+
+    for (int i = 0; i < changeCount && decodeTileChange(&reader, &change); ++i) {
+        if(change.x < mapW && change.y < mapH) {
+            gameMap[change.y * mapW + change.x] = (char)change.tile;
+        }
+    }
+
+    // Tiles are drawn with the next frame (renderFrame)
+}
+
+/**
+ * Handle player joined event - write a notification and save the player
+ *
+ * @param packet
+ * @param length
+ */
+void playerJoinedEvent(char *packet, size_t length) {
+    packetReader_t reader;
+    joinedPacket_t joined;
+
+    packetReaderInit(&reader, packet, length);
+    if(!decodeJoined(&reader, &joined) || joined.id < 0 || joined.id >= MAX_PLAYER_ID) {
+        return;
+    }
 
     // Notify the players of the recently joined one
     char msg[300] = {0};
-    sprintf(msg, "Player %s joined the game!", name);
+    sprintf(msg, "Player %s joined the game!", joined.name);
 
-    strcpy(playerList[playerId], name);
+    strcpy(playerList[joined.id], joined.name);
 
     writeToWindow(notificationWindow, notificationCounter, 1, msg, 1, 1);
 }
@@ -760,189 +1496,322 @@ void playerJoinedEvent(char *event) {
 /**
  * Handle player disconnect event - write a notification
  *
- * @param mapH
- * @param mapW
- * @param map
+ * @param packet
+ * @param length
  */
-void playerDisconnectedEvent(char *event) {
-    // Move pointer beyond packet type
-    event++;
-
-    int playerId;
-    // Save player ID and move pointer beyond it
-    memcpy((void *) &playerId, (void *) *&event, sizeof(playerId));
-    event += sizeof(playerId);
+void playerDisconnectedEvent(char *packet, size_t length) {
+    packetReader_t reader;
+    playerIdPacket_t disconnected;
+
+    packetReaderInit(&reader, packet, length);
+    if(!decodePlayerId(&reader, PLAYER_DISCONNECTED, &disconnected) ||
+       disconnected.id < 0 || disconnected.id >= MAX_PLAYER_ID) {
+        return;
+    }
 
     // Notify the players of the recently disconnected one
     char msg[300] = {0};
-    sprintf(msg, "Player %s left the game!", playerList[playerId]);
+    sprintf(msg, "Player %s left the game!", playerList[disconnected.id]);
 
     writeToWindow(notificationWindow, notificationCounter, 1, msg, 1, 1);
+
+    // Players kept from earlier snapshots (CAP_AREA_OF_INTEREST) would otherwise stay on the map
+    for (int i = 0; i < snapshotCount; ++i) {
+        struct snapshot *snapshot = &snapshots[(snapshotLast - i + SNAPSHOT_BUFFER) % SNAPSHOT_BUFFER];
+        for (int j = 0; j < snapshot->playerCount; ++j) {
+            if(snapshot->players[j].id == disconnected.id) {
+                snapshot->players[j--] = snapshot->players[--snapshot->playerCount];
+            }
+        }
+    }
 }
 
 
 /**
- * Main method for player drawing
+ * Handle PLAYERS packet - reconcile our predicted position and keep the snapshot for interpolation
+ * Snapshots of a tick which is already buffered are dropped, the server may send a tick twice
  *
- * @param mapH
- * @param mapW
- * @param map
+ * @param packet
+ * @param length
  */
-void drawPlayers(char *players) {
-    // Move pointer beyond packet type
-    players++;
-
+void storeSnapshot(char *packet, size_t length) {
+    packetReader_t reader;
+    playerEntry_t player;
+    moveAck_t ack;
+    snapshotStamp_t stamp;
     int playerCount;
-    // Save the player count to draw, move pointer beyond it
-    memcpy((void *) &playerCount, (void *) *&players, sizeof(playerCount));
-    players += sizeof(playerCount);
+    uint64_t now = clockMs();
+
+    packetReaderInit(&reader, packet, length);
+    if(!decodePlayersBegin(&reader, &playerCount, &ack, &stamp, protocolVersion)) {
+        return;
+    }
+
+    // Older servers don't stamp snapshots, the time they arrive at is the best guess
+    if(protocolVersion < PROTOCOL_VERSION_SNAPSHOT_TIME) {
+        stamp.tick = snapshotCount > 0 ? snapshots[snapshotLast].tick + 1 : 1;
+        stamp.time = now;
+    }
+    if(snapshotCount > 0 && (int32_t)(stamp.tick - snapshots[snapshotLast].tick) <= 0) {
+        return;
+    }
+
+    // Server clock offset follows the snapshot which arrived the fastest, slower ones only move it back slowly
+    int64_t offset = (int64_t)(stamp.time - now);
+    if(snapshotCount == 0 || offset > serverClockOffset) {
+        serverClockOffset = offset;
+    } else {
+        serverClockOffset--;
+    }
+
+    // Oldest snapshot is overwritten once the buffer is full
+    struct snapshot *previous = snapshotCount > 0 ? &snapshots[snapshotLast] : NULL;
+    snapshotLast = (snapshotLast + 1) % SNAPSHOT_BUFFER;
+    if(snapshotCount < SNAPSHOT_BUFFER) {
+        snapshotCount++;
+    }
+    struct snapshot *snapshot = &snapshots[snapshotLast];
+    snapshot->tick = stamp.tick;
+    snapshot->time = stamp.time;
+    snapshot->playerCount = 0;
+    bool included[MAX_PLAYER_ID] = {false};
+    for (int i = 0; i < playerCount && decodePlayerEntry(&reader, &player); ++i) {
+        if(player.id < 0 || player.id >= MAX_PLAYER_ID || included[player.id]) {
+            continue;
+        }
+        if(player.id == myId && predicting) {
+            reconcilePrediction(&player, &ack);
+        }
+        included[player.id] = true;
+        snapshot->players[snapshot->playerCount++] = player;
+    }
+
+    // Distant players are only sent now and then (CAP_AREA_OF_INTEREST), in between they stay where they were
+    if(previous != NULL && (capabilities & CAP_AREA_OF_INTEREST)) {
+        for (int i = 0; i < previous->playerCount; ++i) {
+            if(!included[previous->players[i].id]) {
+                snapshot->players[snapshot->playerCount++] = previous->players[i];
+            }
+        }
+    }
+}
+
+/**
+ * Draws the map and all players as they were INTERPOLATION_DELAY ago on the server clock,
+ * interpolated between the two buffered snapshots around that time. Our own character is drawn
+ * where the prediction puts it
+ */
+void renderFrame() {
+    if(snapshotCount == 0) {
+        return;
+    }
 
-    int playerId;
-    float playerX, playerY;
-    enum playerState_t playerState;
-    enum playerType_t playerType;
+    // Find the snapshots just before (from) and after (to) the render time, or the closest one
+    int64_t renderTime = (int64_t)clockMs() + serverClockOffset - INTERPOLATION_DELAY;
+    int oldest = (snapshotLast - snapshotCount + 1 + SNAPSHOT_BUFFER) % SNAPSHOT_BUFFER;
+    struct snapshot *from = &snapshots[oldest];
+    struct snapshot *to = from;
+    for (int i = 1; i < snapshotCount; ++i) {
+        struct snapshot *next = &snapshots[(oldest + i) % SNAPSHOT_BUFFER];
+        to = next;
+        if((int64_t)next->time > renderTime) {
+            break;
+        }
+        from = next;
+    }
+    float t = 1;
+    if(to != from && renderTime > (int64_t)from->time) {
+        t = (float)(renderTime - (int64_t)from->time) / (float)(to->time - from->time);
+    } else if(to != from) {
+        to = from;
+    }
 
-    // Get information about each player and draw the character
+    int fromIndex[MAX_PLAYER_ID];
+    for (int i = 0; i < MAX_PLAYER_ID; ++i) {
+        fromIndex[i] = -1;
+    }
+    for (int i = 0; i < from->playerCount; ++i) {
+        fromIndex[from->players[i].id] = i;
+    }
+
+    // Positions between the snapshots, players who respawned or teleported are not slid across the map
+    playerEntry_t players[MAX_PLAYER_ID];
+    int playerCount = to->playerCount;
+    int own = -1;
     for (int i = 0; i < playerCount; ++i) {
-        // Save player ID, coordinates, state and type
-        // Move pointer after each copy by the read byte count
-        memcpy((void *) &playerId, (void *) *&players, sizeof(playerId));
-        players += sizeof(playerId);
-        memcpy((void *) &playerX, (void *) *&players, sizeof(playerX));
-        players += sizeof(playerX);
-        memcpy((void *) &playerY, (void *) *&players, sizeof(playerY));
-        players += sizeof(playerY);
-        memcpy((void *) &playerState, (void *) *&players, 1);
-        players++;
-        memcpy((void *) &playerType, (void *) *&players, 1);
-        players++;
-
-        // Convert to integers as sadly we can not represent floats in ncurses
-        int integerPosX = (int)playerX;
-        int integerPosY = (int)playerY;
-
-        // Default color (pacman)
-        int usePair = GREEN_PAIR;
-
-        // Determine which color pair to use
-        if(playerType == Ghost) {
-            usePair = RED_PAIR;
-        }
-
-        if(playerId == myId) {
-            usePair = YELLOW_PAIR;
-        }
-
-        if(playerState == PS_Invincibility) {
-            usePair = WHITE_PAIR;
-        } else if (playerState == PS_PowerPellet) {
-            usePair = BLUE_PAIR;
-        }
-
-        // Draw character if it is alive and set its color
-        wattron(mainWindow, COLOR_PAIR(usePair));
-        if(playerState != PS_DEAD) {
-            if(playerType == Ghost) {
-                mvwaddch(mainWindow, integerPosY+1, integerPosX+1, '&');
-            } else {
-                mvwaddch(mainWindow, integerPosY+1, integerPosX+1, '@');
+        players[i] = to->players[i];
+        int j = fromIndex[players[i].id];
+        if(j >= 0) {
+            playerEntry_t *previous = &from->players[j];
+            if(fabsf(players[i].x - previous->x) + fabsf(players[i].y - previous->y) <= INTERPOLATION_MAX_DISTANCE) {
+                players[i].x = previous->x + (players[i].x - previous->x) * t;
+                players[i].y = previous->y + (players[i].y - previous->y) * t;
             }
         }
-        wattroff(mainWindow, COLOR_PAIR(usePair));
+        if(players[i].id == myId) {
+            own = i;
+        }
+    }
+    if(own >= 0 && predicting) {
+        players[own].x = predictedX;
+        players[own].y = predictedY;
     }
 
-    // Refresh the window to render the changes
-    refresh();
-    wrefresh(mainWindow);
+    // Keep the camera on our own character, every cell of the view is composed anyway
+    if(own >= 0) {
+        moveCamera((int)players[own].x, (int)players[own].y);
+    }
+    composeMapTiles();
+    for (int i = 0; i < playerCount; ++i) {
+        composePlayer(&players[i]);
+    }
+
+    // Only the cells which changed since the last frame are sent to the terminal
+    flushFrame();
 }
 
 /**
- * Main method for scoreboard drawing
+ * Puts a single character into the frame relative to the camera
  *
- * @param mapH
- * @param mapW
- * @param map
+ * @param player
  */
-void drawScoreTable(char *scores) {
-    // Move pointer beyond packet type
-    scores++;
+void composePlayer(playerEntry_t *player) {
+    // Convert to integers as sadly we can not represent floats in ncurses, positions are relative to the camera
+    int integerPosX = (int)player->x - cameraX;
+    int integerPosY = (int)player->y - cameraY;
+
+    if(integerPosX < 0 || integerPosY < 0 || integerPosX >= VIEW_WIDTH || integerPosY >= VIEW_HEIGHT) {
+        return;
+    }
+
+    // Default color (pacman)
+    int usePair = GREEN_PAIR;
+
+    // Determine which color pair to use
+    if(player->playerType == Ghost) {
+        usePair = RED_PAIR;
+    }
+
+    if(player->id == myId) {
+        usePair = YELLOW_PAIR;
+    }
+
+    if(player->playerState == powerupInvincibility) {
+        usePair = WHITE_PAIR;
+    } else if (player->playerState == powerupPowerPellet) {
+        usePair = BLUE_PAIR;
+    }
+
+    // Draw character if it is alive with its color
+    if(player->playerState != DEAD) {
+        frameCells[integerPosY][integerPosX] = (player->playerType == Ghost ? '&' : '@') | COLOR_PAIR(usePair);
+    }
+}
 
+/**
+ * Returns monotonic clock time in miliseconds
+ */
+uint64_t clockMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Main method for scoreboard drawing
+ *
+ * @param packet
+ * @param length
+ */
+void drawScoreTable(char *packet, size_t length) {
+    packetReader_t reader;
+    scoreEntry_t entry;
     int scoreCount;
-    // Save the amount of scores to display
-    memcpy((void *) &scoreCount, (void *) *&scores, sizeof(scoreCount));
-    scores += sizeof(scoreCount);
 
-    int playerId, playerScore;
+    // Save the amount of scores to display
+    packetReaderInit(&reader, packet, length);
+    if(!decodeScoresBegin(&reader, &scoreCount)) {
+        return;
+    }
 
     // Get information about each player and draw the score
-    for (int i = 0; i < scoreCount; ++i) {
-        // Save player score and ID
-        memcpy((void *) &playerScore, (void *) *&scores, sizeof(playerScore));
-        scores += sizeof(playerScore);
-        memcpy((void *) &playerId, (void *) *&scores, sizeof(playerId));
-        scores += sizeof(playerId);
+    for (int i = 0; i < scoreCount && decodeScoreEntry(&reader, &entry); ++i) {
+        if(entry.id < 0 || entry.id >= MAX_PLAYER_ID) {
+            continue;
+        }
 
         // Prepare the formatted strings for output
         char printId[MAX_PACKET_SIZE] = {0};
         char printScore[MAX_PACKET_SIZE] = {0};
         // Get the player name from our saved list
-        sprintf(printId, "%s", playerList[playerId]);
-        sprintf(printScore, "%d", playerScore);
+        sprintf(printId, "%s", playerList[entry.id]);
+        sprintf(printScore, "%d", entry.score);
 
         // If it is the client's score, draw it in green
-        if(playerId == myId) {
+        if(entry.id == myId) {
             wattron(scoreBoardWindow, COLOR_PAIR(GREEN_PAIR));
         }
 
         writeToWindow(scoreBoardWindow, i+1, 1, printId, 1, 0);
         writeToWindow(scoreBoardWindow, i+1, 25, printScore, 1, 0);
 
-        if(playerId == myId) {
+        if(entry.id == myId) {
             wattroff(scoreBoardWindow, COLOR_PAIR(GREEN_PAIR));
         }
     }
+}
 
-    refresh();
+/**
+ * Echoes PING back right away, the server measures the round trip and lowers our snapshot rate if it grows
+ *
+ * @param packet
+ * @param length
+ */
+void answerPing(char *packet, size_t length) {
+    packetReader_t reader;
+    packetWriter_t writer;
+    pingPacket_t ping;
+    char pong[MAX_PACKET_SIZE];
+
+    packetReaderInit(&reader, packet, length);
+    if(!decodePing(&reader, PING, &ping)) {
+        return;
+    }
+    packetWriterInit(&writer, pong, sizeof(pong));
+    encodePing(&writer, PONG, &ping);
+    sendPacket(pong, writer.length);
 }
 
 /**
  * Main method for reading and displaying user/server messages
  *
- * @param mapH
- * @param mapW
- * @param map
+ * @param packet
+ * @param length
  */
-void handleMessage(char *message) {
-    // Move pointer beyond packet type
-    message++;
-
-    int senderId, messageLength;
+void handleMessage(char *packet, size_t length) {
+    packetReader_t reader;
+    messagePacket_t message;
 
     // Save the sender ID, message length and the message itself
-    memcpy((void *) &senderId, (void *) *&message, sizeof(senderId));
-    message += sizeof(senderId);
-    memcpy((void *) &messageLength, (void *) *&message, sizeof(messageLength));
-    message += sizeof(messageLength);
-
-    char msg[messageLength];
-    memcpy((void *) &msg, (void *) *&message, messageLength);
+    packetReaderInit(&reader, packet, length);
+    if(!decodeMessage(&reader, &message) || message.id < 0 || message.id >= MAX_PLAYER_ID) {
+        return;
+    }
 
     // If the sender is the current client, draw the message in green
-    if(senderId == myId) {
+    if(message.id == myId) {
         wattron(notificationWindow, COLOR_PAIR(GREEN_PAIR));
     }
 
     // Format the message string to output
     char formattedMsg[MAX_PACKET_SIZE] = {0};
-    sprintf(formattedMsg, "%s: %s", playerList[senderId], msg);
+    snprintf(formattedMsg, sizeof(formattedMsg), "%s: %.*s", playerList[message.id], message.length, message.text);
 
     // Message line count
     int lineCount = (int)ceil(strlen(formattedMsg) / NOTIFICATION_WIDTH) + 1;
     writeToWindow(notificationWindow, notificationCounter, 1, formattedMsg, lineCount, 1);
 
-    if(senderId == myId) {
+    if(message.id == myId) {
         wattroff(notificationWindow, COLOR_PAIR(GREEN_PAIR));
     }
-
-    refresh();
 }
@@ -0,0 +1,96 @@
+/*
+ * LSP Kursa projekts
+ * Karšu kompilators
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "mapfile.h"
+
+/*
+ * Compiles text maps into MAP_BINARY_EXTENSION files which the server loads without parsing
+ * and without computing the map metadata (spawn points, components, distances) again
+ */
+
+void printUsage(char *);
+
+bool compileMap(char *, char *);
+
+int main(int argc, char *argv[]) {
+    char *output = NULL;
+    int first = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+        printUsage(argv[0]);
+        return EXIT_SUCCESS;
+    }
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        output = argv[2];
+        first = 3;
+    }
+    if (first >= argc || (output && argc - first != 1)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (int i = first; i < argc; i++) {
+        char path[FILENAME_MAX];
+        if (output) {
+            snprintf(path, FILENAME_MAX, "%s", output);
+        } else {
+            // Input name with its extension replaced
+            char *dot = strrchr(argv[i], '.');
+            char *slash = strrchr(argv[i], '/');
+            int length = (dot && (!slash || dot > slash)) ? (int) (dot - argv[i]) : (int) strlen(argv[i]);
+            snprintf(path, FILENAME_MAX, "%.*s%s", length, argv[i], MAP_BINARY_EXTENSION);
+        }
+        if (!compileMap(argv[i], path)) failed++;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void printUsage(char *name) {
+    fprintf(stderr, "Usage: %s [-o OUTPUT] MAP...\n"
+                    "Compiles text maps, MAP.txt is written to MAP" MAP_BINARY_EXTENSION " unless -o is given\n", name);
+}
+
+/**
+ * Parses a text map, computes its metadata and writes the compiled map
+ */
+bool compileMap(char *input, char *output) {
+    mapFile_t map;
+    mapFileError_t error;
+
+    if (isMapBinary(input)) {
+        fprintf(stderr, "%s: Already compiled\n", input);
+        return false;
+    }
+    if (!loadMapText(input, &map, &error)) {
+        if (error.line > 0) {
+            fprintf(stderr, "%s:%d:%d: %s\n", input, error.line, error.column, error.message);
+        } else {
+            fprintf(stderr, "%s: %s\n", input, error.message);
+        }
+        return false;
+    }
+    if (!computeMapMetadata(&map, &error)) {
+        fprintf(stderr, "%s: %s\n", input, error.message);
+        freeMapFile(&map);
+        return false;
+    }
+    if (!saveMapBinary(output, &map, &error)) {
+        fprintf(stderr, "%s: %s\n", output, error.message);
+        freeMapFile(&map);
+        return false;
+    }
+    printf("%s -> %s (%dx%d, %d dots, %d spawn points, %d components, %d landmarks)\n", input, output,
+           map.width, map.height, map.dotCount, map.pacmanSpawnCount, map.componentCount, map.landmarkCount);
+    freeMapFile(&map);
+    return true;
+}
@@ -0,0 +1,557 @@
+/*
+ * LSP Kursa projekts
+ * Skatītāju retranslators
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "framing.h"
+#include "protocol.h"
+
+/*
+ * Subscribes to a game server as a single spectator (CAP_SPECTATOR) and passes its stream on to any
+ * number of spectators which connect to the relay, e.g. lsp_p1_client -s. The server sends every tick
+ * once no matter how many people watch, the relay forwards the frames without serializing them again.
+ * Only START and the full MAP for spectators which have to be synced are built here, from the map
+ * kept up to date with the server's MAP and MAP_DELTA packets
+ */
+
+#define MAX_VIEWERS 4096                // Spectators connected to the relay
+#define MAX_PLAYER_ID 256               // Names of player IDs outside of 0..MAX_PLAYER_ID-1 are not kept
+#define RELAY_PORT 8889                 // Default listening port (-l)
+#define SERVER_PORT 8888                // Default game server port (-p)
+#define MAX_PACKET_SIZE 1472            // Packets built by the relay (ACK, JOINED)
+#define JOIN_TIMEOUT 5000               // Miliseconds a new spectator has to send JOIN, then it is dropped
+
+enum debugLevel_t {
+    INFO, VERBOSE
+};
+
+typedef struct viewer {
+    int sock;
+    struct in_addr ip;
+    bool joined;                        // JOIN has been answered, the viewer gets the stream
+    uint64_t joinDeadline;              // clockMs until which JOIN is waited for
+    unsigned int game;                  // Game the viewer has START and the full MAP of, 0 if none
+    frameStream_t recvStream;           // JOIN, anything after it is read away
+    frameBuffer_t backlog;              // Frames the socket didn't take yet
+} viewer_t;
+
+/*
+ * Globals
+ */
+int upstream;                           // Connection to the game server
+frameStream_t upstreamStream;           // Reassembly buffer for frames from the game server
+int listenSock;                         // Socket accepting spectators
+viewer_t *viewers[MAX_VIEWERS];         // Connected spectators, NULL if the slot is free
+char playerNames[MAX_PLAYER_ID][MAX_NICK_SIZE + 1]; // Names from JOINED, empty for IDs which aren't in the game
+char startPacket[MAX_PACKET_SIZE];      // Last START from the server, forwarded to every viewer which is synced
+size_t startLength;                     // 0 before the first START
+int mapWidth;
+int mapHeight;
+char *gameMap;                          // Tiles of the current game (row-major), allocated on START
+bool mapKnown;                          // MAP has been received since START
+unsigned int game;                      // Increased with every START
+frameBuffer_t events;                   // JOINED/PLAYER_DISCONNECTED/MESSAGE/END frames of the current batch
+frameBuffer_t snapshot;                 // MAP_DELTA/SCORE/PLAYERS frames of the current batch
+frameBuffer_t syncFrames;               // START and the full MAP, built when a viewer needs them
+bool syncValid;                         // syncFrames matches the current map
+char SERVER_ADDRESS[16];                // Game server address (-s)
+int SERVER_PORT_NUMBER;                 // Game server port (-p)
+int LISTEN_PORT;                        // Relay port (-l)
+char RELAY_NAME[MAX_NICK_SIZE + 1];     // Name the relay joins the server with (-n)
+enum debugLevel_t debugLevel;           // Holds debugging level of the relay (-v)
+
+void exitWithMessage(char[]);
+
+void processArgs(int, char *[]);
+
+void connectUpstream();
+
+int startListening();
+
+void runRelay();
+
+void handleUpstreamFrame(char *, size_t);
+
+void forwardFrame(frameBuffer_t *, char *, size_t);
+
+void sendBatch();
+
+bool buildSync();
+
+void acceptViewer();
+
+bool readViewer(viewer_t *);
+
+bool joinViewer(viewer_t *, char *, size_t);
+
+void dropViewer(int, char *);
+
+int dropSilentViewers();
+
+uint64_t clockMs();
+
+/**
+ * Starting point
+ */
+int main(int argc, char *argv[]) {
+    processArgs(argc, argv);
+    // A write to a spectator which is gone fails with EPIPE and only that spectator is dropped
+    signal(SIGPIPE, SIG_IGN);
+    frameStreamInit(&upstreamStream, FRAME_MAX_PAYLOAD_SIZE);
+    frameBufferInit(&events);
+    frameBufferInit(&snapshot);
+    frameBufferInit(&syncFrames);
+    connectUpstream();
+    listenSock = startListening();
+    runRelay();
+    return 0;
+}
+
+/**
+ * Fatal error, viewers are disconnected when the process exits
+ */
+void exitWithMessage(char error[]) {
+    printf("%s\n", error);
+    exit(EXIT_FAILURE);
+}
+
+void processArgs(int argc, char *argv[]) {
+    snprintf(SERVER_ADDRESS, sizeof(SERVER_ADDRESS), "127.0.0.1");
+    SERVER_PORT_NUMBER = SERVER_PORT;
+    LISTEN_PORT = RELAY_PORT;
+    snprintf(RELAY_NAME, sizeof(RELAY_NAME), "relay");
+    debugLevel = INFO;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            snprintf(SERVER_ADDRESS, sizeof(SERVER_ADDRESS), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            SERVER_PORT_NUMBER = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            LISTEN_PORT = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            snprintf(RELAY_NAME, sizeof(RELAY_NAME), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-v") == 0) {
+            debugLevel = VERBOSE;
+        } else if (strcmp(argv[i], "-h") == 0) {
+            exitWithMessage("-s [ADDRESS] Game server address, default 127.0.0.1\n"
+                                    "-p [PORT] Game server port, default 8888\n"
+                                    "-l [PORT] Port spectators connect to, default 8889\n"
+                                    "-n [NAME] Name the relay joins the game server with, default relay\n"
+                                    "-v Verbose logging\n");
+        }
+    }
+}
+
+/**
+ * Joins the game server as a spectator, the server has to speak the current protocol version
+ * since the frames are forwarded as they are
+ */
+void connectUpstream() {
+    struct sockaddr_in server;
+    char packet[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    packetReader_t reader;
+    joinPacket_t join;
+    ackPacket_t ack;
+    char *payload;
+    size_t payloadLength;
+    int frameState;
+
+    upstream = socket(AF_INET, SOCK_STREAM, 0);
+    if (upstream == -1) exitWithMessage("Could not create socket");
+    server.sin_addr.s_addr = inet_addr(SERVER_ADDRESS);
+    server.sin_family = AF_INET;
+    server.sin_port = htons((uint16_t) SERVER_PORT_NUMBER);
+    if (connect(upstream, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        exitWithMessage("Connection to the game server failed");
+    }
+
+    memset(&join, 0, sizeof(join));
+    memcpy(join.name, RELAY_NAME, sizeof(join.name));
+    join.version = PROTOCOL_VERSION;
+    join.capabilities = CAP_SPECTATOR | CAP_COMPACT_MAP;
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeJoin(&writer, &join);
+    if (frameSend(upstream, packet, writer.length) < 0) exitWithMessage("Failed to join the game server");
+
+    while ((frameState = frameStreamNext(&upstreamStream, &payload, &payloadLength)) == 0) {
+        if (frameStreamRead(&upstreamStream, upstream) <= 0) exitWithMessage("Game server closed the connection");
+    }
+    packetReaderInit(&reader, payload, payloadLength);
+    if (frameState < 0 || !decodeAck(&reader, &ack) || ack.id < 0) {
+        exitWithMessage("Game server rejected the relay");
+    }
+    if (!(ack.capabilities & CAP_SPECTATOR) || ack.version != PROTOCOL_VERSION) {
+        exitWithMessage("Game server doesn't stream to spectators in this protocol version");
+    }
+    printf("INFO:\tSubscribed to %s:%d as %s\n", SERVER_ADDRESS, SERVER_PORT_NUMBER, RELAY_NAME);
+}
+
+/**
+ * Opens the socket spectators connect to
+ */
+int startListening() {
+    struct sockaddr_in address;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    if (sock == -1) exitWithMessage("Unable to create a socket");
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons((uint16_t) LISTEN_PORT);
+    if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0) exitWithMessage("Unable to bind relay");
+    if (listen(sock, 64) < 0) exitWithMessage("Unable to listen");
+    printf("INFO:\tWaiting for spectators on port %d\n", LISTEN_PORT);
+    return sock;
+}
+
+/**
+ * Relay loop: one poll over the game server, the listening socket and the viewers
+ * Everything which arrived from the server in one read is sent on to the viewers as one batch
+ */
+void runRelay() {
+    struct pollfd fds[MAX_VIEWERS + 2];
+    int slots[MAX_VIEWERS + 2];
+    char *payload;
+    size_t payloadLength;
+    int frameState;
+
+    while (true) {
+        int timeout = dropSilentViewers();
+        int fdCount = 0;
+        fds[fdCount].fd = upstream;
+        fds[fdCount++].events = POLLIN;
+        fds[fdCount].fd = listenSock;
+        fds[fdCount++].events = POLLIN;
+        for (int i = 0; i < MAX_VIEWERS; i++) {
+            if (viewers[i] == NULL) continue;
+            fds[fdCount].fd = viewers[i]->sock;
+            // Viewers with a backlog are also woken when their socket can take more
+            fds[fdCount].events = (short) (POLLIN | (viewers[i]->backlog.length > 0 ? POLLOUT : 0));
+            slots[fdCount++] = i;
+        }
+        if (poll(fds, (nfds_t) fdCount, timeout) < 0) {
+            if (errno == EINTR) continue;
+            exitWithMessage("poll failed");
+        }
+
+        if (fds[0].revents) {
+            ssize_t readSize = frameStreamRead(&upstreamStream, upstream);
+            if (readSize == 0) exitWithMessage("Game server closed the connection");
+            if (readSize < 0) exitWithMessage("Failed to communicate with the game server");
+            while ((frameState = frameStreamNext(&upstreamStream, &payload, &payloadLength)) > 0) {
+                handleUpstreamFrame(payload, payloadLength);
+            }
+            if (frameState < 0) exitWithMessage("Received malformed frame from the game server");
+            sendBatch();
+        }
+        if (fds[1].revents) {
+            acceptViewer();
+        }
+        for (int i = 2; i < fdCount; i++) {
+            viewer_t *viewer = viewers[slots[i]];
+            if (!fds[i].revents || viewer == NULL) continue;
+            if ((fds[i].revents & POLLIN) && !readViewer(viewer)) {
+                dropViewer(slots[i], "Spectator disconnected");
+            } else if ((fds[i].revents & POLLOUT) && !frameBufferSend(&viewer->backlog, viewer->sock, NULL, 0)) {
+                dropViewer(slots[i], "Lost connection with spectator");
+            } else if (fds[i].revents & (POLLERR | POLLHUP)) {
+                dropViewer(slots[i], "Lost connection with spectator");
+            }
+        }
+    }
+}
+
+/**
+ * Updates the relay's copy of the game with a frame from the server and queues it for the viewers
+ */
+void handleUpstreamFrame(char *payload, size_t length) {
+    packetReader_t reader;
+    packetReaderInit(&reader, payload, length);
+    switch (packetType(payload, length)) {
+        case START: {
+            // New game (or the server synced the relay again), every viewer has to be synced too
+            startPacket_t start;
+            if (length > sizeof(startPacket) || !decodeStart(&reader, &start, PROTOCOL_VERSION) ||
+                start.width <= 0 || start.height <= 0) {
+                break;
+            }
+            char *tiles = calloc((size_t) start.width, (size_t) start.height);
+            if (tiles == NULL) exitWithMessage("Map is too large");
+            free(gameMap);
+            gameMap = tiles;
+            mapWidth = start.width;
+            mapHeight = start.height;
+            memcpy(startPacket, payload, length);
+            startLength = length;
+            mapKnown = false;
+            syncValid = false;
+            game++;
+            // Frames of the previous game which are still queued are useless now
+            snapshot.length = 0;
+            if (debugLevel >= VERBOSE) printf("VERBOSE:\tGame %u started, map %dx%d\n", game, mapWidth, mapHeight);
+            break;
+        }
+        case MAP:
+            if (gameMap != NULL && decodeCompactMap(&reader, mapWidth, mapHeight, gameMap)) {
+                mapKnown = true;
+                syncValid = false;
+            }
+            break;
+        case MAP_DELTA: {
+            tileChange_t change;
+            int changeCount;
+            if (gameMap == NULL || !decodeMapDeltaBegin(&reader, &changeCount)) break;
+            for (int i = 0; i < changeCount && decodeTileChange(&reader, &change); i++) {
+                if (change.x >= 0 && change.y >= 0 && change.x < mapWidth && change.y < mapHeight) {
+                    gameMap[change.y * mapWidth + change.x] = (char) change.tile;
+                }
+            }
+            syncValid = false;
+            forwardFrame(&snapshot, payload, length);
+            break;
+        }
+        case PLAYERS:
+        case SCORE:
+            forwardFrame(&snapshot, payload, length);
+            break;
+        case JOINED: {
+            joinedPacket_t joined;
+            if (decodeJoined(&reader, &joined) && joined.id >= 0 && joined.id < MAX_PLAYER_ID) {
+                memcpy(playerNames[joined.id], joined.name, sizeof(playerNames[joined.id]));
+            }
+            forwardFrame(&events, payload, length);
+            break;
+        }
+        case PLAYER_DISCONNECTED: {
+            playerIdPacket_t disconnected;
+            if (decodePlayerId(&reader, PLAYER_DISCONNECTED, &disconnected) &&
+                disconnected.id >= 0 && disconnected.id < MAX_PLAYER_ID) {
+                playerNames[disconnected.id][0] = '\0';
+            }
+            forwardFrame(&events, payload, length);
+            break;
+        }
+        case MESSAGE:
+        case END:
+            forwardFrame(&events, payload, length);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Queues a frame received from the server as it is
+ */
+void forwardFrame(frameBuffer_t *buffer, char *payload, size_t length) {
+    char *frame = frameBufferBegin(buffer, length);
+    if (frame == NULL) exitWithMessage("Failed to allocate relay buffers");
+    memcpy(frame, payload, length);
+    frameBufferEnd(buffer, length);
+}
+
+/**
+ * Sends the queued frames to every viewer. A viewer which hasn't taken the previous batch yet skips this one
+ * and gets START and the full MAP once its backlog drains, like spectators of the server
+ */
+void sendBatch() {
+    for (int i = 0; i < MAX_VIEWERS; i++) {
+        viewer_t *viewer = viewers[i];
+        if (viewer == NULL || !viewer->joined) continue;
+        if (viewer->backlog.length > 0 && !frameBufferSend(&viewer->backlog, viewer->sock, NULL, 0)) {
+            dropViewer(i, "Lost connection with spectator");
+            continue;
+        }
+        if (viewer->backlog.length > 0) {
+            viewer->game = 0;
+            continue;
+        }
+
+        struct iovec frames[3];
+        int frameCount = 0;
+        if (events.length > 0) {
+            frames[frameCount].iov_base = events.data;
+            frames[frameCount++].iov_len = events.length;
+        }
+        if (viewer->game != game && mapKnown && buildSync()) {
+            frames[frameCount].iov_base = syncFrames.data;
+            frames[frameCount++].iov_len = syncFrames.length;
+            viewer->game = game;
+        }
+        if (viewer->game == game && game != 0 && snapshot.length > 0) {
+            frames[frameCount].iov_base = snapshot.data;
+            frames[frameCount++].iov_len = snapshot.length;
+        }
+        if (!frameBufferSend(&viewer->backlog, viewer->sock, frames, frameCount)) {
+            dropViewer(i, "Lost connection with spectator");
+        }
+    }
+    events.length = 0;
+    snapshot.length = 0;
+}
+
+/**
+ * Builds START and the full compact MAP of the current map unless they are up to date
+ */
+bool buildSync() {
+    if (syncValid) return true;
+    size_t mapPacketSize = PACKET_TYPE_SIZE + (size_t) mapWidth * mapHeight;
+    packetWriter_t writer;
+    syncFrames.length = 0;
+    char *frame = frameBufferBegin(&syncFrames, startLength);
+    if (frame == NULL) return false;
+    memcpy(frame, startPacket, startLength);
+    frameBufferEnd(&syncFrames, startLength);
+    if ((frame = frameBufferBegin(&syncFrames, mapPacketSize)) == NULL) return false;
+    packetWriterInit(&writer, frame, mapPacketSize);
+    if (!encodeCompactMap(&writer, gameMap, mapWidth, mapHeight, mapWidth)) return false;
+    frameBufferEnd(&syncFrames, writer.length);
+    syncValid = true;
+    return true;
+}
+
+/**
+ * Accepts a spectator, it is answered when its JOIN arrives
+ */
+void acceptViewer() {
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    int sock = accept(listenSock, (struct sockaddr *) &address, &addressLength);
+    if (sock < 0) return;
+
+    int slot = -1;
+    for (int i = 0; i < MAX_VIEWERS && slot < 0; i++) {
+        if (viewers[i] == NULL) slot = i;
+    }
+    viewer_t *viewer = slot >= 0 ? malloc(sizeof(viewer_t)) : NULL;
+    if (viewer == NULL) {
+        close(sock);
+        return;
+    }
+    viewer->sock = sock;
+    viewer->ip = address.sin_addr;
+    viewer->joined = false;
+    viewer->joinDeadline = clockMs() + JOIN_TIMEOUT;
+    viewer->game = 0;
+    frameStreamInit(&viewer->recvStream, MAX_PACKET_SIZE);
+    frameBufferInit(&viewer->backlog);
+    viewers[slot] = viewer;
+    if (debugLevel >= VERBOSE) printf("VERBOSE:\tConnection accepted from %s\n", inet_ntoa(address.sin_addr));
+}
+
+/**
+ * Reads from a viewer, the first frame has to be JOIN. Returns false if the viewer has to be dropped
+ */
+bool readViewer(viewer_t *viewer) {
+    char *payload;
+    size_t payloadLength;
+    if (frameStreamRead(&viewer->recvStream, viewer->sock) <= 0) return false;
+    if (viewer->joined) {
+        // Spectators don't play, anything they send (QUIT) is read away
+        viewer->recvStream.length = 0;
+        viewer->recvStream.offset = 0;
+        return true;
+    }
+    int frameState = frameStreamNext(&viewer->recvStream, &payload, &payloadLength);
+    if (frameState == 0) return true;
+    return frameState > 0 && joinViewer(viewer, payload, payloadLength);
+}
+
+/**
+ * Answers JOIN with ACK and the names of the players. Only spectators speaking the server's protocol
+ * version can attach, since the frames are forwarded as they are
+ */
+bool joinViewer(viewer_t *viewer, char *payload, size_t length) {
+    char packet[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    packetReader_t reader;
+    joinPacket_t join;
+    frameBuffer_t names;
+
+    packetReaderInit(&reader, payload, length);
+    if (!decodeJoin(&reader, &join)) return false;
+    // Spectators of the relay have no session to resume
+    ackPacket_t ack = {0, PROTOCOL_VERSION, CAP_SPECTATOR | CAP_COMPACT_MAP, 0};
+    if (!(join.capabilities & CAP_SPECTATOR) || join.version < PROTOCOL_VERSION) {
+        // Players have to connect to the game server
+        ack.id = ERROR_OTHER;
+    }
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeAck(&writer, &ack);
+    if (frameSend(viewer->sock, packet, writer.length) < 0 || ack.id < 0) return false;
+
+    frameBufferInit(&names);
+    for (int i = 0; i < MAX_PLAYER_ID; i++) {
+        if (playerNames[i][0] == '\0') continue;
+        joinedPacket_t joined;
+        joined.id = i;
+        memcpy(joined.name, playerNames[i], sizeof(joined.name));
+        char *frame = frameBufferBegin(&names, MAX_PACKET_SIZE);
+        if (frame == NULL) break;
+        packetWriterInit(&writer, frame, MAX_PACKET_SIZE);
+        encodeJoined(&writer, &joined);
+        frameBufferEnd(&names, writer.length);
+    }
+    struct iovec iov = {names.data, names.length};
+    bool sent = frameBufferSend(&viewer->backlog, viewer->sock, &iov, names.length > 0 ? 1 : 0);
+    frameBufferFree(&names);
+
+    viewer->joined = true;
+    printf("INFO:\tNew spectator %.*s from %s\n", MAX_NICK_SIZE, join.name, inet_ntoa(viewer->ip));
+    return sent;
+}
+
+/**
+ * Disconnects and frees a viewer
+ */
+void dropViewer(int slot, char *reason) {
+    viewer_t *viewer = viewers[slot];
+    printf("INFO: %s: %s\n", inet_ntoa(viewer->ip), reason);
+    viewers[slot] = NULL;
+    close(viewer->sock);
+    frameStreamFree(&viewer->recvStream);
+    frameBufferFree(&viewer->backlog);
+    free(viewer);
+}
+
+/**
+ * Drops viewers which didn't send JOIN in JOIN_TIMEOUT
+ * Returns the poll timeout until the next deadline, -1 if no viewer is waiting for JOIN
+ */
+int dropSilentViewers() {
+    uint64_t now = clockMs();
+    int timeout = -1;
+    for (int i = 0; i < MAX_VIEWERS; i++) {
+        if (viewers[i] == NULL || viewers[i]->joined) continue;
+        if (viewers[i]->joinDeadline <= now) {
+            dropViewer(i, "No JOIN received in time");
+        } else if (timeout < 0 || viewers[i]->joinDeadline - now < (uint64_t) timeout) {
+            timeout = (int) (viewers[i]->joinDeadline - now);
+        }
+    }
+    return timeout;
+}
+
+/**
+ * Returns monotonic clock time in miliseconds
+ */
+uint64_t clockMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
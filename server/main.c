@@ -7,17 +7,36 @@
  * 23.12.2016
  */
 
+#define _GNU_SOURCE // accept4, pipe2
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <linux/sockios.h>
+
+#include "framing.h"
+#include "protocol.h"
+#include "mapfile.h"
 
 #ifdef WIN32
 #include <windows.h>
@@ -29,18 +48,23 @@
 #include <unistd.h> // for usleep
 #endif
 
-#define MAX_PLAYERS 16
+#define MAX_PLAYERS 16                        // Connected players
+#define MAX_BOTS 224                          // Server controlled players (-b), their slots follow the MAX_PLAYERS ones
+#define MAX_SLOTS (MAX_PLAYERS + MAX_BOTS)    // Slots in playerData
 #define MAX_PACKET_SIZE 1472
-#define PACKET_TYPE_SIZE 1
-#define MAX_NICK_SIZE 20
-#define MAX_MAP_HEIGHT 100
-#define MAX_MAP_WIDTH 100
+#define PLAYERS_PACKET_SIZE (PLAYERS_HEADER_SIZE + MAX_SLOTS * PLAYER_ENTRY_SIZE)
+#define SCORE_PACKET_SIZE (PACKET_TYPE_SIZE + sizeof(int) + MAX_SLOTS * SCORE_ENTRY_SIZE)
+#define SEND_QUEUE_LIMIT ((MAX_PACKET_SIZE + FRAME_HEADER_SIZE) * 64) // Bytes of queued frames a client may have before it is dropped
+#define MAX_SPECTATORS 1024                   // Connected spectators (CAP_SPECTATOR), they don't count as players
+#define BROADCAST_EVENTS_SIZE (64 * 1024)     // Bytes of JOINED/MESSAGE/... frames held for spectators until the next tick
+#define BROADCAST_BUFFERS 3                   // Published ticks: the last one, one spectatorSender is sending and one being built
+#define SPECTATOR_NICE 10                     // Nice value of the spectatorSender thread, players' threads run first
 #define MIN_PLAYERS 2
-#define TICK_FREQUENCY 50                   // Time between ticks in miliseconds
 #define GHOST_RATIO 1                         // Ratio of ghosts per one pacman
 #define PACMAN_RATIO 2                        // Ratio of Pacmans per one ghost
 #define SPAWNPOINT_TRAVERSAL_RANGE 5          // Nearby blocks to be checked for enemies when spawning
-#define TICK_MOVEMENT 0.5f                    // Player movement per each tick
+#define MAP_WATCH_DELAY 200                   // Miliseconds without MAPDIR changes before changed maps are loaded
+#define MAP_WATCH_BATCH 64                    // Changed files loaded at once, even if MAPDIR keeps changing
 #define DOT_POINTS 10                         // Points given for encountering DOT tole
 #define SCORE_POINTS 100                      // Points given for encountering SCORE tile
 #define POWERUP_PowerPellet_TICKS 120         // Ticks before PowerPellet expires
@@ -50,40 +74,38 @@
 #define SCORE_PACMAN_KILL 1                   // Score Pacman gets for killing Ghost
 #define POWERUP_PowerPellet_SPAWN_TICKS 500      // Amount of ticks between spawning powerPellet
 #define POWERUP_Invincibility_SPAWN_TICKS 250    // Amount of ticks between spawning Invincibility
+#define BOT_FLEE_DISTANCE 6                   // Pacman bots run from Ghosts closer than this many steps
+#define AOI_RADIUS 50                         // Players this close (tiles on both axes) are in every PLAYERS packet, half the client's view
+#define AOI_SIGHT_RANGE 100                   // Players up to this far are also in every packet while no wall is between them
+#define AOI_FAR_INTERVAL 10                   // Ticks between updates of the other players (CAP_AREA_OF_INTEREST)
+#define AOI_CELL_SIZE 16                      // Tiles per side of an interestGrid cell
+#define PING_INTERVAL 1000                    // Miliseconds between PING packets, also the throughput measuring window
+#define MAX_SEND_INTERVAL 8                   // Most ticks between the snapshots of a client which can't keep up
+#define RATE_BACKOFF_QUEUE 2                  // Snapshots waiting in the socket buffer before the snapshot rate is lowered
+#define RATE_BACKOFF_DELAY 200                // Round trip time (ms) above the client's fastest one before the rate is lowered
+#define RATE_HOLD_TIME 500                    // Miliseconds after lowering the rate before it is lowered again
+#define RATE_RECOVER_TIME 2000                // Miliseconds of a drained socket buffer per step back towards the full rate
+#define MAP_CHUNKS_PER_FLUSH 4                // MAP_CHUNK packets playerSender adds to a snapshot while a map transfer runs
+#define RESUME_GRACE 10000                    // Miliseconds a dropped player's slot is kept for it to resume (PROTOCOL_VERSION_RESUME)
+#define MAX_ACCEPTORS 16                      // Accept loops (-a), each has its own SO_REUSEPORT listening socket
+#define DEFAULT_ACCEPTORS 4
+#define DEFAULT_LISTEN_QUEUE 1024             // Connections waiting in each listening socket (-q), capped by net.core.somaxconn
+#define JOIN_TIMEOUT 5000                     // Miliseconds a new connection has to send JOIN, then it is closed
+#define MAX_PENDING_JOINS 4096                // Connections waiting for JOIN at once, newer ones are closed
+#define SPARE_CLIENT_RECORDS 256              // Client records for connections between JOIN and ACK and for resumes
+#define MAX_CLIENT_RECORDS (MAX_PLAYERS + MAX_SPECTATORS + SPARE_CLIENT_RECORDS) // Records in clientPool
+#define SCRATCH_ALIGN _Alignof(max_align_t)   // Alignment of every tickArena allocation, same as malloc's
+#define HANDOFF_MAGIC 0x4c535031               // "LSP1", starts the hello of a process taking over (-u)
+#define HANDOFF_VERSION 4                     // Layout of the handed over state, processes only hand over to the same one
+#define HANDOFF_CHUNK (32 * 1024)             // Bytes of state per message on the handoff socket
+#define HANDOFF_FD_BATCH 200                  // Descriptors per SCM_RIGHTS message, the kernel takes at most 253
+#define SERVER_CAPABILITIES (CAP_COMPACT_MAP | CAP_MAP_CACHE | CAP_SPECTATOR | CAP_AREA_OF_INTEREST) // Capabilities (protocol.h) the server offers in ACK
 
 /*
  * Enumerations
  * http://en.cppreference.com/w/c/language/enum
+ * Packet, map object, movement and player enumerations are shared with the client (protocol.h)
  */
-enum connectionError_t {
-    ERROR_NAME_IN_USE = -1, ERROR_SERVER_FULL = -2
-};
-
-// Packet type enumerations
-enum packet_t {
-    JOIN, ACK, START, END, MAP, PLAYERS, SCORE, MOVE, MESSAGE, QUIT, JOINED, PLAYER_DISCONNECTED
-};
-
-
-//Map object enumerations
-enum mapObjecT_t {
-    None, Dot, Wall, PowerPellet, Invincibility, Score
-};
-
-// Client movement enumerations
-enum clientMovement_t {
-    UP, DOWN, RIGHT, LEFT
-};
-
-// Player state enumerations
-enum playerState_t {
-    NORMAL, DEAD, powerupPowerPellet = 3, powerupInvincibility = 4
-};
-// Player type enumerations
-enum playerType_t {
-    Pacman, Ghost
-};
-
 //Debug level enumerations
 enum debugLevel_t {
     INFO, VERBOSE, DEBUG
@@ -94,111 +116,495 @@ enum debugLevel_t {
  */
 typedef struct clientInfo clientInfo_t;
 
+typedef uint32_t clientHandle_t;            // Generation (high 16 bits) and index of a clientPool record, never 0
+
+typedef struct mapList mapList_t;
+
+typedef struct pendingJoin pendingJoin_t;
+
+typedef struct handoffHello handoffHello_t;
+
 void exitWithMessage(char error[]);
 
 void *handle_connection(void *);
 
+void finishHandshake(void *);
+
+void startPlayer(clientInfo_t *);
+
 void processArgs(int argc, char *argv[]);
 
 void *safeMalloc(size_t);
 
+
+void freeBuffer(void *);
+
 int startServer();
 
+void *acceptConnections(void *);
+
+void queueHandshake(int, struct in_addr);
+
+void *joinHandshaker(void *);
+
+void startConnection(pendingJoin_t *);
+
+void *handoffListener(void *);
+
+void initHandoffHello(handoffHello_t *);
+
+bool sendHandoff(int, const char *, size_t);
+
+bool receiveHandoff(int, char *, size_t);
+
+bool sendDescriptors(int, const int *, int);
+
+bool receiveDescriptors(int, int *, int);
+
+bool handOff(int);
+
+void takeOver();
+
 void initPacket(char *, ssize_t *);
 
+void sendPacket(char *, ssize_t, clientInfo_t *);
+
+void sendPacketNow(char *, ssize_t, clientInfo_t *);
+
+ssize_t flushPackets(clientInfo_t *, struct iovec *, int);
+
 void sendMassPacket(char *, ssize_t, clientInfo_t *);
 
+void sendMassPacketLocked(char *, ssize_t, clientInfo_t *);
+
 clientInfo_t *initClientData(int, struct in_addr);
 
+clientInfo_t *clientFromHandle(clientHandle_t);
+
+bool retireClient(clientInfo_t *);
+
+void releaseClient(clientInfo_t *);
+
+void *scratchAlloc(size_t);
+
+void scratchReset();
+
+void resetLinkState(clientInfo_t *);
+
 void sendPlayerDisconnect(clientInfo_t *);
 
 void *gameController(void *a);
 
-void prepareStartPacket(char *, clientInfo_t *);
+ssize_t prepareStartPacket(char *, clientInfo_t *);
+
+ssize_t prepareResumePacket(char *, clientInfo_t *);
+
+void queueStartPacket(char *, ssize_t, clientInfo_t *);
+
+bool mapFitsVersion(int);
 
 void sleep_ms(int);
 
+uint64_t clockMs();
+
 unsigned int getPlayerCount();
 
+int slotPlayerId(int);
+
+const char *playerName(int);
+
+void initBots();
+
+void spawnPlayer(int, const char *);
+
+void steerBots();
+
+void computeFlowField(uint16_t *, int);
+
+enum clientMovement_t followFlowField(const uint16_t *, int, bool);
+
 void stripSpecialCharacters(int *, char *);
 
 void sendMessage(int, int, char *);
 
 void processQuit(clientInfo_t *);
 
+bool acceptMove(clientInfo_t *, const movePacket_t *);
+
+void sendPing(clientInfo_t *);
+
+void acceptPong(clientInfo_t *, const pingPacket_t *);
+
+void adaptSendRate(clientInfo_t *, size_t);
+
 void processTick(unsigned long int *);
 
-bool sameTile(clientInfo_t *, clientInfo_t *);
+void movePlayers();
+
+void updateInterestGrid(unsigned long int);
+
+int encodeNearbyPlayers(packetWriter_t *, int, unsigned long int *);
+
+bool inLineOfSight(int, int, int, int);
+
+void setMapObject(int, int, enum mapObjecT_t);
+
+void requestMapChunks(clientInfo_t *, uint64_t);
+
+bool sameTile(int, int);
 
 void threadErrorHandler(char errormsg[], int, clientInfo_t *);
 
-void debugPacket(char *, const char *, const char *);
+void debugPacket(char *, size_t, int, const char *, const char *);
 
 void initVariables();
 
 void initMaps();
 
-void addMap(FILE *, char name[256]);
+int compareFilenames(const void *, const void *);
+
+mapList_t *addMap(char *, char *);
+
+void *mapLoader(void *);
+
+void *mapWatcher(void *);
+
+void reloadMap(char *);
+
+void reloadTextSibling(const char *);
+
+void applyPendingMaps();
+
+void insertMap(mapList_t *);
+
+void unlinkMap(mapList_t *);
+
+void freeMap(mapList_t *);
+
+int mapStemLength(const char *);
+
+int compiledMapState(const char *);
 
 void sendStartPackets();
 
-void processNewPlayer(clientInfo_t *);
+clientInfo_t *processNewPlayer(clientInfo_t *);
+
+clientInfo_t *resumeClient(clientInfo_t *, uint64_t);
+
+uint64_t newResumeToken();
+
+bool suspendClient(clientInfo_t *);
+
+bool clientSuspended(clientInfo_t *);
+
+void expireSessions();
+
+void processNewSpectator(clientInfo_t *);
+
+void sendAck(clientInfo_t *, int);
 
 void *playerSender(void *);
 
 void *playerReceiver(void *);
 
+void *spectatorSender(void *);
+
+char *broadcastFrame(frameBuffer_t *, size_t);
+
+void dropSpectator(int, char *);
+
+void queueBroadcast(char *, size_t);
+
+void publishBroadcast(unsigned long int);
+
 /*
  * Structs
  */
 
 typedef struct clientInfo {                 // Holds client specific data
+    clientHandle_t handle;                  // Pool index and generation of this record, threads are given this
     int sock;                               // Client TCP socket
     int id;                                 // Client ID
     struct in_addr ip;                      // Client IP address
-    char name[20];                          // Client name
-    enum playerType_t playerType;           // Client type (initialized if active=true)
-    enum playerState_t playerState;         // Client state (initialized if active=true)
-    enum clientMovement_t clientMovement;   // Client movement (UP/DOWN/LEFT/RIGHT)
-    unsigned int powerupTick;               // Ticks before client powerup expires
-    float x;                                // x coordinates
-    float y;                                // x coordinates
-    int score;                              // Player score
-    bool active;                            // Tells if client type, state has been initialized
+    char name[MAX_NICK_SIZE + 1];           // Client name
+    int slot;                               // Index in clientArr and playerData (game state), -1 until findClientSpot
+    int protocolVersion;                    // Protocol version agreed in JOIN/ACK
+    uint32_t capabilities;                  // Capabilities agreed in JOIN/ACK
+    size_t mapChangesSent;                  // Entries of the current map change journal sent as MAP_DELTA
+    int mapChunkOffset;                     // Next tile of the MAP_CHUNK transfer, -1 while none runs. Locked by clientArrLock
+    uint64_t mapChunkHash;                  // Map of the MAP_CHUNK transfer
+    uint32_t lastMoveSequence;              // Sequence of the newest MOVE received, older ones are stale
+    uint32_t inputLag;                      // Moving average of MOVE time to arrival (miliseconds)
+    uint32_t inputLagMax;                   // Largest MOVE time to arrival seen
+    uint32_t staleInputs;                   // MOVE packets dropped as stale or duplicate
+    uint32_t pingSequence;                  // Sequence of the last PING sent
+    uint32_t pongSequence;                  // Sequence of the last PONG received, older ones are ignored
+    uint64_t nextPingTime;                  // clockMs when the next PING is due
+    int rtt;                                // Moving average of the PING round trip time (ms), -1 until the first PONG
+    int rttMin;                             // Fastest round trip seen, the rest of rtt is queueing delay
+    uint64_t bytesSent;                     // Bytes written to sock, guarded by sendLock like rtt and rttMin
+    uint64_t windowStart;                   // clockMs when the current throughput window started, 0 before the first
+    uint64_t windowDelivered;               // Bytes the client had taken at windowStart (bytesSent minus the socket queue)
+    uint32_t throughput;                    // Bytes per second the client took in the last window, 0 until measured
+    int sendInterval;                       // Ticks between snapshots, raised while the client can't keep up
+    uint64_t nextRateChange;                // clockMs before which sendInterval isn't lowered again
+    uint64_t drainedSince;                  // clockMs since the socket buffer has stayed drained, 0 while it isn't
+    uint64_t resumeToken;                   // Sent in ACK, a JOIN carrying it takes the session over after a drop, 0 if none
+    uint64_t suspendedAt;                   // clockMs when the connection dropped, 0 while connected. Locked by clientArrLock
+    bool resuming;                          // A new connection is taking the suspended session over
+    bool quitting;                          // QUIT received, the session ends with the connection
+    unsigned int spectatorGame;             // Spectators: broadcast.game they have START and the full MAP of, 0 if none
+    frameBuffer_t backlog;                  // Spectators: frames left over from a partial write
     pthread_t connection_handler_thread_id; // Thread ID of connection handler
     pthread_t packet_sndr_thread_id;        // Thread ID of packet sender
     pthread_t packet_rcv_thread_id;         // Thread ID of packet receiver
+    pthread_mutex_t writeLock;              // Serializes writes to sock, taken before sendLock
+    pthread_mutex_t sendLock;               // Guards sendQueue and sock, never held while writing
+    frameBuffer_t sendQueue;                // Frames waiting to be written together with the next tick
+    frameBuffer_t sendSpare;                // Frames being written by flushPackets, swapped with sendQueue
+    bool sendOverflow;                      // sendQueue went over SEND_QUEUE_LIMIT, the connection is shut down
+    frameStream_t recvStream;               // Reassembly buffer for frames received from the client
 } clientInfo_t;
 
+/*
+ * Client records are taken from a fixed pool and given back, never allocated or freed
+ * A record's generation changes when it is retired, so a thread still holding the handle of a removed client
+ * gets NULL from clientFromHandle instead of the record of whoever connects next
+ */
+typedef struct clientPool {
+    clientInfo_t records[MAX_CLIENT_RECORDS];
+    uint16_t generation[MAX_CLIENT_RECORDS];  // Current generation of every record, never 0
+    int freeList[MAX_CLIENT_RECORDS];         // Indexes of the records not in use
+    int freeCount;
+    pthread_mutex_t lock;                     // Mutex locking the pool, taken after clientArrLock
+} clientPool_t;
+
+/*
+ * Bump allocator for data which only lives until the next tick, reset by processTick
+ * A tick which needs more than there is gets its extra blocks from malloc, the arena is grown
+ * to the largest tick seen at the next reset, so steady ticks allocate nothing
+ */
+typedef struct scratchBlock {
+    struct scratchBlock *next;
+    max_align_t data[];
+} scratchBlock_t;
+
+typedef struct scratchArena {
+    char *data;
+    size_t size;                            // Bytes allocated in data
+    size_t used;                            // Bytes handed out from data this tick
+    size_t wanted;                          // Bytes asked for this tick, data included
+    scratchBlock_t *overflow;               // Blocks allocated this tick because data was too small
+} scratchArena_t;
+
+/*
+ * Game state of every player, indexed by clientArr slot (structure of arrays)
+ * Kept apart from clientInfo_t so processTick and the packet builders only touch these few cache lines
+ * Slots from MAX_PLAYERS on belong to bots, which have no clientArr entry
+ */
+typedef struct playerTable {
+    int id[MAX_SLOTS];                      // Client ID, copied here for the packet builders
+    float x[MAX_SLOTS];                     // x coordinates
+    float y[MAX_SLOTS];                     // y coordinates
+    int score[MAX_SLOTS];                   // Player score
+    unsigned int powerupTick[MAX_SLOTS];    // Ticks before player powerup expires
+    uint8_t state[MAX_SLOTS];               // enum playerState_t (initialized if active=true)
+    uint8_t type[MAX_SLOTS];                // enum playerType_t (initialized if active=true)
+    uint8_t movement[MAX_SLOTS];            // enum clientMovement_t (UP/DOWN/LEFT/RIGHT)
+    uint32_t moveSequence[MAX_SLOTS];       // Sequence of the last MOVE received, set together with movement
+    uint32_t ackedSequence[MAX_SLOTS];      // moveSequence in effect during the last tick, sent back in PLAYERS
+    uint32_t ackedTicks[MAX_SLOTS];         // Ticks the player has moved since ackedSequence took effect
+    bool active[MAX_SLOTS];                 // Slot is taken and its type, state have been initialized
+} playerTable_t;
+
+/*
+ * Walking distance from every tile of the current map to the nearest tile of a target set
+ * One multi-source BFS per set and tick is shared by all bots, each bot only compares its 4 neighbours
+ * The fields are taken from tickArena, they are only valid during the tick which computed them
+ */
+typedef struct flowFields {
+    size_t size;                            // Tiles of the current map
+    uint16_t *toPacman;                     // Pacmans without PowerPellet, Ghost bots go down this field
+    uint16_t *toGhost;                      // Ghosts, Pacman bots go up it to flee or down it with PowerPellet
+    uint16_t *toFood;                       // Dots, Score tiles and powerups, Pacman bots go down it
+    uint32_t *queue;                        // BFS queue, also used to pass the sources
+} flowFields_t;
+
+/*
+ * Active players bucketed by position into AOI_CELL_SIZE squares, rebuilt by processTick once the players moved
+ * playerSender only walks the cells around its player to find the ones it has to send every tick
+ */
+typedef struct interestGrid {
+    int width;                              // Cells
+    int height;
+    int *head;                              // First slot in every cell, -1 if it is empty. Taken from tickArena
+    int next[MAX_SLOTS];                    // Next slot in the same cell
+    unsigned long int tick;                 // Tick the grid was built for
+} interestGrid_t;
+
+
+/*
+ * Frames of one published tick, not changed while spectatorSender sends them
+ */
+typedef struct broadcastTick {
+    frameBuffer_t events;                   // Queued frames of the tick
+    frameBuffer_t snapshot;                 // MAP_DELTA, SCORE and PLAYERS
+    frameBuffer_t sync;                     // START and the full compact MAP, empty unless a spectator needs them
+} broadcastTick_t;
+
+/*
+ * Spectator stream, serialized once per tick by gameController and sent as it is to every spectator
+ * Ticks are built into a buffer which is neither published nor being sent, so spectatorSender writes
+ * straight from the published one without copying and neither thread waits for the other
+ */
+typedef struct broadcast {
+    frameBuffer_t queued;                   // JOINED/PLAYER_DISCONNECTED/MESSAGE/END frames waiting for the next tick
+    broadcastTick_t ticks[BROADCAST_BUFFERS];
+    int published;                          // Index of the last published tick in ticks
+    int sending;                            // Index spectatorSender is sending from, -1 while it isn't
+    unsigned long int serial;               // Increased with every publish, spectatorSender notices skipped ones
+    unsigned int game;                      // Increased with every game start
+    size_t changesSent;                     // Entries of the current map change journal sent as MAP_DELTA
+    bool syncWanted;                        // Set by spectatorSender, sync is built with the next tick
+} broadcast_t;
+
+/*
+ * Handoff (-u): a new server process takes the listening socket, the connections and the game over
+ * from the running one. Both sides are built from the same sources, records are passed as they are
+ */
+typedef struct handoffHello {           // Sent by the new process, the running one hands over only if it matches
+    uint32_t magic;
+    uint32_t version;
+    int maxPlayers;
+    int maxBots;
+    int maxSpectators;
+    size_t playerTableSize;
+} handoffHello_t;
+
+typedef struct handoffState {           // Followed by botNames, playerData, the map change journal, clients and spectators
+    bool gameStarted;
+    unsigned long int tick;
+    int botCount;
+    snapshotStamp_t tickStamp;
+    char mapFilename[FILENAME_MAX];     // MAP_CURRENT, the new process has loaded MAPDIR itself
+    uint64_t mapHash;
+    size_t changeCount;
+    int listenerCount;                  // Listening sockets, passed before the connections
+    int clientCount;
+    int spectatorCount;
+    size_t stateSize;                   // Bytes of the whole state, this record included
+} handoffState_t;
+
+typedef struct handoffClient {          // Followed by sendQueueLength queued and receivedLength received bytes
+    int id;
+    struct in_addr ip;
+    char name[MAX_NICK_SIZE + 1];
+    int slot;                           // -1 for spectators
+    int protocolVersion;
+    uint32_t capabilities;
+    size_t mapChangesSent;
+    int mapChunkOffset;
+    uint64_t mapChunkHash;
+    uint32_t lastMoveSequence;
+    uint32_t inputLag;
+    uint32_t inputLagMax;
+    uint32_t staleInputs;
+    uint64_t resumeToken;
+    uint64_t suspendedFor;              // Miliseconds the session has been suspended, 0 if its socket is passed
+    bool quitting;
+    size_t sendQueueLength;             // Frames not written yet (spectators: backlog)
+    size_t receivedLength;              // Received bytes which don't form a whole frame yet
+} handoffClient_t;
 
 typedef struct mapList {                            //Contains list of loaded maps, populated by initMaps
     char filename[FILENAME_MAX];                    //Map filename
     int width;                                      //x
     int height;                                     //y
-    char map[MAX_MAP_WIDTH][MAX_MAP_HEIGHT];        //Map during game, might change during gameplay
-    char mapDefault[MAX_MAP_WIDTH][MAX_MAP_HEIGHT]; //Map which was loded from file
+    char *map;                                      //Map during game, might change during gameplay (row-major, width*height)
+    char *mapDefault;                               //Map which was loded from file (row-major, width*height)
+    mapFile_t file;                                 //Default tiles (mapDefault) with precomputed metadata
+    uint64_t hash;                                  //mapHash of mapDefault, sent in START
+    int dotsRemaining;                              //Dots left on map, game ends when it reaches 0
+    tileChange_t *changes;                          //Journal of tiles changed during the game (map vs mapDefault)
+    size_t changeCount;                             //Entries used in changes
+    size_t changeCapacity;                          //Entries allocated in changes
     struct mapList *next;
 } mapList_t;
 
+typedef struct mapLoadJob {                         //Map files shared between mapLoader threads
+    char **filenames;                               //Files in MAPDIR
+    mapList_t **maps;                               //Loaded map for every file, NULL if it failed to load
+    int count;
+    int next;                                       //Next file to be taken by a loader
+    pthread_mutex_t lock;                           //Mutex locking next
+} mapLoadJob_t;
+
+typedef struct pendingJoin {                        //Accepted connection which hasn't sent JOIN yet
+    int sock;
+    struct in_addr ip;
+    uint64_t deadline;                              //clockMs when it is closed unless JOIN has arrived
+    frameStream_t stream;                           //Received bytes, handed over to the client record
+} pendingJoin_t;
+
+typedef struct pendingMap {                         //Map change found by mapWatcher, applied between games
+    char filename[FILENAME_MAX];
+    mapList_t *map;                                 //Loaded map, NULL if the file was removed
+    struct pendingMap *next;
+} pendingMap_t;
+
 
 /*
  * Globals
  */
-clientInfo_t *clientArr[MAX_PLAYERS];   // Array holding all player data
+clientPool_t clientPool;                // Records of every connected client, see clientFromHandle
+clientInfo_t *clientArr[MAX_PLAYERS];   // Array holding all player connection data
+playerTable_t playerData;               // Game state of clientArr players and bots, locked by clientArrLock
+char botNames[MAX_BOTS][MAX_NICK_SIZE + 1]; // Names of the bots, bot slot is MAX_PLAYERS + index
+int BOT_COUNT;                          // Bots playing together with the connected players (-b)
+flowFields_t flowFields;                // Bot pathfinding fields, only used by gameController
+scratchArena_t tickArena;               // Temporary data of the current tick, locked by clientArrLock
+interestGrid_t interestGrid;            // Players by position for filtering PLAYERS, locked by clientArrLock
+snapshotStamp_t tickStamp;              // Tick number and time of the positions in playerData, locked by clientArrLock
 pthread_mutex_t clientArrLock;          // Mutex locking clientArr
+clientInfo_t *spectatorArr[MAX_SPECTATORS]; // Connected spectators, never part of the game
+pthread_mutex_t spectatorLock;          // Mutex locking spectatorArr, taken before broadcastLock
+broadcast_t broadcast;                  // Shared spectator stream
+pthread_mutex_t broadcastLock;          // Mutex locking broadcast, taken after clientArrLock
+pthread_cond_t broadcastReady;          // Signalled when gameController publishes a tick
 int PORT;                               // Server port (-p)
 char MAPDIR[FILENAME_MAX];              // Directory containing maps (-m)
 mapList_t *MAP_HEAD;                    // Pointer to the first MAP
 bool gameStarted;                       // True if the game is in progress
 pthread_mutex_t gameStartedock;         // Mutex locking gameStarted
 mapList_t *MAP_CURRENT;                 // Pointer to the current loaded MAP
+pendingMap_t *PENDING_MAPS;             // Map changes waiting for the current game to end
+pthread_mutex_t pendingMapsLock;        // Mutex locking PENDING_MAPS
 enum debugLevel_t debugLevel;           // Holds debugging level of the server (-v/-vv)
+unsigned long int TICK;                 // Ticks of the current game, 0 between games. Changed by gameController
+int ACCEPTORS;                          // Accept loops and listening sockets (-a)
+int LISTEN_QUEUE;                       // Backlog of every listening socket (-q)
+int listenSocks[MAX_ACCEPTORS];         // Listening TCP sockets, -1 until created or taken over
+pthread_t acceptThreads[MAX_ACCEPTORS]; // Threads running acceptConnections, the first one is the main thread
+pendingJoin_t pendingJoins[MAX_PENDING_JOINS]; // Connections waiting for JOIN, served by joinHandshaker
+int pendingJoinCount;
+pthread_mutex_t pendingJoinsLock;       // Mutex locking pendingJoins, taken before clientArrLock
+int handshakeWake[2];                   // Pipe waking joinHandshaker up when a connection is queued
+int handshakesRunning;                  // handle_connection threads not finished yet, locked by pendingJoinsLock
+pthread_cond_t handshakesDone;          // Signalled when handshakesRunning drops to 0, handOff waits for it
+char HANDOFF_PATH[sizeof(((struct sockaddr_un *) 0)->sun_path)]; // Unix socket for handing the server over (-u), empty if none
 
 
 /*
  * Helper functions
  */
 
+/**
+ * Thread cleanup handler, frees a heap buffer through a pointer to it
+ */
+void freeBuffer(void *buffer) {
+    free(*(char **) buffer);
+}
+
 /**
  * Safe malloc implementation
  */
@@ -221,22 +627,160 @@ void exitWithMessage(char error[]) {
 }
 
 /**
- * Returns initialized client struct
+ * Returns the player ID of a playerData slot, IDs stay below MAX_PLAYER_ID of clients and the relay
+ * A freed slot passes its ID on, PLAYER_DISCONNECTED of the old owner is sent before JOINED of the new one
+ */
+int slotPlayerId(int slot) {
+    return slot + 1;
+}
+
+/**
+ * Returns initialized client struct taken from clientPool, NULL if every record is in use
+ * Buffers of the record (recvStream, backlog, sendQueue) are kept from its last use
  */
 clientInfo_t *initClientData(int sock, struct in_addr ip) {
-    static unsigned int CLIENT_ID_ITERATOR = 1;
     pthread_mutex_lock(&clientArrLock);
-    clientInfo_t *client = safeMalloc(sizeof(clientInfo_t));
-    client->id = CLIENT_ID_ITERATOR++;  // Player ID
+    pthread_mutex_lock(&clientPool.lock);
+    clientInfo_t *client = NULL;
+    if (clientPool.freeCount > 0) {
+        int index = clientPool.freeList[--clientPool.freeCount];
+        client = &clientPool.records[index];
+        client->handle = (clientHandle_t) clientPool.generation[index] << 16 | (clientHandle_t) index;
+    }
+    pthread_mutex_unlock(&clientPool.lock);
+    if (!client) {
+        pthread_mutex_unlock(&clientArrLock);
+        return NULL;
+    }
+    client->id = 0;                     // Player ID comes with the slot in findClientSpot
     client->sock = sock;                // Player TCP socket
     client->ip = ip;                    // Player IP address
-    client->active = false;             // Active will be set to true only when game starts and player is sent STARt packet
+    client->slot = -1;                  // Game state slot is taken in findClientSpot
+    client->protocolVersion = 0;        // Negotiated when JOIN is received
+    client->capabilities = 0;
+    client->mapChangesSent = 0;         // Set again when START is sent
+    client->mapChunkOffset = -1;        // Started by MAP_REQUEST
+    client->lastMoveSequence = 0;       // Input statistics, kept by the packet receiver
+    client->inputLag = 0;
+    client->inputLagMax = 0;
+    client->staleInputs = 0;
+    resetLinkState(client);
+    client->resumeToken = 0;            // Given to players in ACK
+    client->suspendedAt = 0;
+    client->resuming = false;
+    client->quitting = false;
+    client->spectatorGame = 0;          // Spectators are synced by spectatorSender
+    client->backlog.length = 0;
     client->packet_rcv_thread_id = 0;     // Client packet receiver thread
     client->packet_sndr_thread_id = 0;    // Client packet sender thread
+    client->sendQueue.length = 0;         // Nothing queued yet
+    client->sendSpare.length = 0;
+    client->sendOverflow = false;
+    client->recvStream.length = 0;        // Nothing received yet
+    client->recvStream.offset = 0;
+    pthread_mutex_init(&client->writeLock, NULL);
+    pthread_mutex_init(&client->sendLock, NULL);
     pthread_mutex_unlock(&clientArrLock);
     return client;
 }
 
+/**
+ * Returns the record the handle was given for, NULL once that client has been retired
+ */
+clientInfo_t *clientFromHandle(clientHandle_t handle) {
+    unsigned int index = handle & 0xFFFF;
+    clientInfo_t *client = NULL;
+    if (index >= MAX_CLIENT_RECORDS) return NULL;
+    pthread_mutex_lock(&clientPool.lock);
+    if (clientPool.generation[index] == handle >> 16) client = &clientPool.records[index];
+    pthread_mutex_unlock(&clientPool.lock);
+    return client;
+}
+
+/**
+ * Makes the handles of the client stale, the record itself stays valid until releaseClient
+ * Returns false if it had already been retired
+ */
+bool retireClient(clientInfo_t *client) {
+    unsigned int index = client->handle & 0xFFFF;
+    bool retired = false;
+    pthread_mutex_lock(&clientPool.lock);
+    if (clientPool.generation[index] == client->handle >> 16) {
+        if (++clientPool.generation[index] == 0) clientPool.generation[index] = 1;
+        retired = true;
+    }
+    pthread_mutex_unlock(&clientPool.lock);
+    return retired;
+}
+
+/**
+ * Gives the record back to clientPool, the socket has to be closed (or handed on) by the caller
+ * No other thread may use the record anymore, its buffers are kept for the next client
+ */
+void releaseClient(clientInfo_t *client) {
+    retireClient(client);
+    pthread_mutex_destroy(&client->sendLock);
+    pthread_mutex_destroy(&client->writeLock);
+    pthread_mutex_lock(&clientPool.lock);
+    clientPool.freeList[clientPool.freeCount++] = (int) (client - clientPool.records);
+    pthread_mutex_unlock(&clientPool.lock);
+}
+
+/**
+ * Returns size bytes of tickArena, valid until the next scratchReset. Called with clientArrLock held
+ */
+void *scratchAlloc(size_t size) {
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t) (SCRATCH_ALIGN - 1);
+    tickArena.wanted += size;
+    if (tickArena.used + size <= tickArena.size) {
+        void *p = tickArena.data + tickArena.used;
+        tickArena.used += size;
+        return p;
+    }
+    // Doesn't fit this tick, the arena is grown by the next reset
+    scratchBlock_t *block = safeMalloc(sizeof(scratchBlock_t) + size);
+    block->next = tickArena.overflow;
+    tickArena.overflow = block;
+    return block->data;
+}
+
+/**
+ * Frees everything taken from tickArena, called by processTick before anything of the new tick is allocated
+ */
+void scratchReset() {
+    while (tickArena.overflow) {
+        scratchBlock_t *block = tickArena.overflow;
+        tickArena.overflow = block->next;
+        free(block);
+    }
+    if (tickArena.wanted > tickArena.size) {
+        free(tickArena.data);
+        tickArena.data = safeMalloc(tickArena.wanted);
+        tickArena.size = tickArena.wanted;
+        if (debugLevel >= VERBOSE) printf("VERBOSE:\tTick arena grown to %zu bytes\n", tickArena.size);
+    }
+    tickArena.used = 0;
+    tickArena.wanted = 0;
+}
+
+/**
+ * Forgets what was measured about the client's connection, used for new and resumed connections
+ */
+void resetLinkState(clientInfo_t *client) {
+    client->pingSequence = 0;
+    client->pongSequence = 0;
+    client->nextPingTime = 0;           // First PING goes out with the first tick
+    client->rtt = -1;
+    client->rttMin = -1;
+    client->bytesSent = 0;
+    client->windowStart = 0;
+    client->windowDelivered = 0;
+    client->throughput = 0;
+    client->sendInterval = 1;           // Full rate until the connection shows it can't keep up
+    client->nextRateChange = 0;
+    client->drainedSince = 0;
+}
+
 /**
  * Returns client pointer to array or NULL if no free spots
  */
@@ -245,6 +789,16 @@ clientInfo_t *findClientSpot(clientInfo_t *client) {
     for (int i = 0; i < MAX_PLAYERS; i++) {
         if (clientArr[i] == NULL) {
             clientArr[i] = client;
+            client->slot = i;
+            client->id = slotPlayerId(i);
+            playerData.id[i] = client->id;
+            // Active will be set to true only when game starts and player is sent START packet
+            playerData.active[i] = false;
+            playerData.score[i] = 0;
+            playerData.movement[i] = UP;
+            playerData.moveSequence[i] = 0;
+            playerData.ackedSequence[i] = 0;
+            playerData.ackedTicks[i] = 0;
             pthread_mutex_unlock(&clientArrLock);
             return client;
         }
@@ -267,9 +821,20 @@ bool isNameUsed(char *name) {
         }
     }
     pthread_mutex_unlock(&clientArrLock);
+    for (int i = 0; i < BOT_COUNT; i++) {
+        if (strcmp(botNames[i], name) == 0) return true;
+    }
     return false;
 }
 
+/**
+ * Returns the name of the player in the given playerData slot
+ */
+const char *playerName(int slot) {
+    if (slot >= MAX_PLAYERS) return botNames[slot - MAX_PLAYERS];
+    return clientArr[slot] ? clientArr[slot]->name : "";
+}
+
 /**
  * Initializes empty packet and bufferPointer
  */
@@ -279,34 +844,123 @@ void initPacket(char *buffer, ssize_t *bufferPointer) {
 }
 
 /**
- * Receives data from buffer, received data is stored in buffer
+ * Receives the next frame from the client, received data is stored in buffer
+ * Frames are reassembled from the client stream, one recv may return several frames or only a part of one
  */
 void receivePacket(char *buffer, ssize_t *bufferPointer, clientInfo_t *client) {
+    char *payload;
+    size_t payloadLength;
+    int frameState;
     initPacket(buffer, bufferPointer);
-    *bufferPointer = recv(client->sock, buffer, MAX_PACKET_SIZE, 0);
-    if (*bufferPointer <= 0) threadErrorHandler("Lost connection with player", 10, client);
+    while ((frameState = frameStreamNext(&client->recvStream, &payload, &payloadLength)) == 0) {
+        // Receivers may only be cancelled (handOff) while they wait for data
+        int cancelState;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cancelState);
+        ssize_t readSize = frameStreamRead(&client->recvStream, client->sock);
+        pthread_setcancelstate(cancelState, NULL);
+        if (readSize <= 0)
+            threadErrorHandler("Lost connection with player", 10, client);
+    }
+    // The stream refuses frames over MAX_PACKET_SIZE, so nothing is buffered for a larger header
+    if (frameState < 0) threadErrorHandler("Received malformed frame", 11, client);
+    memcpy(buffer, payload, payloadLength);
+    *bufferPointer = (ssize_t) payloadLength;
     if (debugLevel >= DEBUG) {
-        debugPacket(buffer, __func__, strerror(errno));
+        debugPacket(buffer, payloadLength, client->protocolVersion, __func__, strerror(errno));
     }
 }
 
 /**
- * Sends the buffer to socket
+ * Queues the buffer as a frame for the client, it is written together with the next playerSender flush
+ * If the queue can not fit the frame, queued data is written out immediately
  */
 void sendPacket(char *buffer, ssize_t bufferPointer, clientInfo_t *client) {
+    const char *result = "queued";
+    pthread_mutex_lock(&client->sendLock);
+    size_t length = client->sendQueue.length + FRAME_HEADER_SIZE + (size_t) bufferPointer;
+    char *frame = NULL;
+    if (!client->sendOverflow && length <= SEND_QUEUE_LIMIT) {
+        frame = frameBufferBegin(&client->sendQueue, (size_t) bufferPointer);
+    }
+    if (frame) {
+        memcpy(frame, buffer, (size_t) bufferPointer);
+        frameBufferEnd(&client->sendQueue, (size_t) bufferPointer);
+    } else {
+        result = "dropped";
+        if (!client->sendOverflow) {
+            client->sendOverflow = true;
+            shutdown(client->sock, SHUT_RDWR);
+            if (debugLevel >= VERBOSE) {
+                printf("VERBOSE:\tCan't queue more frames for %s (%zu bytes queued), dropping the connection\n",
+                       client->name, client->sendQueue.length);
+            }
+        }
+    }
+    pthread_mutex_unlock(&client->sendLock);
+    if (debugLevel >= DEBUG) {
+        debugPacket(buffer, (size_t) bufferPointer, client->protocolVersion, __func__, result);
+    }
+}
 
-    write(client->sock, buffer, (size_t) bufferPointer);
+/**
+ * Writes the buffer to socket right away (after anything already queued)
+ * Used before the playerSender thread exists, i.e. ACK during the handshake
+ */
+void sendPacketNow(char *buffer, ssize_t bufferPointer, clientInfo_t *client) {
+    struct iovec iov = {buffer, (size_t) bufferPointer};
+    ssize_t written = flushPackets(client, &iov, 1);
     if (debugLevel >= DEBUG) {
-        debugPacket(buffer, __func__, strerror(errno));
+        debugPacket(buffer, (size_t) bufferPointer, client->protocolVersion, __func__,
+                    written < 0 ? strerror(errno) : "sent");
+    }
+}
+
+/**
+ * Writes queued frames followed by the given packets (each framed here) to the client with a single writev call
+ * The queue is swapped with sendSpare first, so sendPacket can go on queueing while this blocks
+ * Returns the writeAll result, -1 with errno set if the connection failed
+ */
+ssize_t flushPackets(clientInfo_t *client, struct iovec *packets, int packetCount) {
+    struct iovec iov[packetCount * 2 + 1];
+    char headers[packetCount + 1][FRAME_HEADER_SIZE];
+    int iovCount = 0;
+    pthread_mutex_lock(&client->writeLock);
+    pthread_mutex_lock(&client->sendLock);
+    frameBuffer_t queued = client->sendQueue;
+    client->sendQueue = client->sendSpare;
+    client->sendSpare = queued;
+    int sock = client->sock;
+    pthread_mutex_unlock(&client->sendLock);
+    if (queued.length > 0) {
+        iov[iovCount].iov_base = queued.data;
+        iov[iovCount++].iov_len = queued.length;
+    }
+    for (int i = 0; i < packetCount; i++) {
+        frameHeader(headers[i], packets[i].iov_len);
+        iov[iovCount].iov_base = headers[i];
+        iov[iovCount++].iov_len = FRAME_HEADER_SIZE;
+        iov[iovCount++] = packets[i];
+    }
+    ssize_t written = iovCount > 0 ? writeAll(sock, iov, iovCount) : 0;
+    client->sendSpare.length = 0;
+    if (written > 0) {
+        pthread_mutex_lock(&client->sendLock);
+        client->bytesSent += (uint64_t) written;
+        pthread_mutex_unlock(&client->sendLock);
     }
+    pthread_mutex_unlock(&client->writeLock);
+    return written;
 }
 
 
 /**
  * Debugging function which is called when packet is sent/received prints out packet type and errno
+ * Packets whose layout depends on the protocol version (START) are decoded with the client's version
  */
 
-void debugPacket(char *buffer, const char *caller, const char *errorno) {
+void debugPacket(char *buffer, size_t length, int version, const char *caller, const char *errorno) {
+    packetReader_t reader;
+    packetReaderInit(&reader, buffer, length);
     switch (buffer[0]) {
         case JOIN:
             printf("DEBUG:\t%s with type JOIN %s\n", caller, errorno);
@@ -314,11 +968,16 @@ void debugPacket(char *buffer, const char *caller, const char *errorno) {
         case ACK:
             printf("DEBUG:\t%s with type ACK %s\n", caller, errorno);
             break;
-        case START:
-            printf("DEBUG:\t%s with type START MAP(%d:%d), POS(%d:%d) %s\n", caller, (int) buffer[1],
-                   (int) buffer[2],
-                   (int) buffer[3], (int) buffer[4], errorno);
+        case START: {
+            startPacket_t start;
+            if (decodeStart(&reader, &start, version)) {
+                printf("DEBUG:\t%s with type START MAP(%d:%d), POS(%d:%d) %s\n", caller, start.width, start.height,
+                       start.x, start.y, errorno);
+            } else {
+                printf("DEBUG:\t%s with type START (malformed) %s\n", caller, errorno);
+            }
             break;
+        }
         case END:
             printf("DEBUG:\t%s with type END %s\n", caller, errorno);
             break;
@@ -361,6 +1020,21 @@ void debugPacket(char *buffer, const char *caller, const char *errorno) {
         case PLAYER_DISCONNECTED:
             printf("DEBUG:\t%s with type PLAYER_DISCONNECTED %s\n", caller, errorno);
             break;
+        case MAP_REQUEST:
+            printf("DEBUG:\t%s with type MAP_REQUEST %s\n", caller, errorno);
+            break;
+        case MAP_CHUNK:
+            printf("DEBUG:\t%s with type MAP_CHUNK %s\n", caller, errorno);
+            break;
+        case MAP_DELTA:
+            printf("DEBUG:\t%s with type MAP_DELTA %s\n", caller, errorno);
+            break;
+        case PING:
+            printf("DEBUG:\t%s with type PING %s\n", caller, errorno);
+            break;
+        case PONG:
+            printf("DEBUG:\t%s with type PONG %s\n", caller, errorno);
+            break;
         default:
             printf("DEBUG:\t%s UNKNOWN PACKET %s\n", caller, errorno);
     }
@@ -370,23 +1044,46 @@ void debugPacket(char *buffer, const char *caller, const char *errorno) {
 /**
  * Thread fatal error handler to exit gracefully
  *  Prints the error message
- *  Closes the client socket
- *  Removes the client from client list array and cleans up the memory
- *  Exits packetSender and packetReceiver threads if they have been created
- *  Exits the main client connection thread
+ *  Shuts the client socket down and retires the record, so no other thread picks the client up anymore
+ *  Removes the client from client list array
+ *  Waits for the client's other threads (packetSender, packetReceiver) to exit, then gives the record back
+ *  Exits the calling thread, which is never the packetSender
  */
 void threadErrorHandler(char errormsg[], int retval, clientInfo_t *client) {
     printf("INFO: %s: %s\n", inet_ntoa(client->ip), errormsg);
-    close(client->sock);
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (client == clientArr[i]) {
-            clientArr[i] = NULL;
-            sendPlayerDisconnect(client);
-        }
+    if (debugLevel >= VERBOSE && client->protocolVersion >= PROTOCOL_VERSION_MOVE_TIME) {
+        printf("VERBOSE:\t%s input lag %u ms (max %u ms), %u stale inputs dropped\n", client->name,
+               client->inputLag, client->inputLagMax, client->staleInputs);
+    }
+    if (debugLevel >= VERBOSE && client->rtt >= 0) {
+        printf("VERBOSE:\t%s round trip %d ms (fastest %d ms), took %u B/s, snapshot every %d ticks\n", client->name,
+               client->rtt, client->rttMin, client->throughput, client->sendInterval);
+    }
+    if (suspendClient(client)) pthread_exit(&retval);
+    // A write blocked on the socket returns, the sender exits once it sees the stale handle
+    shutdown(client->sock, SHUT_RDWR);
+    if (!retireClient(client)) pthread_exit(&retval);
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&clientArrLock);
+    if (client->slot >= 0 && client->slot < MAX_PLAYERS && clientArr[client->slot] == client) {
+        clientArr[client->slot] = NULL;
+        playerData.active[client->slot] = false;
+        sendPlayerDisconnect(client);
     }
-    if (client->packet_rcv_thread_id != 0) pthread_cancel(client->packet_rcv_thread_id);
-    if (client->packet_sndr_thread_id != 0) pthread_cancel(client->packet_sndr_thread_id);
-    free(client);
+    // Nobody joins an exiting receiver, unless handOff has already taken its thread ID to do so
+    bool detach = client->packet_rcv_thread_id != 0 && pthread_equal(self, client->packet_rcv_thread_id);
+    if (detach) client->packet_rcv_thread_id = 0;
+    pthread_mutex_unlock(&clientArrLock);
+
+    if (client->packet_rcv_thread_id != 0 && !pthread_equal(self, client->packet_rcv_thread_id)) {
+        // Receivers can only be cancelled while they wait for data
+        pthread_cancel(client->packet_rcv_thread_id);
+        pthread_join(client->packet_rcv_thread_id, NULL);
+    }
+    if (client->packet_sndr_thread_id != 0) pthread_join(client->packet_sndr_thread_id, NULL);
+    close(client->sock);
+    releaseClient(client);
+    if (detach) pthread_detach(self);
     pthread_exit(&retval);
 }
 
@@ -415,12 +1112,18 @@ int main(int argc, char *argv[]) {
 
     initVariables();
     processArgs(argc, argv);
+    srand((unsigned int) time(0)); //Seed PRNG once, powerup positions and resume tokens come from rand
     initMaps();
+    initBots();
+    // Games and connections of a server already running with the same -u go on in this process
+    if (HANDOFF_PATH[0] != '\0') takeOver();
     startServer();
     return 0;
 }
 
 void initVariables() {
+    // Writes to dropped connections fail with EPIPE instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
     // Default port
     PORT = 8888;
     // Default map directory
@@ -430,8 +1133,46 @@ void initVariables() {
     for (int i = 0; i < MAX_PLAYERS; i++) {
         clientArr[i] = NULL;
     }
+    for (int i = 0; i < MAX_SPECTATORS; i++) {
+        spectatorArr[i] = NULL;
+    }
+    memset(&broadcast, 0, sizeof(broadcast));
+    broadcast.sending = -1;
+    pthread_mutex_init(&spectatorLock, NULL);
+    pthread_mutex_init(&broadcastLock, NULL);
+    pthread_cond_init(&broadcastReady, NULL);
     MAP_HEAD = NULL;
+    PENDING_MAPS = NULL;
+    pthread_mutex_init(&pendingMapsLock, NULL);
     gameStarted = false;
+    BOT_COUNT = 0;
+    TICK = 0;
+    ACCEPTORS = DEFAULT_ACCEPTORS;
+    LISTEN_QUEUE = DEFAULT_LISTEN_QUEUE;
+    for (int i = 0; i < MAX_ACCEPTORS; i++) {
+        listenSocks[i] = -1;
+    }
+    pendingJoinCount = 0;
+    for (int i = 0; i < MAX_PENDING_JOINS; i++) {
+        frameStreamInit(&pendingJoins[i].stream, MAX_PACKET_SIZE);
+    }
+    pthread_mutex_init(&pendingJoinsLock, NULL);
+    handshakesRunning = 0;
+    pthread_cond_init(&handshakesDone, NULL);
+    // Every record is free, handles start with generation 1
+    pthread_mutex_init(&clientPool.lock, NULL);
+    clientPool.freeCount = 0;
+    for (int i = MAX_CLIENT_RECORDS - 1; i >= 0; i--) {
+        clientPool.generation[i] = 1;
+        frameStreamInit(&clientPool.records[i].recvStream, MAX_PACKET_SIZE);
+        frameBufferInit(&clientPool.records[i].backlog);
+        frameBufferInit(&clientPool.records[i].sendQueue);
+        frameBufferInit(&clientPool.records[i].sendSpare);
+        clientPool.freeList[clientPool.freeCount++] = i;
+    }
+    memset(&tickArena, 0, sizeof(tickArena));
+    HANDOFF_PATH[0] = '\0';
+    MAP_CURRENT = NULL;
 }
 
 
@@ -444,6 +1185,30 @@ void processArgs(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "-m") == 0) {
             i++;
             strcpy(MAPDIR, argv[i]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            i++;
+            BOT_COUNT = atoi(argv[i]);
+            if (BOT_COUNT < 0 || BOT_COUNT > MAX_BOTS) {
+                exitWithMessage("Bot count (-b) is out of range");
+            }
+        } else if (strcmp(argv[i], "-a") == 0) {
+            i++;
+            ACCEPTORS = atoi(argv[i]);
+            if (ACCEPTORS < 1 || ACCEPTORS > MAX_ACCEPTORS) {
+                exitWithMessage("Accept loop count (-a) is out of range");
+            }
+        } else if (strcmp(argv[i], "-q") == 0) {
+            i++;
+            LISTEN_QUEUE = atoi(argv[i]);
+            if (LISTEN_QUEUE < 1) {
+                exitWithMessage("Listen queue length (-q) is out of range");
+            }
+        } else if (strcmp(argv[i], "-u") == 0) {
+            i++;
+            if (i >= argc || strlen(argv[i]) >= sizeof(HANDOFF_PATH)) {
+                exitWithMessage("Handoff socket path (-u) is missing or too long");
+            }
+            strcpy(HANDOFF_PATH, argv[i]);
         } else if (strcmp(argv[i], "-v") == 0) {
             debugLevel = VERBOSE;
         } else if (strcmp(argv[i], "-vv") == 0) {
@@ -451,20 +1216,33 @@ void processArgs(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "-h") == 0) {
             exitWithMessage("-p [PORT] if not specified 8888\n"
                                     "-m [DIRECTORY] Directory name containing maps, default maps\n"
+                                    "-b [COUNT] Server controlled players joining every game, default 0\n"
+                                    "-a [COUNT] Accept loops, each on its own socket, default 4\n"
+                                    "-q [LENGTH] Connections queued per accept loop, default 1024\n"
+                                    "-u [PATH] Unix socket for upgrades, a server started with the same PATH takes over\n"
                                     "-v Verbose logging\n"
                                     "-vv VERY verbose logging (including packets)\n");
         }
     }
 }
 
+/**
+ * Sorts map filenames for qsort, maps are played in alphabetical order
+ */
+int compareFilenames(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
 /**
  * Reads maps from the MAPDIR directory into mapList struct list
+ * Files are loaded in parallel by mapLoader threads, maps which fail to load are skipped
  */
 void initMaps() {
 
     DIR *desc; //Directory descriptor
     struct dirent *ent;
-    FILE *open_file;
+    mapLoadJob_t job = {NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    int capacity = 0;
 
 
     //Open directory
@@ -477,120 +1255,424 @@ void initMaps() {
             continue; //We do not want to follow current and upper directory hard links
         // If the directory contains file
         if (ent->d_type == DT_REG) {
-            char filepath[FILENAME_MAX];
-            snprintf(filepath, FILENAME_MAX, "%s/%s", MAPDIR, ent->d_name);
-            // Open file
-            open_file = fopen(filepath, "r");
-            if (open_file == NULL) {
-                fprintf(stderr, "INFO:\tFailed to open %s, skipping\n", ent->d_name);
-                fclose(open_file);
-                continue;
+            if (job.count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                char **filenames = realloc(job.filenames, capacity * sizeof(char *));
+                if (!filenames) exitWithMessage("Unable to allocate map list");
+                job.filenames = filenames;
             }
-            //Pass to addMap function which tries to load file
-            addMap(open_file, ent->d_name);
-            fclose(open_file);
+            job.filenames[job.count] = safeMalloc(strlen(ent->d_name) + 1);
+            strcpy(job.filenames[job.count++], ent->d_name);
+        }
+    }
+    closedir(desc);
+    if (job.count == 0) {
+        exitWithMessage("ERROR: No maps loaded");
+    }
+    qsort(job.filenames, (size_t) job.count, sizeof(char *), compareFilenames);
+    job.maps = safeMalloc(job.count * sizeof(mapList_t *));
+
+    // A text map compiled with lsp_p1_mapc is only loaded from its compiled file, unless the text was edited since
+    bool *skipped = calloc((size_t) job.count, sizeof(bool));
+    if (!skipped) exitWithMessage("Unable to allocate map list");
+    for (int i = 0; i < job.count; i++) {
+        char compiledName[FILENAME_MAX];
+        char *key = compiledName;
+        snprintf(compiledName, FILENAME_MAX, "%.*s%s", mapStemLength(job.filenames[i]), job.filenames[i],
+                 MAP_BINARY_EXTENSION);
+        char **found = isMapBinary(job.filenames[i]) ? NULL :
+                       bsearch(&key, job.filenames, (size_t) job.count, sizeof(char *), compareFilenames);
+        if (!found) continue;
+        if (compiledMapState(job.filenames[i]) > 0) {
+            skipped[i] = true;
+            if (debugLevel >= VERBOSE) printf("VERBOSE:\tUsing %s instead of %s\n", compiledName, job.filenames[i]);
+        } else {
+            skipped[found - job.filenames] = true;
+            printf("INFO:\t%s is older than %s, loading the text map (run lsp_p1_mapc again)\n", compiledName,
+                   job.filenames[i]);
+        }
+    }
+    int kept = 0;
+    for (int i = 0; i < job.count; i++) {
+        if (skipped[i]) free(job.filenames[i]);
+        else job.filenames[kept++] = job.filenames[i];
+    }
+    job.count = kept;
+    free(skipped);
+
+    // One loader per CPU, but not more than there are files
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) threadCount = 1;
+    if (threadCount > job.count) threadCount = job.count;
+    pthread_t loaders[threadCount];
+    int started = 0;
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&loaders[i], NULL, mapLoader, &job) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        mapLoader(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(loaders[i], NULL);
+    }
+
+    //Link loaded maps in filename order
+    mapList_t **tail = &MAP_HEAD;
+    for (int i = 0; i < job.count; i++) {
+        if (job.maps[i]) {
+            *tail = job.maps[i];
+            tail = &job.maps[i]->next;
         }
+        free(job.filenames[i]);
     }
+    free(job.filenames);
+    free(job.maps);
+    pthread_mutex_destroy(&job.lock);
     if (MAP_HEAD == NULL) {
         exitWithMessage("ERROR: No maps loaded");
     }
 }
 
-void addMap(FILE *mapfile, char name[256]) {
+/**
+ * Map loading thread, takes files from the shared job until all of them are loaded
+ */
+void *mapLoader(void *jobP) {
+    mapLoadJob_t *job = (mapLoadJob_t *) jobP;
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count) break;
+
+        char filepath[FILENAME_MAX];
+        snprintf(filepath, FILENAME_MAX, "%s/%s", MAPDIR, job->filenames[i]);
+        job->maps[i] = addMap(filepath, job->filenames[i]);
+    }
+    return 0;
+}
+
+/**
+ * Loads a single map file, returns NULL (after logging the reason) if the file isn't a valid map
+ */
+mapList_t *addMap(char *filepath, char *name) {
+    mapFileError_t error;
     mapList_t *map = safeMalloc(sizeof(mapList_t));
-    // Initialize map metadata
-    map->next = NULL;
-    map->height = 0;
-    map->width = 0;
-    memset(map->map, 0, MAX_MAP_HEIGHT * MAX_MAP_WIDTH);
-    strcpy(map->filename, name);
-
-
-    if (MAP_HEAD == NULL) { // First map, point map head to it
-        MAP_HEAD = map;
-
-    } else { // Nth map, go to the end of list and append
-        mapList_t *tmp = MAP_HEAD;
-        while (tmp->next) {
-            tmp = tmp->next;
-        }
-        tmp->next = map;
-    }
-    // Reads the map data into 2D array
-    char c;
-    int x = 0;
-    int y = 0;
-    do {
-        c = getc(mapfile);
-        if (c == '\n') {
-            y++;
-            x = 0;
-        } else if (c == EOF) {
-            break;
+
+    if (!loadMapFile(filepath, &map->file, &error)) {
+        if (error.line > 0) {
+            fprintf(stderr, "INFO:\t%s:%d:%d: %s, skipping\n", filepath, error.line, error.column, error.message);
         } else {
-            c = c -
-                '0'; //The data in file are char type, but the map data should have char value of 0/1/2... not 47/48/49...
-            if (c == None || c == Dot || c == Wall || c == PowerPellet || c == Invincibility || c == Score) {
-                map->map[y][x] = c;
-                x++;
-            } else {
-                char tmp[FILENAME_MAX];
-                snprintf(tmp, FILENAME_MAX, "Incorrect character in %s (%d:%d)", map->filename, x, y);
-                exitWithMessage(tmp);
-            }
+            fprintf(stderr, "INFO:\t%s: %s, skipping\n", filepath, error.message);
         }
-    } while (c != EOF);
-    map->width = x;
-    map->height = ++y;
-    memset(map->mapDefault, 0, MAX_MAP_HEIGHT * MAX_MAP_WIDTH);
-    memcpy(map->mapDefault, map->map, MAX_MAP_HEIGHT * MAX_MAP_WIDTH);
+        free(map);
+        return NULL;
+    }
+
+    // Initialize map metadata, compiled maps already carry the hash, counts and spawn points
+    map->next = NULL;
+    map->width = map->file.width;
+    map->height = map->file.height;
+    map->changes = NULL;
+    map->changeCount = 0;
+    map->changeCapacity = 0;
+    snprintf(map->filename, FILENAME_MAX, "%s", name);
+    map->mapDefault = map->file.tiles;
+    map->map = safeMalloc((size_t) map->width * map->height);
+    memcpy(map->map, map->mapDefault, (size_t) map->width * map->height);
+    map->hash = map->file.hash;
+    map->dotsRemaining = map->file.dotCount;
+
     if (debugLevel >= VERBOSE)
         printf("VERBOSE:\tMap %s loaded, length x=%d, y=%d\n", name, map->width, map->height);
-
+    return map;
 }
 
 /**
- * Main server thread which listens to incoming connections
- * Creates a new gameController thread which controls the game process
- * If a new client connection is received a new thread (handle_connection) is created which authorizes the client and
- * creates client specific packet receiver (playerReceiver) and packet sender thread (playerSender) in which game data
- * is being sent
+ * Length of the map filename without its extension, map.txt and map.lmap are the same map
  */
-int startServer() {
-    int socket_desc, client_sock, c;
-    struct sockaddr_in server, client;
-
-    //Create socket
-    socket_desc = socket(AF_INET, SOCK_STREAM, 0);
-    // set SO_REUSEADDR on a socket to true (1):
-    int optval = 1;
-    setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval); //Allow reuse of addresses
-    if (socket_desc == -1 || optval == -1) {
-        exitWithMessage("Unable to create a socket");
-    }
-    optval = 1;
-    setsockopt(socket_desc, IPPROTO_TCP, TCP_NODELAY, (char *) &optval,
-               sizeof(optval)); //Make sure the packets aren't buffered
-    if (socket_desc == -1 || optval == -1) {
-        exitWithMessage("ERROR: Unable to create a socket");
-    }
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY; // Listen to all interfaces
-    server.sin_port = htons((uint16_t) PORT);       // Listening port
-
-    //Binds TCP
-    if (bind(socket_desc, (struct sockaddr *) &server, sizeof(server)) < 0) {
-        exitWithMessage("ERROR:\tUnable to bind server");
-        return 1;
-    }
+int mapStemLength(const char *filename) {
+    char *dot = strrchr(filename, '.');
+    return dot ? (int) (dot - filename) : (int) strlen(filename);
+}
 
-    //Listen to incoming connections
-    listen(socket_desc, 3);
+/**
+ * Compares a text map in MAPDIR with its compiled file
+ * Returns 1 if the compiled file is at least as new as the text, -1 if it is older and 0 if there is none
+ */
+int compiledMapState(const char *filename) {
+    char path[FILENAME_MAX];
+    struct stat text;
+    struct stat compiled;
+
+    snprintf(path, FILENAME_MAX, "%s/%s", MAPDIR, filename);
+    if (stat(path, &text) < 0) return 0;
+    snprintf(path, FILENAME_MAX, "%s/%.*s%s", MAPDIR, mapStemLength(filename), filename, MAP_BINARY_EXTENSION);
+    if (stat(path, &compiled) < 0) return 0;
+    if (compiled.st_mtim.tv_sec != text.st_mtim.tv_sec) return compiled.st_mtim.tv_sec > text.st_mtim.tv_sec ? 1 : -1;
+    return compiled.st_mtim.tv_nsec >= text.st_mtim.tv_nsec ? 1 : -1;
+}
+
+/**
+ * Map directory watcher thread (inotify)
+ * Changed files are collected until MAPDIR is quiet for MAP_WATCH_DELAY, then loaded on this thread
+ * and queued for gameController, so games in progress never see a half replaced map list
+ */
+void *mapWatcher(void *unused) {
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char *changed[MAP_WATCH_BATCH];
+    int changedCount = 0;
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, MAPDIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+        fprintf(stderr, "INFO:\tUnable to watch %s (%s), maps will not be reloaded\n", MAPDIR, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    if (debugLevel >= VERBOSE) printf("VERBOSE:\tWatching %s for map changes\n", MAPDIR);
+
+    while (true) {
+        struct pollfd watch = {fd, POLLIN, 0};
+        int ready = poll(&watch, 1, changedCount ? MAP_WATCH_DELAY : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ready > 0) {
+            ssize_t length = read(fd, events, sizeof(events));
+            if (length <= 0) {
+                if (length < 0 && errno == EINTR) continue;
+                break;
+            }
+            for (char *p = events; p < events + length;) {
+                struct inotify_event *event = (struct inotify_event *) p;
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->len == 0 || event->name[0] == '.' || (event->mask & IN_ISDIR)) continue;
+                bool known = false;
+                for (int i = 0; i < changedCount && !known; i++) known = strcmp(changed[i], event->name) == 0;
+                if (!known && changedCount < MAP_WATCH_BATCH) {
+                    changed[changedCount] = safeMalloc(strlen(event->name) + 1);
+                    strcpy(changed[changedCount++], event->name);
+                }
+            }
+            if (changedCount < MAP_WATCH_BATCH) continue;
+        }
+        // Directory is quiet (or the batch is full), files which are still there are loaded, others removed
+        for (int i = 0; i < changedCount; i++) {
+            reloadMap(changed[i]);
+            free(changed[i]);
+        }
+        changedCount = 0;
+    }
+    fprintf(stderr, "INFO:\tMap watcher stopped (%s)\n", strerror(errno));
+    close(fd);
+    return 0;
+}
+
+/**
+ * Loads a changed map file and queues it for applyPendingMaps
+ * Invalid files are skipped so the previous version of the map stays in the rotation
+ */
+void reloadMap(char *filename) {
+    char filepath[FILENAME_MAX];
+    struct stat info;
+    mapList_t *map = NULL;
+
+    snprintf(filepath, FILENAME_MAX, "%s/%s", MAPDIR, filename);
+    if (stat(filepath, &info) == 0) {
+        if (!S_ISREG(info.st_mode)) return;
+        if (!isMapBinary(filename)) {
+            // Text maps which are compiled are only loaded from the compiled file, an edited one replaces it
+            int state = compiledMapState(filename);
+            if (state > 0) return;
+            if (state < 0) {
+                printf("INFO:\t%s was edited after it was compiled, loading the text map (run lsp_p1_mapc again)\n",
+                       filename);
+            }
+        }
+        if ((map = addMap(filepath, filename)) == NULL) return;
+    }
+
+    pendingMap_t *pending = safeMalloc(sizeof(pendingMap_t));
+    snprintf(pending->filename, FILENAME_MAX, "%s", filename);
+    pending->map = map;
+    pthread_mutex_lock(&pendingMapsLock);
+    // Keep the order of changes, a file removed and added again must end up added
+    pendingMap_t **tail = &PENDING_MAPS;
+    while (*tail) tail = &(*tail)->next;
+    pending->next = NULL;
+    *tail = pending;
+    pthread_mutex_unlock(&pendingMapsLock);
+    if (!map && isMapBinary(filename)) reloadTextSibling(filename);
+}
+
+/**
+ * Queues the text map a removed compiled map was made from, it wasn't loaded while the compiled file was there
+ */
+void reloadTextSibling(const char *compiledName) {
+    char filename[FILENAME_MAX];
+    int stem = mapStemLength(compiledName);
+    DIR *desc = opendir(MAPDIR);
+    struct dirent *ent;
+    if (!desc) return;
+    while ((ent = readdir(desc))) {
+        if (ent->d_name[0] == '.' || isMapBinary(ent->d_name) || mapStemLength(ent->d_name) != stem ||
+            strncmp(ent->d_name, compiledName, (size_t) stem) != 0) {
+            continue;
+        }
+        snprintf(filename, FILENAME_MAX, "%s", ent->d_name);
+        if (debugLevel >= VERBOSE) printf("VERBOSE:\t%s was removed, loading %s\n", compiledName, filename);
+        reloadMap(filename);
+    }
+    closedir(desc);
+}
+
+/**
+ * Applies map changes queued by mapWatcher, called by gameController between games
+ * Both game locks are held, so the sender/receiver threads never see the list while it is changed
+ */
+void applyPendingMaps() {
+    pthread_mutex_lock(&pendingMapsLock);
+    pendingMap_t *pending = PENDING_MAPS;
+    PENDING_MAPS = NULL;
+    pthread_mutex_unlock(&pendingMapsLock);
+    if (!pending) return;
+
+    pthread_mutex_lock(&gameStartedock);
+    pthread_mutex_lock(&clientArrLock);
+    while (pending) {
+        pendingMap_t *next = pending->next;
+        mapList_t *old = NULL;
+        for (mapList_t *map = MAP_HEAD; map; map = map->next) {
+            if (strcmp(map->filename, pending->filename) == 0) old = map;
+        }
+
+        if (pending->map) {
+            insertMap(pending->map);
+            if (old) {
+                if (MAP_CURRENT == old) MAP_CURRENT = pending->map;
+                unlinkMap(old);
+                freeMap(old);
+            }
+            // A compiled map replaces the text map it was made from, a text map edited since replaces the compiled one
+            int stem = mapStemLength(pending->filename);
+            bool binary = isMapBinary(pending->filename);
+            mapList_t *map = MAP_HEAD;
+            while (map) {
+                mapList_t *following = map->next;
+                if (map != pending->map && isMapBinary(map->filename) != binary &&
+                    mapStemLength(map->filename) == stem &&
+                    strncmp(map->filename, pending->filename, (size_t) stem) == 0) {
+                    if (MAP_CURRENT == map) MAP_CURRENT = pending->map;
+                    unlinkMap(map);
+                    freeMap(map);
+                }
+                map = following;
+            }
+            printf("INFO:\tMap %s %s\n", pending->filename, old ? "reloaded" : "added");
+        } else if (old && MAP_HEAD == old && old->next == NULL) {
+            printf("INFO:\tMap %s removed, but it is the only map left, keeping it\n", pending->filename);
+        } else if (old) {
+            // old isn't the only map, so if it is the last one MAP_HEAD is another map
+            if (MAP_CURRENT == old) MAP_CURRENT = old->next ? old->next : MAP_HEAD;
+            unlinkMap(old);
+            freeMap(old);
+            printf("INFO:\tMap %s removed\n", pending->filename);
+        }
+        free(pending);
+        pending = next;
+    }
+    pthread_mutex_unlock(&clientArrLock);
+    pthread_mutex_unlock(&gameStartedock);
+}
+
+/**
+ * Inserts a map into the map list, keeping it sorted by filename (same order as initMaps)
+ */
+void insertMap(mapList_t *map) {
+    mapList_t **position = &MAP_HEAD;
+    while (*position && strcmp((*position)->filename, map->filename) <= 0) {
+        position = &(*position)->next;
+    }
+    map->next = *position;
+    *position = map;
+}
+
+/**
+ * Removes a map from the map list
+ */
+void unlinkMap(mapList_t *map) {
+    mapList_t **position = &MAP_HEAD;
+    while (*position && *position != map) {
+        position = &(*position)->next;
+    }
+    if (*position) *position = map->next;
+    map->next = NULL;
+}
+
+/**
+ * Releases a map which isn't in the map list anymore
+ */
+void freeMap(mapList_t *map) {
+    freeMapFile(&map->file);
+    free(map->map);
+    free(map->changes);
+    free(map);
+}
+
+/**
+ * Main server thread which listens to incoming connections
+ * Creates a new gameController thread which controls the game process
+ * If a new client connection is received a new thread (handle_connection) is created which authorizes the client and
+ * creates client specific packet receiver (playerReceiver) and packet sender thread (playerSender) in which game data
+ * is being sent
+ */
+int startServer() {
+    int socket_desc;
+    struct sockaddr_in server;
+
+    // Taken over from the previous server process (takeOver)
+    // Every accept loop gets its own socket, the kernel spreads new connections over them (SO_REUSEPORT)
+    for (int i = 0; i < ACCEPTORS && listenSocks[i] < 0; i++) {
+        //Create socket
+        socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+        // set SO_REUSEADDR on a socket to true (1):
+        int optval = 1;
+        setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval); //Allow reuse of addresses
+        if (socket_desc == -1 || optval == -1) {
+            exitWithMessage("Unable to create a socket");
+        }
+        optval = 1;
+        if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval) < 0) {
+            exitWithMessage("ERROR:\tUnable to share the port between accept loops");
+        }
+        optval = 1;
+        setsockopt(socket_desc, IPPROTO_TCP, TCP_NODELAY, (char *) &optval,
+                   sizeof(optval)); //Make sure the packets aren't buffered
+        if (socket_desc == -1 || optval == -1) {
+            exitWithMessage("ERROR: Unable to create a socket");
+        }
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = INADDR_ANY; // Listen to all interfaces
+        server.sin_port = htons((uint16_t) PORT);       // Listening port
+
+        //Binds TCP
+        if (bind(socket_desc, (struct sockaddr *) &server, sizeof(server)) < 0) {
+            exitWithMessage("ERROR:\tUnable to bind server");
+            return 1;
+        }
+
+        //Listen to incoming connections, a reconnect storm waits in the queue instead of being refused
+        if (listen(socket_desc, LISTEN_QUEUE) < 0) {
+            exitWithMessage("ERROR:\tUnable to listen");
+        }
+        listenSocks[i] = socket_desc;
+    }
 
 
     //Accept and incoming connection
     if (debugLevel >= INFO) printf("INFO:\tWaiting for incoming connections on port %d\n", PORT);
-    c = sizeof(struct sockaddr_in);
+    if (debugLevel >= VERBOSE) printf("VERBOSE:\t%d accept loops, queues of %d\n", ACCEPTORS, LISTEN_QUEUE);
     pthread_t thread_id;
 
     // Launch game controller thread
@@ -599,31 +1681,624 @@ int startServer() {
         return 1;
     }
 
+    // Launch spectator sender, spectators are only served by it
+    if (pthread_create(&thread_id, NULL, spectatorSender, NULL) != 0) {
+        perror("could not create thread");
+        return 1;
+    }
 
-    while ((client_sock = accept(socket_desc, (struct sockaddr *) &client, (socklen_t *) &c))) {
-        printf("INFO:\tConnection accepted from %s \n", inet_ntoa(client.sin_addr));
+    // Launch map directory watcher, the server keeps running with the loaded maps if it fails
+    if (pthread_create(&thread_id, NULL, mapWatcher, NULL) != 0) {
+        fprintf(stderr, "INFO:\tUnable to start map watcher, maps will not be reloaded\n");
+    }
+
+    // Launch handoff listener, the next server process started with -u takes over from this one
+    if (HANDOFF_PATH[0] != '\0' && pthread_create(&thread_id, NULL, handoffListener, NULL) != 0) {
+        fprintf(stderr, "INFO:\tUnable to start handoff listener, the server can't be upgraded in place\n");
+    }
 
-        clientInfo_t *currentClient = initClientData(client_sock, client.sin_addr);
+    // Launch JOIN handshake thread, accepted connections wait there until they have sent JOIN
+    if (pipe2(handshakeWake, O_NONBLOCK | O_CLOEXEC) < 0 ||
+        pthread_create(&thread_id, NULL, joinHandshaker, NULL) != 0) {
+        perror("could not create thread");
+        return 1;
+    }
 
-        //Launch player connection controller thread
-        if (pthread_create(&currentClient->connection_handler_thread_id, NULL, handle_connection,
-                           (void *) currentClient) < 0) {
+    // Main thread is the first accept loop
+    for (int i = 1; i < ACCEPTORS; i++) {
+        if (pthread_create(&acceptThreads[i], NULL, acceptConnections, (void *) (intptr_t) i) != 0) {
             perror("could not create thread");
             return 1;
         }
+    }
+    acceptThreads[0] = pthread_self();
+    acceptConnections((void *) 0);
+    return 1;
+
+}
 
+/**
+ * Accept loop of one listening socket (listenSocks), connections are passed to joinHandshaker right away
+ * Only cancelled (handOff) while waiting in accept, so a connection is never left half registered
+ */
+void *acceptConnections(void *index) {
+    int listener = listenSocks[(intptr_t) index];
+    struct sockaddr_in client;
+    socklen_t c;
+    int client_sock;
 
-        //Now join the thread , so that we dont terminate before the thread
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (true) {
+        c = sizeof(struct sockaddr_in);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        client_sock = accept4(listener, (struct sockaddr *) &client, &c, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Out of descriptors during a storm, the queue holds the rest until some are closed
+                perror("accept failed");
+                sleep_ms(TICK_FREQUENCY);
+                continue;
+            }
+            perror("accept failed");
+            return 0;
+        }
+        printf("INFO:\tConnection accepted from %s \n", inet_ntoa(client.sin_addr));
+        queueHandshake(client_sock, client.sin_addr);
     }
-    //pthread_join(thread_id, NULL);
+}
 
-    if (client_sock < 0) {
-        perror("accept failed");
-        return 1;
+/**
+ * Adds an accepted (non-blocking) connection to the ones waiting for JOIN, it has JOIN_TIMEOUT to send it
+ * Connections beyond MAX_PENDING_JOINS are closed right away
+ */
+void queueHandshake(int sock, struct in_addr ip) {
+    pthread_mutex_lock(&pendingJoinsLock);
+    if (pendingJoinCount == MAX_PENDING_JOINS) {
+        pthread_mutex_unlock(&pendingJoinsLock);
+        printf("INFO:\t%s: Too many connections waiting for JOIN\n", inet_ntoa(ip));
+        close(sock);
+        return;
     }
+    pendingJoin_t *join = &pendingJoins[pendingJoinCount++];
+    join->sock = sock;
+    join->ip = ip;
+    join->deadline = clockMs() + JOIN_TIMEOUT;
+    join->stream.length = 0;            // Buffer is kept from an earlier connection
+    join->stream.offset = 0;
+    pthread_mutex_unlock(&pendingJoinsLock);
+    // Wakes joinHandshaker up to poll the new connection too, a full pipe already does
+    char wake = 0;
+    if (write(handshakeWake[1], &wake, 1) < 0 && errno != EAGAIN) perror("handshake wakeup failed");
+}
+
+/**
+ * Handshake thread, waits for JOIN on every accepted connection with a single poll
+ * A connection which sent JOIN gets its client record and a handle_connection thread, which finds JOIN
+ * already received. Connections which close or don't send JOIN within JOIN_TIMEOUT are closed, so idle and
+ * half-open ones never hold a thread
+ */
+void *joinHandshaker(void *unused) {
+    static struct pollfd fds[MAX_PENDING_JOINS + 1];
+    char discard[64];
+
+    while (true) {
+        uint64_t now = clockMs();
+        uint64_t nextDeadline = now + JOIN_TIMEOUT;
+        pthread_mutex_lock(&pendingJoinsLock);
+        int polled = pendingJoinCount;
+        for (int i = 0; i < polled; i++) {
+            fds[i + 1].fd = pendingJoins[i].sock;
+            fds[i + 1].events = POLLIN;
+            if (pendingJoins[i].deadline < nextDeadline) nextDeadline = pendingJoins[i].deadline;
+        }
+        pthread_mutex_unlock(&pendingJoinsLock);
+        fds[0].fd = handshakeWake[0];
+        fds[0].events = POLLIN;
+        if (poll(fds, (nfds_t) polled + 1, nextDeadline > now ? (int) (nextDeadline - now) : 0) < 0) {
+            if (errno != EINTR) perror("handshake poll failed");
+            continue;
+        }
+        if (fds[0].revents) {
+            while (read(handshakeWake[0], discard, sizeof(discard)) > 0);
+        }
 
+        // Acceptors only append, the first polled entries are still the ones in fds
+        // Going backwards, a finished entry is replaced by the last one, which was either checked or not polled yet
+        now = clockMs();
+        pthread_mutex_lock(&pendingJoinsLock);
+        for (int i = polled - 1; i >= 0; i--) {
+            pendingJoin_t *join = &pendingJoins[i];
+            bool received = false;
+            bool failed = false;
+            if (fds[i + 1].revents) {
+                ssize_t readSize = frameStreamRead(&join->stream, join->sock);
+                failed = readSize == 0 || (readSize < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+                received = !failed && frameStreamReady(&join->stream);
+            }
+            if (!received && !failed && now >= join->deadline) {
+                if (debugLevel >= VERBOSE) printf("VERBOSE:\t%s sent no JOIN in time\n", inet_ntoa(join->ip));
+                failed = true;
+            }
+            if (!received && !failed) continue;
+
+            // Swapped rather than overwritten, entries past pendingJoinCount keep their buffers for reuse
+            pendingJoin_t finished = *join;
+            *join = pendingJoins[--pendingJoinCount];
+            pendingJoins[pendingJoinCount] = finished;
+            if (failed) {
+                close(finished.sock);
+            } else {
+                startConnection(&pendingJoins[pendingJoinCount]);
+            }
+        }
+        pthread_mutex_unlock(&pendingJoinsLock);
+    }
     return 0;
+}
 
+/**
+ * Creates the client record of a connection which sent JOIN and launches its handle_connection thread
+ * Called by joinHandshaker with pendingJoinsLock held, the socket becomes blocking again like the per client
+ * threads expect. The received bytes are swapped into the record, the pending join keeps the record's old buffer
+ */
+void startConnection(pendingJoin_t *join) {
+    int flags = fcntl(join->sock, F_GETFL);
+    clientInfo_t *client = NULL;
+    if (flags >= 0 && fcntl(join->sock, F_SETFL, flags & ~O_NONBLOCK) >= 0) {
+        client = initClientData(join->sock, join->ip);
+        if (!client) printf("INFO:\t%s: No free client records\n", inet_ntoa(join->ip));
+    }
+    if (!client) {
+        close(join->sock);
+        return;
+    }
+    frameStream_t spare = client->recvStream;
+    client->recvStream = join->stream;
+    join->stream = spare;
+
+    //Launch player connection controller thread
+    if (pthread_create(&client->connection_handler_thread_id, NULL, handle_connection,
+                       (void *) (uintptr_t) client->handle) != 0) {
+        perror("could not create thread");
+        close(client->sock);
+        releaseClient(client);
+    } else {
+        pthread_detach(client->connection_handler_thread_id);
+        handshakesRunning++;
+    }
+}
+
+/**
+ * Unix socket (HANDOFF_PATH) listener thread, a server process started later with the same -u connects to it
+ * The server hands itself over (handOff) and exits, if that fails it keeps running and waits for the next one
+ */
+void *handoffListener(void *unused) {
+    struct sockaddr_un address = {0};
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, HANDOFF_PATH);
+    // The path may be left by a server which crashed or by the one this process took over from
+    unlink(HANDOFF_PATH);
+    // Only this user may connect, nobody can before listen so the mode is set in between
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        chmod(HANDOFF_PATH, S_IRUSR | S_IWUSR) < 0 || listen(listener, 1) < 0) {
+        fprintf(stderr, "INFO:\tUnable to listen on %s (%s), the server can't be upgraded in place\n", HANDOFF_PATH,
+                strerror(errno));
+        if (listener >= 0) close(listener);
+        return 0;
+    }
+    if (debugLevel >= VERBOSE) printf("VERBOSE:\tWaiting for a server to hand over to on %s\n", HANDOFF_PATH);
+
+    while (true) {
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("handoff accept failed");
+            close(listener);
+            return 0;
+        }
+        struct ucred peer;
+        socklen_t peerLength = sizeof(peer);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) < 0 || peer.uid != geteuid()) {
+            printf("INFO:\tRefused handoff to a process of another user\n");
+            close(conn);
+            continue;
+        }
+        if (handOff(conn)) {
+            printf("INFO:\tHanded the server over to the new process, exiting\n");
+            exit(EXIT_SUCCESS);
+        }
+        close(conn);
+    }
+}
+
+/**
+ * Fills the hello of this build, padding is zeroed so nothing of the stack is sent along
+ */
+void initHandoffHello(handoffHello_t *hello) {
+    memset(hello, 0, sizeof(*hello));
+    hello->magic = HANDOFF_MAGIC;
+    hello->version = HANDOFF_VERSION;
+    hello->maxPlayers = MAX_PLAYERS;
+    hello->maxBots = MAX_BOTS;
+    hello->maxSpectators = MAX_SPECTATORS;
+    hello->playerTableSize = sizeof(playerTable_t);
+}
+
+/**
+ * Sends a block of state to the other server process in HANDOFF_CHUNK messages
+ */
+bool sendHandoff(int conn, const char *data, size_t length) {
+    while (length > 0) {
+        size_t chunk = length < HANDOFF_CHUNK ? length : HANDOFF_CHUNK;
+        ssize_t sent = send(conn, data, chunk, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent != (ssize_t) chunk) return false;
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Receives a block of state sent with sendHandoff
+ */
+bool receiveHandoff(int conn, char *data, size_t length) {
+    while (length > 0) {
+        size_t chunk = length < HANDOFF_CHUNK ? length : HANDOFF_CHUNK;
+        ssize_t received = recv(conn, data, chunk, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received != (ssize_t) chunk) return false;
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Passes the descriptors to the other server process (SCM_RIGHTS), HANDOFF_FD_BATCH per message
+ */
+bool sendDescriptors(int conn, const int *fds, int count) {
+    for (int offset = 0; offset < count; offset += HANDOFF_FD_BATCH) {
+        int batch = count - offset < HANDOFF_FD_BATCH ? count - offset : HANDOFF_FD_BATCH;
+        char control[CMSG_SPACE(HANDOFF_FD_BATCH * sizeof(int))] = {0};
+        struct iovec iov = {&batch, sizeof(batch)};
+        struct msghdr message = {0};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(header), fds + offset, batch * sizeof(int));
+        if (sendmsg(conn, &message, MSG_NOSIGNAL) != sizeof(batch)) return false;
+    }
+    return true;
+}
+
+/**
+ * Receives descriptors passed with sendDescriptors, they are in the order they were sent
+ */
+bool receiveDescriptors(int conn, int *fds, int count) {
+    for (int offset = 0; offset < count;) {
+        int batch = 0;
+        char control[CMSG_SPACE(HANDOFF_FD_BATCH * sizeof(int))];
+        struct iovec iov = {&batch, sizeof(batch)};
+        struct msghdr message = {0};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(conn, &message, MSG_CMSG_CLOEXEC) != sizeof(batch)) return false;
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (!header || header->cmsg_type != SCM_RIGHTS || batch <= 0 || batch > count - offset ||
+            header->cmsg_len != CMSG_LEN(batch * sizeof(int))) {
+            return false;
+        }
+        memcpy(fds + offset, CMSG_DATA(header), batch * sizeof(int));
+        offset += batch;
+    }
+    return true;
+}
+
+/**
+ * Hands the running server over to the process connected to the handoff socket
+ *      Receivers and the acceptor stop while they wait for data, then the game, the players' sends and the
+ *      spectator stream are frozen by holding their locks, so no socket is left in the middle of a frame
+ *      The state, the listening socket and the connections are sent, the sockets stay open in the new process
+ *      Clients still waiting for JOIN are dropped, they connect again. Clients whose JOIN arrived are
+ *      registered first, joinHandshaker is held off with pendingJoinsLock until the handoff is over
+ * Returns true once the new process confirmed it runs the game, otherwise everything is resumed here
+ */
+bool handOff(int conn) {
+    handoffHello_t hello;
+    handoffHello_t expected;
+    initHandoffHello(&expected);
+    struct timeval timeout = {5, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    // Fields are compared one by one, padding of the struct holds whatever the other process left there
+    if (recv(conn, &hello, sizeof(hello), 0) != sizeof(hello) ||
+        hello.magic != expected.magic || hello.version != expected.version ||
+        hello.maxPlayers != expected.maxPlayers || hello.maxBots != expected.maxBots ||
+        hello.maxSpectators != expected.maxSpectators || hello.playerTableSize != expected.playerTableSize) {
+        printf("INFO:\tRefused handoff to an incompatible server process\n");
+        return false;
+    }
+    printf("INFO:\tHanding the server over to a new process\n");
+
+    // Nothing is accepted or read from now on, connections still waiting for JOIN are dropped
+    for (int i = 0; i < ACCEPTORS; i++) {
+        pthread_cancel(acceptThreads[i]);
+        pthread_join(acceptThreads[i], NULL);
+    }
+    // No new handshakes, the running ones finish before the receivers they start are stopped
+    pthread_mutex_lock(&pendingJoinsLock);
+    while (handshakesRunning > 0) pthread_cond_wait(&handshakesDone, &pendingJoinsLock);
+    while (true) {
+        pthread_t receivers[MAX_PLAYERS];
+        int receiverCount = 0;
+        pthread_mutex_lock(&clientArrLock);
+        for (int i = 0; i < MAX_PLAYERS; i++) {
+            if (clientArr[i] && !clientArr[i]->suspendedAt && clientArr[i]->packet_rcv_thread_id != 0) {
+                receivers[receiverCount++] = clientArr[i]->packet_rcv_thread_id;
+                clientArr[i]->packet_rcv_thread_id = 0;
+            }
+        }
+        pthread_mutex_unlock(&clientArrLock);
+        if (receiverCount == 0) break;
+        for (int i = 0; i < receiverCount; i++) pthread_cancel(receivers[i]);
+        for (int i = 0; i < receiverCount; i++) pthread_join(receivers[i], NULL);
+    }
+
+    // Freeze the game and every writer
+    pthread_mutex_lock(&gameStartedock);
+    pthread_mutex_lock(&clientArrLock);
+    pthread_mutex_lock(&spectatorLock);
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (!clientArr[i]) continue;
+        pthread_mutex_lock(&clientArr[i]->writeLock);
+        pthread_mutex_lock(&clientArr[i]->sendLock);
+    }
+
+    frameBuffer_t state;
+    frameBufferInit(&state);
+    int fds[MAX_ACCEPTORS + MAX_PLAYERS + MAX_SPECTATORS];
+    int fdCount = 0;
+    uint64_t now = clockMs();
+    handoffState_t header = {0};
+    header.gameStarted = gameStarted;
+    header.tick = TICK;
+    header.botCount = BOT_COUNT;
+    header.tickStamp = tickStamp;
+    snprintf(header.mapFilename, FILENAME_MAX, "%s", MAP_CURRENT->filename);
+    header.mapHash = MAP_CURRENT->hash;
+    header.changeCount = gameStarted ? MAP_CURRENT->changeCount : 0;
+    header.listenerCount = ACCEPTORS;
+    for (int i = 0; i < ACCEPTORS; i++) {
+        fds[fdCount++] = listenSocks[i];
+    }
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (clientArr[i]) header.clientCount++;
+    }
+    for (int i = 0; i < MAX_SPECTATORS; i++) {
+        if (spectatorArr[i]) header.spectatorCount++;
+    }
+    bool stored = frameBufferAppend(&state, (char *) &header, sizeof(header)) &&
+                  frameBufferAppend(&state, (char *) botNames, BOT_COUNT * sizeof(botNames[0])) &&
+                  frameBufferAppend(&state, (char *) &playerData, sizeof(playerData)) &&
+                  frameBufferAppend(&state, (char *) MAP_CURRENT->changes, header.changeCount * sizeof(tileChange_t));
+    for (int i = 0; i < MAX_PLAYERS + MAX_SPECTATORS && stored; i++) {
+        clientInfo_t *client = i < MAX_PLAYERS ? clientArr[i] : spectatorArr[i - MAX_PLAYERS];
+        if (!client) continue;
+        handoffClient_t record = {client->id, client->ip, {0}, client->slot, client->protocolVersion,
+                                  client->capabilities, client->mapChangesSent, client->mapChunkOffset,
+                                  client->mapChunkHash, client->lastMoveSequence,
+                                  client->inputLag, client->inputLagMax, client->staleInputs, client->resumeToken,
+                                  client->suspendedAt ? now - client->suspendedAt : 0, client->quitting, 0, 0};
+        memcpy(record.name, client->name, sizeof(record.name));
+        frameBuffer_t *queued = i < MAX_PLAYERS ? &client->sendQueue : &client->backlog;
+        record.sendQueueLength = queued->length;
+        record.receivedLength = client->recvStream.length - client->recvStream.offset;
+        if (i >= MAX_PLAYERS) record.slot = -1;
+        stored = frameBufferAppend(&state, (char *) &record, sizeof(record)) &&
+                 frameBufferAppend(&state, queued->data, record.sendQueueLength) &&
+                 frameBufferAppend(&state, client->recvStream.data + client->recvStream.offset,
+                                   record.receivedLength);
+        if (!client->suspendedAt) fds[fdCount++] = client->sock;
+    }
+    if (stored) ((handoffState_t *) state.data)->stateSize = state.length;
+
+    // New process answers with a single byte once it has taken everything over
+    char confirmation = 0;
+    timeout.tv_sec = 30;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    // Header goes alone, the new process needs it to know how much follows
+    bool handedOver = stored && sendHandoff(conn, state.data, sizeof(header)) &&
+                      sendHandoff(conn, state.data + sizeof(header), state.length - sizeof(header)) &&
+                      sendDescriptors(conn, fds, fdCount) && recv(conn, &confirmation, 1, 0) == 1;
+    frameBufferFree(&state);
+    if (handedOver) return true;
+
+    // The new process failed, carry on as before
+    printf("INFO:\tHandoff failed, the server keeps running\n");
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (!clientArr[i]) continue;
+        pthread_mutex_unlock(&clientArr[i]->sendLock);
+        pthread_mutex_unlock(&clientArr[i]->writeLock);
+    }
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (clientArr[i] && !clientArr[i]->suspendedAt &&
+            pthread_create(&clientArr[i]->packet_rcv_thread_id, NULL, playerReceiver,
+                           (void *) (uintptr_t) clientArr[i]->handle) != 0) {
+            clientArr[i]->packet_rcv_thread_id = 0;
+            shutdown(clientArr[i]->sock, SHUT_RDWR); // Its sender notices
+        }
+    }
+    pthread_mutex_unlock(&spectatorLock);
+    pthread_mutex_unlock(&clientArrLock);
+    pthread_mutex_unlock(&gameStartedock);
+    pthread_mutex_unlock(&pendingJoinsLock);
+    for (int i = 0; i < ACCEPTORS; i++) {
+        if (pthread_create(&acceptThreads[i], NULL, acceptConnections, (void *) (intptr_t) i) != 0) {
+            exitWithMessage("Unable to accept connections again after a failed handoff");
+        }
+    }
+    return false;
+}
+
+/**
+ * Takes the server over from the process listening on HANDOFF_PATH, if there is one (see handOff)
+ * The game goes on with the same tick, map, players and connections. If the current map is not in MAPDIR
+ * anymore the game is ended. Any failure before the running process has been told to exit is fatal here
+ */
+void takeOver() {
+    struct sockaddr_un address = {0};
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, HANDOFF_PATH);
+    if (conn < 0) exitWithMessage("Unable to create the handoff socket");
+    if (connect(conn, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        // Nothing to take over, this is the first server
+        close(conn);
+        return;
+    }
+
+    handoffHello_t hello;
+    initHandoffHello(&hello);
+    handoffState_t header;
+    if (send(conn, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+        !receiveHandoff(conn, (char *) &header, sizeof(header))) {
+        exitWithMessage("ERROR:\tThe running server refused the handoff");
+    }
+    if (header.stateSize < sizeof(header) || header.listenerCount < 1 || header.listenerCount > MAX_ACCEPTORS ||
+        header.botCount < 0 || header.botCount > MAX_BOTS ||
+        header.clientCount < 0 || header.clientCount > MAX_PLAYERS ||
+        header.spectatorCount < 0 || header.spectatorCount > MAX_SPECTATORS) {
+        exitWithMessage("ERROR:\tReceived broken handoff state");
+    }
+    size_t remaining = header.stateSize - sizeof(header);
+    char *state = safeMalloc(remaining);
+    char *cursor = state;
+    if (!receiveHandoff(conn, state, remaining)) exitWithMessage("ERROR:\tHandoff state was cut short");
+
+    // Bots and ids of the running game, -b of this process is ignored
+    BOT_COUNT = header.botCount;
+    memcpy(botNames, cursor, BOT_COUNT * sizeof(botNames[0]));
+    cursor += BOT_COUNT * sizeof(botNames[0]);
+    memcpy(&playerData, cursor, sizeof(playerData));
+    cursor += sizeof(playerData);
+    tickStamp = header.tickStamp;
+
+    for (mapList_t *map = MAP_HEAD; map && !MAP_CURRENT; map = map->next) {
+        if (strcmp(map->filename, header.mapFilename) == 0 && map->hash == header.mapHash) MAP_CURRENT = map;
+    }
+    tileChange_t *changes = (tileChange_t *) cursor;
+    cursor += header.changeCount * sizeof(tileChange_t);
+    bool gameEnded = header.gameStarted && !MAP_CURRENT;
+    if (header.gameStarted && MAP_CURRENT) {
+        // Map journal is replayed over the default tiles, so the clients' MAP_DELTA positions stay valid
+        for (size_t i = 0; i < header.changeCount; i++) {
+            setMapObject(changes[i].x, changes[i].y, (enum mapObjecT_t) changes[i].tile);
+        }
+        gameStarted = true;
+        TICK = header.tick;
+        broadcast.game = 1;
+        broadcast.changesSent = MAP_CURRENT->changeCount;
+    } else {
+        for (int i = 0; i < MAX_SLOTS; i++) playerData.active[i] = false;
+    }
+
+    int fdCount = header.listenerCount + header.spectatorCount;
+    int fds[MAX_ACCEPTORS + MAX_PLAYERS + MAX_SPECTATORS];
+    handoffClient_t *records[MAX_PLAYERS + MAX_SPECTATORS];
+    for (int i = 0; i < header.clientCount + header.spectatorCount; i++) {
+        records[i] = (handoffClient_t *) cursor;
+        cursor += sizeof(handoffClient_t) + records[i]->sendQueueLength + records[i]->receivedLength;
+        if (i < header.clientCount && records[i]->suspendedFor == 0) fdCount++;
+        if (cursor > state + remaining || (i < header.clientCount &&
+                                           (records[i]->slot < 0 || records[i]->slot >= MAX_PLAYERS ||
+                                            records[i]->sendQueueLength > SEND_QUEUE_LIMIT))) {
+            exitWithMessage("ERROR:\tReceived broken handoff state");
+        }
+    }
+    if (!receiveDescriptors(conn, fds, fdCount)) exitWithMessage("ERROR:\tHandoff descriptors were not received");
+    // Accept loops of the old process go on here, -a of this process is ignored
+    ACCEPTORS = header.listenerCount;
+    for (int i = 0; i < ACCEPTORS; i++) {
+        listenSocks[i] = fds[i];
+    }
+
+    int fdIndex = ACCEPTORS;
+    uint64_t now = clockMs();
+    for (int i = 0; i < header.clientCount + header.spectatorCount; i++) {
+        handoffClient_t *record = records[i];
+        bool spectator = i >= header.clientCount;
+        char *queued = (char *) (record + 1);
+        int sock = spectator || record->suspendedFor == 0 ? fds[fdIndex++] : -1;
+        clientInfo_t *client = initClientData(sock, record->ip);
+        if (!client) exitWithMessage("ERROR:\tNo free client records for the handed over clients");
+        client->id = record->id;
+        memcpy(client->name, record->name, sizeof(client->name));
+        client->slot = record->slot;
+        client->protocolVersion = record->protocolVersion;
+        client->capabilities = record->capabilities;
+        client->mapChangesSent = record->mapChangesSent;
+        client->mapChunkOffset = record->mapChunkOffset;
+        client->mapChunkHash = record->mapChunkHash;
+        client->lastMoveSequence = record->lastMoveSequence;
+        client->inputLag = record->inputLag;
+        client->inputLagMax = record->inputLagMax;
+        client->staleInputs = record->staleInputs;
+        client->resumeToken = record->resumeToken;
+        client->suspendedAt = record->suspendedFor ? now - record->suspendedFor : 0;
+        client->quitting = record->quitting;
+        if (!frameStreamAppend(&client->recvStream, queued + record->sendQueueLength, record->receivedLength)) {
+            exitWithMessage("ERROR:\tFailed to allocate handed over data");
+        }
+        if (spectator) {
+            // Synced again with START and the full MAP, what the old process didn't write goes first
+            if (!frameBufferAppend(&client->backlog, queued, record->sendQueueLength)) {
+                exitWithMessage("ERROR:\tFailed to allocate handed over data");
+            }
+            spectatorArr[i - header.clientCount] = client;
+        } else {
+            if (!frameBufferAppend(&client->sendQueue, queued, record->sendQueueLength)) {
+                exitWithMessage("ERROR:\tFailed to allocate handed over data");
+            }
+            clientArr[client->slot] = client;
+        }
+    }
+    free(state);
+    if (gameEnded) {
+        char buffer[PACKET_TYPE_SIZE];
+        packetWriter_t writer;
+        packetWriterInit(&writer, buffer, sizeof(buffer));
+        encodeEnd(&writer);
+        sendMassPacket(buffer, writer.length, NULL);
+        printf("INFO:\tMap %s of the running game is gone, the game was ended\n", header.mapFilename);
+    }
+
+    // Running process exits once it gets the confirmation, from now on the connections are served here
+    char confirmation = 1;
+    if (send(conn, &confirmation, 1, MSG_NOSIGNAL) != 1) exitWithMessage("ERROR:\tHandoff was not confirmed");
+    close(conn);
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        clientInfo_t *client = clientArr[i];
+        if (!client || client->suspendedAt) continue;
+        void *handle = (void *) (uintptr_t) client->handle;
+        if (pthread_create(&client->packet_sndr_thread_id, NULL, playerSender, handle) != 0 ||
+            pthread_create(&client->packet_rcv_thread_id, NULL, playerReceiver, handle) != 0) {
+            exitWithMessage("ERROR:\tCould not create player threads");
+        }
+    }
+    printf("INFO:\tTook over %d players and %d spectators at tick %lu of map %s\n", header.clientCount,
+           header.spectatorCount, TICK, MAP_CURRENT ? MAP_CURRENT->filename : "-");
 }
 
 /**
@@ -632,12 +2307,16 @@ int startServer() {
  */
 void *gameController(void *a) {
     printf("INFO:\tGame controller started\n");
-    MAP_CURRENT = MAP_HEAD;
-    unsigned long int TICK = 0;
-    gameStarted = false;
+    // Set by takeOver when the game goes on from the previous server process
+    if (MAP_CURRENT == NULL) MAP_CURRENT = MAP_HEAD;
     while (true) {
         sleep_ms(TICK_FREQUENCY);
-        if (getPlayerCount() >= MIN_PLAYERS || gameStarted) {
+        expireSessions();
+        // Maps changed in MAPDIR are only swapped in between games
+        if (!gameStarted) applyPendingMaps();
+        // Bots fill the game up to MIN_PLAYERS, but they don't play alone
+        unsigned int playerCount = getPlayerCount();
+        if ((playerCount > 0 && playerCount + BOT_COUNT >= MIN_PLAYERS) || gameStarted) {
             if (TICK == 0) {
                 pthread_mutex_lock(&gameStartedock);
                 gameStarted = true;
@@ -647,6 +2326,7 @@ void *gameController(void *a) {
             }
             TICK += 1;
             processTick(&TICK);
+            publishBroadcast(TICK);
 
             /*
             * Check if game ending condition is met
@@ -656,24 +2336,14 @@ void *gameController(void *a) {
             */
             int ghostCount = 0;
             int pacmanCount = 0;
-            for (int i = 0; i < MAX_PLAYERS; i++) {
-                if (clientArr[i] && clientArr[i]->active && clientArr[i]->playerState != DEAD) {
-                    if (clientArr[i]->playerType == Ghost ) ghostCount++; //Count ghosts
-                    else if (clientArr[i]->playerType == Pacman) pacmanCount++; //Count pacmans
+            for (int i = 0; i < MAX_SLOTS; i++) {
+                if (playerData.active[i] && playerData.state[i] != DEAD) {
+                    if (playerData.type[i] == Ghost) ghostCount++; //Count ghosts
+                    else if (playerData.type[i] == Pacman) pacmanCount++; //Count pacmans
                 }
             }
-            //Check if there are any leftover dots
-            bool dotFound = false;
-            for (int i = 0; i < MAP_CURRENT->height; i++) {
-                for (int j = 0; j < MAP_CURRENT->width; j++) {
-                    enum mapObjecT_t mapObject = (enum mapObjecT_t) MAP_CURRENT->map[i][j];
-                    if (mapObject == Dot) {
-                        dotFound = true;
-                        break;
-                    }
-                }
-                if (dotFound) break;
-            }
+            //Check if there are any leftover dots (counted by setMapObject)
+            bool dotFound = MAP_CURRENT->dotsRemaining > 0;
 
             // CHECK FOR END GAME
             bool gameEnd = false;
@@ -702,25 +2372,30 @@ void *gameController(void *a) {
                  * Prepare END packet
                 */
                 char buffer[PACKET_TYPE_SIZE];
-                memset(buffer, 0, MAX_PACKET_SIZE);
+                packetWriter_t writer;
+                packetWriterInit(&writer, buffer, sizeof(buffer));
+                encodeEnd(&writer);
                 pthread_mutex_lock(&gameStartedock);
                 pthread_mutex_lock(&clientArrLock);
-                buffer[0] = END;
-                for (int i = 0; i < MAX_PLAYERS; i++) {
-                    if (clientArr[i] && clientArr[i]->active) {
-                        sendPacket(buffer, PACKET_TYPE_SIZE,
-                                   clientArr[i]); //Send END packet to all players which received START
-                        clientArr[i]->active = false; //Deactivate player
+                for (int i = 0; i < MAX_SLOTS; i++) {
+                    if (playerData.active[i]) {
+                        //Send END packet to all players which received START
+                        if (i < MAX_PLAYERS && !clientArr[i]->suspendedAt) sendPacket(buffer, writer.length, clientArr[i]);
+                        playerData.active[i] = false; //Deactivate player
                     }
                 }
                 pthread_mutex_unlock(&clientArrLock);
                 gameStarted = false;
                 pthread_mutex_unlock(&gameStartedock);
+                queueBroadcast(buffer, writer.length);
+                publishBroadcast(0);
 
                 //Reset ticks, map data
                 TICK = 0;
                 // Resets map tiles to default values since they have changed during game
-                memcpy(MAP_CURRENT->map, MAP_CURRENT->mapDefault, MAX_MAP_HEIGHT * MAX_MAP_WIDTH);
+                memcpy(MAP_CURRENT->map, MAP_CURRENT->mapDefault, (size_t) MAP_CURRENT->width * MAP_CURRENT->height);
+                MAP_CURRENT->changeCount = 0;
+                MAP_CURRENT->dotsRemaining = MAP_CURRENT->file.dotCount;
                 //Go to next map
                 if (MAP_CURRENT->next) {
                     MAP_CURRENT = MAP_CURRENT->next;
@@ -741,37 +2416,62 @@ void *gameController(void *a) {
  * If player was not sent START packet sends it (for late joins, when game is in progress)
  * Creates playerSender and playerReceiver threads which send and receive player data during game
  */
-void *handle_connection(void *conn) {
-    // Get the socket descriptor
-    clientInfo_t *clientInfo = (clientInfo_t *) conn;
+void *handle_connection(void *handleP) {
+    clientInfo_t *clientInfo = clientFromHandle((clientHandle_t) (uintptr_t) handleP);
+    // handOff waits for this thread, also when threadErrorHandler ends it
+    pthread_cleanup_push(finishHandshake, NULL);
+
+    // New client connection, authorize the client, a resumed session continues with its old record
+    if (clientInfo) clientInfo = processNewPlayer(clientInfo);
+    // Spectators (NULL) belong to spectatorSender from now on
+    if (clientInfo) startPlayer(clientInfo);
+
+    pthread_cleanup_pop(1);
+    return 0;
+}
 
-    // New client connection, authorize the client
-    processNewPlayer(clientInfo);
+/**
+ * Thread cleanup handler of handle_connection, counts the handshake as finished
+ */
+void finishHandshake(void *unused) {
+    pthread_mutex_lock(&pendingJoinsLock);
+    if (--handshakesRunning == 0) pthread_cond_broadcast(&handshakesDone);
+    pthread_mutex_unlock(&pendingJoinsLock);
+}
 
+/**
+ * Sends START to a player who joined or resumed during the game and starts its playerSender and playerReceiver
+ */
+void startPlayer(clientInfo_t *clientInfo) {
     // If the game had already started and the player was not processed during start we have to also send the START packet
     pthread_mutex_lock(&gameStartedock);
-    if (gameStarted && !clientInfo->active) {
+    if (gameStarted && playerData.active[clientInfo->slot]) {
+        // Resumed during the game, START puts the client back where its player is, the first tick sends the whole map
         char buffer[MAX_PACKET_SIZE] = {0};
-        prepareStartPacket(buffer, clientInfo);
+        ssize_t bufferPointer = prepareResumePacket(buffer, clientInfo);
+        queueStartPacket(buffer, bufferPointer, clientInfo);
+    } else if (gameStarted) {
+        char buffer[MAX_PACKET_SIZE] = {0};
+        ssize_t bufferPointer = prepareStartPacket(buffer, clientInfo);
         if (debugLevel >= DEBUG) printf("DEBUG:\t%s joined late, also sending START packet\n", clientInfo->name);
-        sendPacket(buffer, 5, clientInfo);
+        queueStartPacket(buffer, bufferPointer, clientInfo);
     }
     pthread_mutex_unlock(&gameStartedock);
 
     // Create seperate game handler threads for client
     // First thread - sends game data to the client (MAP/PLAYERS/SCORE)
-    if (pthread_create(&clientInfo->packet_sndr_thread_id, NULL, playerSender, (void *) clientInfo) < 0) {
+    void *handle = (void *) (uintptr_t) clientInfo->handle;
+    if (pthread_create(&clientInfo->packet_sndr_thread_id, NULL, playerSender, handle) != 0) {
+        clientInfo->packet_sndr_thread_id = 0;
         threadErrorHandler("Could not create playerSender thread", 7, clientInfo);
     }
 
 
     // Second thread for receiving messages from client (MOVE/MESSAGE/QUIT(PLAYER_DISCONNECTED))
-    if (pthread_create(&clientInfo->packet_rcv_thread_id, NULL, playerReceiver, (void *) clientInfo) < 0) {
+    if (pthread_create(&clientInfo->packet_rcv_thread_id, NULL, playerReceiver, handle) != 0) {
+        clientInfo->packet_rcv_thread_id = 0;
         threadErrorHandler("Could not create playerReceiver thread", 8, clientInfo);
     }
-
-
-    return 0;
 }
 
 /**
@@ -779,164 +2479,417 @@ void *handle_connection(void *conn) {
  *      Receives JOIN, registers player nickname if possible
  *      Sends ACK to acknowledge the new nickname or ACK with negative ID indicating that player cannot join
  *      Sends JOINED to inform other players that a new player has joined.
+ * JOIN with a resume token takes a suspended session over instead (resumeClient)
+ * Returns the client record to continue with or NULL if the client joined as a spectator (processNewSpectator)
  */
-void processNewPlayer(clientInfo_t *clientInfo) {
+clientInfo_t *processNewPlayer(clientInfo_t *clientInfo) {
     char buffer[MAX_PACKET_SIZE] = {0};
     ssize_t bufferPointer = 0;
-    /*
-     *  0 - Packet type
-     *  1-21 - Nickname
-     */
+    packetReader_t reader;
+    packetWriter_t writer;
+    joinPacket_t join;
     receivePacket(buffer, &bufferPointer, clientInfo);
     if (bufferPointer == 0) {
         threadErrorHandler("INFO:\tUnauthenticated client disconnected", 1, clientInfo);
     } else if (bufferPointer == -1) {
         threadErrorHandler("INFO:\tRecv failed", 2, clientInfo);
     }
-    if ((int) buffer[0] == JOIN) {
-        memcpy(clientInfo->name, buffer + PACKET_TYPE_SIZE, MAX_NICK_SIZE);
-        int nameSize = 20;
+    packetReaderInit(&reader, buffer, (size_t) bufferPointer);
+    if (decodeJoin(&reader, &join)) {
+        memcpy(clientInfo->name, join.name, sizeof(clientInfo->name));
+        // Agree on the protocol version and the features which both sides support
+        clientInfo->protocolVersion = join.version < PROTOCOL_VERSION ? join.version : PROTOCOL_VERSION;
+        clientInfo->capabilities = join.capabilities & SERVER_CAPABILITIES;
+        int nameSize = MAX_NICK_SIZE;
         stripSpecialCharacters(&nameSize, clientInfo->name);
+        if (clientInfo->protocolVersion >= PROTOCOL_VERSION_RESUME && join.resumeToken != 0) {
+            return resumeClient(clientInfo, join.resumeToken);
+        }
+        // Spectator stream is serialized once in the current protocol version
+        if ((clientInfo->capabilities & CAP_SPECTATOR) && clientInfo->protocolVersion == PROTOCOL_VERSION) {
+            clientInfo->capabilities = CAP_SPECTATOR | CAP_COMPACT_MAP;
+            processNewSpectator(clientInfo);
+            return NULL;
+        }
+        clientInfo->capabilities &= ~CAP_SPECTATOR;
+        if (!mapFitsVersion(clientInfo->protocolVersion)) {
+            sendAck(clientInfo, ERROR_OTHER);
+            threadErrorHandler("INFO:\tMap is too large for the client's protocol version", 13, clientInfo);
+        }
         if (isNameUsed(clientInfo->name)) {
-            initPacket(buffer, &bufferPointer);
-            buffer[0] = ACK;
-            int errval = ERROR_NAME_IN_USE;
-            memcpy(buffer + PACKET_TYPE_SIZE, &errval, sizeof(int));
-            sendPacket(buffer, 5, clientInfo);
-
+            sendAck(clientInfo, ERROR_NAME_IN_USE);
             threadErrorHandler("INFO:\tName is in use", 5, clientInfo);
         }
         if (findClientSpot(clientInfo) == NULL) {
-            initPacket(buffer, &bufferPointer);
-            buffer[0] = ACK;
-            int errval = ERROR_SERVER_FULL;
-            memcpy(buffer + PACKET_TYPE_SIZE, &errval, sizeof(int));
-            sendPacket(buffer, 5, clientInfo);
+            sendAck(clientInfo, ERROR_SERVER_FULL);
             threadErrorHandler("INFO:\tServer is full", 4, clientInfo);
         }
+        if (clientInfo->protocolVersion >= PROTOCOL_VERSION_RESUME) clientInfo->resumeToken = newResumeToken();
 
         // Everything OK, sending user ID
-        initPacket(buffer, &bufferPointer);
-        buffer[0] = ACK;
-        memcpy(buffer + PACKET_TYPE_SIZE, &clientInfo->id, sizeof(int));
-        sendPacket(buffer, sizeof(int) + PACKET_TYPE_SIZE, clientInfo);
+        sendAck(clientInfo, clientInfo->id);
 
         //Sending JOINED packet to everyone except current client
-        initPacket(buffer, &bufferPointer);
-        buffer[0] = JOINED;
-        memcpy(buffer + PACKET_TYPE_SIZE, &clientInfo->id, sizeof(int)); //Player ID
-        memcpy(buffer + PACKET_TYPE_SIZE + sizeof(int), &clientInfo->name, MAX_NICK_SIZE); //Player name
-        sendMassPacket(buffer, sizeof(int) + PACKET_TYPE_SIZE + MAX_NICK_SIZE, clientInfo);
+        joinedPacket_t joined;
+        joined.id = clientInfo->id;
+        memcpy(joined.name, clientInfo->name, sizeof(joined.name));
+        packetWriterInit(&writer, buffer, MAX_PACKET_SIZE);
+        encodeJoined(&writer, &joined);
+        sendMassPacket(buffer, writer.length, clientInfo);
+
+        //Bots never join, so the new client is told about them here
+        for (int i = 0; i < BOT_COUNT; i++) {
+            joined.id = playerData.id[MAX_PLAYERS + i];
+            memcpy(joined.name, botNames[i], sizeof(joined.name));
+            packetWriterInit(&writer, buffer, MAX_PACKET_SIZE);
+            encodeJoined(&writer, &joined);
+            sendPacket(buffer, writer.length, clientInfo);
+        }
 
 
         printf("INFO:\tNew player %s(%d) from %s\n", clientInfo->name, clientInfo->id, inet_ntoa(clientInfo->ip));
+        if (debugLevel >= VERBOSE)
+            printf("VERBOSE:\t%s speaks protocol %d, capabilities 0x%x\n", clientInfo->name,
+                   clientInfo->protocolVersion, clientInfo->capabilities);
 
 
     } else {
         threadErrorHandler("Incorrect command received", 3, clientInfo);
     }
+    return clientInfo;
+}
 
+/**
+ * Hands the suspended session with the given token over to the new connection
+ *      The old record keeps its slot, ID, score and position, only the connection is replaced
+ *      Sends ACK with the old ID and a new token, then JOINED of everyone since the client may have missed some
+ * Returns the resumed record, the new one goes back to clientPool
+ * Sends ACK with ERROR_SESSION_EXPIRED if there is no such session
+ */
+clientInfo_t *resumeClient(clientInfo_t *fresh, uint64_t token) {
+    char buffer[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    clientInfo_t *client = NULL;
+    pthread_mutex_lock(&clientArrLock);
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (clientArr[i] && clientArr[i]->resumeToken == token && clientArr[i]->suspendedAt && !clientArr[i]->resuming) {
+            client = clientArr[i];
+            client->resuming = true;  // Keeps expireSessions away
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clientArrLock);
+    if (!client) {
+        sendAck(fresh, ERROR_SESSION_EXPIRED);
+        threadErrorHandler("INFO:\tNo session to resume", 12, fresh);
+    }
+
+    // Old sender notices the suspension within a tick, nothing else writes to a suspended client
+    // Sessions suspended before a handoff (takeOver) have no sender
+    if (client->packet_sndr_thread_id != 0) pthread_join(client->packet_sndr_thread_id, NULL);
+    close(client->sock);
+    pthread_mutex_lock(&client->sendLock);
+    client->sock = fresh->sock;
+    client->ip = fresh->ip;
+    client->sendQueue.length = 0;
+    client->sendOverflow = false;
+    pthread_mutex_unlock(&client->sendLock);
+    frameStream_t spare = client->recvStream;
+    client->recvStream = fresh->recvStream;   // May already hold frames sent after JOIN
+    fresh->recvStream = spare;
+    client->protocolVersion = fresh->protocolVersion;
+    client->capabilities = fresh->capabilities & ~CAP_SPECTATOR;
+    client->mapChangesSent = 0;
+    client->quitting = false;
+    client->packet_sndr_thread_id = 0;
+    client->packet_rcv_thread_id = 0;
+    resetLinkState(client);
+    client->resumeToken = newResumeToken();
+    releaseClient(fresh);
+
+    sendAck(client, client->id);
+    // Players who joined while it was away, including the resumed player itself
+    joinedPacket_t joined;
+    pthread_mutex_lock(&clientArrLock);
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (clientArr[i]) {
+            joined.id = clientArr[i]->id;
+            memcpy(joined.name, clientArr[i]->name, sizeof(joined.name));
+            packetWriterInit(&writer, buffer, MAX_PACKET_SIZE);
+            encodeJoined(&writer, &joined);
+            sendPacket(buffer, writer.length, client);
+        }
+    }
+    for (int i = 0; i < BOT_COUNT; i++) {
+        joined.id = playerData.id[MAX_PLAYERS + i];
+        memcpy(joined.name, botNames[i], sizeof(joined.name));
+        packetWriterInit(&writer, buffer, MAX_PACKET_SIZE);
+        encodeJoined(&writer, &joined);
+        sendPacket(buffer, writer.length, client);
+    }
+    client->suspendedAt = 0;
+    client->resuming = false;
+    pthread_mutex_unlock(&clientArrLock);
 
+    printf("INFO:\tPlayer %s(%d) resumed from %s\n", client->name, client->id, inet_ntoa(client->ip));
+    return client;
+}
+
+/**
+ * Random token for resuming a session, never 0 (no token)
+ */
+uint64_t newResumeToken() {
+    uint64_t token = 0;
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = ((uint64_t) rand() << 32) ^ (uint64_t) rand() ^ clockMs();
+        }
+    }
+    return token;
+}
+
+/**
+ * Keeps the session of a player whose connection dropped for RESUME_GRACE, called by threadErrorHandler
+ *      Only the receiver thread of a player which got a token and did not QUIT suspends the session
+ *      The player stays in the game, its playerSender exits on its own
+ * Returns false if the client has to be removed right away
+ */
+bool suspendClient(clientInfo_t *client) {
+    bool suspended = false;
+    if (client->resumeToken == 0 || client->quitting || client->packet_rcv_thread_id == 0 ||
+        !pthread_equal(pthread_self(), client->packet_rcv_thread_id)) {
+        return false;
+    }
+    pthread_mutex_lock(&clientArrLock);
+    if (client->slot >= 0 && client->slot < MAX_PLAYERS && clientArr[client->slot] == client) {
+        client->suspendedAt = clockMs();
+        // Exiting receiver isn't joined, resumeClient starts a new one
+        client->packet_rcv_thread_id = 0;
+        pthread_detach(pthread_self());
+        suspended = true;
+    }
+    pthread_mutex_unlock(&clientArrLock);
+    if (suspended) {
+        shutdown(client->sock, SHUT_RDWR);
+        printf("INFO:\t%s(%d) can resume for %d seconds\n", client->name, client->id, RESUME_GRACE / 1000);
+    }
+    return suspended;
+}
+
+/**
+ * Returns true while the client's connection is dropped and the session waits to be resumed
+ */
+bool clientSuspended(clientInfo_t *client) {
+    pthread_mutex_lock(&clientArrLock);
+    bool suspended = client->suspendedAt != 0;
+    pthread_mutex_unlock(&clientArrLock);
+    return suspended;
+}
+
+/**
+ * Removes players whose sessions were not resumed within RESUME_GRACE, called by gameController
+ */
+void expireSessions() {
+    uint64_t now = clockMs();
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        clientInfo_t *client = NULL;
+        pthread_mutex_lock(&clientArrLock);
+        if (clientArr[i] && clientArr[i]->suspendedAt && !clientArr[i]->resuming &&
+            now - clientArr[i]->suspendedAt >= RESUME_GRACE) {
+            client = clientArr[i];
+            clientArr[i] = NULL;
+            playerData.active[i] = false;
+            sendPlayerDisconnect(client);
+        }
+        pthread_mutex_unlock(&clientArrLock);
+        if (!client) continue;
+
+        printf("INFO:\t%s(%d) did not resume\n", client->name, client->id);
+        if (client->packet_sndr_thread_id != 0) pthread_join(client->packet_sndr_thread_id, NULL);
+        close(client->sock);
+        releaseClient(client);
+    }
+}
+
+/**
+ * Sends ACK with the player ID or connectionError_t right away (client has no sender thread yet)
+ * ACK also tells the client which protocol version and capabilities will be used
+ */
+void sendAck(clientInfo_t *clientInfo, int id) {
+    char buffer[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    ackPacket_t ack = {id, clientInfo->protocolVersion, clientInfo->capabilities, clientInfo->resumeToken};
+    packetWriterInit(&writer, buffer, sizeof(buffer));
+    encodeAck(&writer, &ack);
+    sendPacketNow(buffer, writer.length, clientInfo);
 }
 
 /**
  * Function (in a seperate thread) which updates the client with game data (MAP/PLAYERS/SCORE)
+ * Every frame due for the client in a tick (queued messages included) is written with a single writev
  */
-void *playerSender(void *clientP) {
-    clientInfo_t *client = (clientInfo_t *) clientP;
-    while (true) {
+void *playerSender(void *handleP) {
+    clientHandle_t handle = (clientHandle_t) (uintptr_t) handleP;
+    clientInfo_t *client = clientFromHandle(handle);
+    if (!client) return 0;
+    char scoreBuffer[SCORE_PACKET_SIZE];
+    char chunkBuffers[MAP_CHUNKS_PER_FLUSH][MAX_PACKET_SIZE];
+    char *mapBuffer = NULL;      // Grown to hold a full MAP packet of the current map
+    size_t mapBufferSize = 0;
+    char playersBuffer[PLAYERS_PACKET_SIZE];
+    pthread_cleanup_push(freeBuffer, &mapBuffer);
+    // Exits when the connection drops and the session is suspended, resumeClient starts a new sender
+    // or when the client is removed (threadErrorHandler waits for that before the record is reused)
+    while (clientFromHandle(handle) && !clientSuspended(client)) {
         int clientTicker = 0; //Used to send players only per X packets
+        int ticksToSnapshot = 0;
+        unsigned long int farDue[MAX_SLOTS] = {0}; // Tick from which each distant player is sent again
         while (gameStarted) {
+            if (client->protocolVersion >= PROTOCOL_VERSION_PING && clockMs() >= client->nextPingTime) {
+                sendPing(client);
+            }
+            // Clients which can't keep up get a snapshot every sendInterval ticks, queued packets still go out
+            if (ticksToSnapshot > 0) {
+                ticksToSnapshot--;
+                flushPackets(client, NULL, 0);
+                sleep_ms(TICK_FREQUENCY);
+                continue;
+            }
+            ticksToSnapshot = client->sendInterval - 1;
+
+            struct iovec frames[3 + MAP_CHUNKS_PER_FLUSH];
+            int frameCount = 0;
+            int objectCount;
+            packetWriter_t writer;
             pthread_mutex_lock(&gameStartedock);
             pthread_mutex_lock(&clientArrLock);
-            int bufferPointer = 1;
-            char buffer[MAX_MAP_HEIGHT * MAX_MAP_WIDTH + PACKET_TYPE_SIZE];
-            int objectCount = 0;
+            // Game ended while waiting, MAP_CURRENT may already be replaced by applyPendingMaps
+            if (!gameStarted || client->suspendedAt || !clientFromHandle(handle)) {
+                pthread_mutex_unlock(&clientArrLock);
+                pthread_mutex_unlock(&gameStartedock);
+                break;
+            }
 
             if (clientTicker % 5 == 0) {
-                // Prepare score packet
-                /*
-                 * 0 - Packet type
-                 * 1 - 4 Object count
-                 * 5 - 8 Player score
-                 * 9 - 12 Player ID
-                 * Repeat player score and player ID for each player
-                 */
+                // Prepare SCORE packet with score and ID of every active player
                 objectCount = 0;
-                memset(buffer, 0, MAX_PACKET_SIZE);
-                buffer[0] = SCORE;
-                bufferPointer = 5;
-                for (int i = 0; i < MAX_PLAYERS; i++) {
-                    if (clientArr[i] && clientArr[i]->active) {
-                        memcpy(buffer + bufferPointer, &clientArr[i]->score, sizeof(int)); //Player score
-                        bufferPointer += sizeof(int);
-                        memcpy(buffer + bufferPointer, &clientArr[i]->id, sizeof(int)); //Player id
-                        bufferPointer += sizeof(int);
+                packetWriterInit(&writer, scoreBuffer, sizeof(scoreBuffer));
+                encodeScoresBegin(&writer);
+                for (int i = 0; i < MAX_SLOTS; i++) {
+                    if (playerData.active[i]) {
+                        scoreEntry_t entry = {playerData.score[i], playerData.id[i]};
+                        encodeScoreEntry(&writer, &entry);
+                        objectCount++;
                     }
                 }
-                memcpy(buffer + 1, &objectCount, sizeof(int));
-                sendPacket(buffer, bufferPointer, client);
-                pthread_mutex_unlock(&clientArrLock);
-                pthread_mutex_unlock(&gameStartedock);
-                clientTicker++;
-                sleep_ms(TICK_FREQUENCY);
-                continue;
-
+                encodeScoresEnd(&writer, objectCount);
+                frames[frameCount].iov_base = scoreBuffer;
+                frames[frameCount++].iov_len = writer.length;
             }
-            // Prepare MAP packet
-            /*
-             * 0 - PACKET TYPE
-             * 1- height*width+1 Map data
-             * Map data doesn't require map size since it is previously sent in the START packet
-             */
-            bufferPointer = 1;
-            memset(buffer, 0, MAX_PACKET_SIZE);
-            buffer[0] = MAP;
-            for (int i = 0; i < MAP_CURRENT->height; i++) {
-                for (int j = 0; j < MAP_CURRENT->width; j++) {
-                    buffer[bufferPointer] = MAP_CURRENT->map[i][j];
-                    bufferPointer++;
+            // Next part of a requested map (MAP_REQUEST), the transfer is dropped if the map has changed
+            if (client->mapChunkOffset >= 0 && client->mapChunkHash != MAP_CURRENT->hash) client->mapChunkOffset = -1;
+            int mapSize = MAP_CURRENT->width * MAP_CURRENT->height;
+            for (int i = 0; i < MAP_CHUNKS_PER_FLUSH && client->mapChunkOffset >= 0; i++) {
+                int offset = client->mapChunkOffset;
+                mapChunkPacket_t chunk = {client->mapChunkHash, (uint32_t) mapSize, (uint32_t) offset,
+                                          mapSize - offset < MAP_CHUNK_SIZE ? mapSize - offset : MAP_CHUNK_SIZE,
+                                          MAP_CURRENT->mapDefault + offset};
+                packetWriterInit(&writer, chunkBuffers[i], MAX_PACKET_SIZE);
+                encodeMapChunk(&writer, &chunk);
+                frames[frameCount].iov_base = chunkBuffers[i];
+                frames[frameCount++].iov_len = writer.length;
+                client->mapChunkOffset += chunk.length;
+                if (client->mapChunkOffset >= mapSize) {
+                    // MAP_DELTA packets received before the chunks were overwritten, the journal goes again
+                    client->mapChunkOffset = -1;
+                    client->mapChangesSent = 0;
+                    if (debugLevel >= VERBOSE) {
+                        printf("VERBOSE:\tSent map %s to %s\n", MAP_CURRENT->filename, client->name);
+                    }
                 }
             }
-            sendPacket(buffer, bufferPointer, client);
-
-
-            // Prepare PLAYERS packet
-            /*
-             * 0 - PACKET TYPE
-             * 1-4 OBJECT COUNT
-             * 5-19..20-33... Player information for each player 14 bytes(int(4)+float(4)+float(4)+PlayerState(1)+PlayerType(1))
-             */
-
-            memset(buffer, 0, MAX_PACKET_SIZE);
-            buffer[0] = PLAYERS;
-            objectCount = 0; //Amount of player objects
-            bufferPointer = 5; //Start of the player information in buffer
-            for (int i = 0; i < MAX_PLAYERS; i++) {
-                if (clientArr[i] && clientArr[i]->active) {
-                    memcpy(buffer + bufferPointer, &clientArr[i]->id, sizeof(int)); //Player ID
-                    bufferPointer += sizeof(int);
-                    memcpy(buffer + bufferPointer, &clientArr[i]->x, sizeof(float)); //Player x coordinates
-                    bufferPointer += sizeof(float);
-                    memcpy(buffer + bufferPointer, &clientArr[i]->y, sizeof(float)); //Player y coordinates
-                    bufferPointer += sizeof(float);
-                    buffer[bufferPointer++] = clientArr[i]->playerState;
-                    buffer[bufferPointer++] = clientArr[i]->playerType;
-                    objectCount++;
+            // Prepare MAP packet, map size is previously sent in the START packet
+            size_t mapPacketSize = PACKET_TYPE_SIZE + (size_t) MAP_CURRENT->width * MAP_CURRENT->height;
+            if (mapPacketSize < MAX_PACKET_SIZE) mapPacketSize = MAX_PACKET_SIZE;
+            if (mapPacketSize > mapBufferSize) {
+                char *buffer = realloc(mapBuffer, mapPacketSize);
+                if (!buffer) {
+                    // Receiver notices the dropped connection and removes the client
+                    pthread_mutex_unlock(&clientArrLock);
+                    pthread_mutex_unlock(&gameStartedock);
+                    printf("INFO: %s: Failed to allocate MAP buffer\n", inet_ntoa(client->ip));
+                    shutdown(client->sock, SHUT_RDWR);
+                    break;
                 }
+                mapBuffer = buffer;
+                mapBufferSize = mapPacketSize;
             }
-            memcpy(buffer + PACKET_TYPE_SIZE, &objectCount, sizeof(int)); // Object count
-
-            sendPacket(buffer, bufferPointer, client);
-
+            packetWriterInit(&writer, mapBuffer, mapBufferSize);
+            if (client->capabilities & CAP_MAP_CACHE) {
+                // Client has the default map (START hash), only send tiles changed since the last MAP_DELTA
+                // Changes which don't fit in one packet go out with the next tick
+                size_t pending = MAP_CURRENT->changeCount - client->mapChangesSent;
+                if (pending > MAP_DELTA_MAX_CHANGES(MAX_PACKET_SIZE)) pending = MAP_DELTA_MAX_CHANGES(MAX_PACKET_SIZE);
+                encodeMapDeltaBegin(&writer);
+                for (size_t i = 0; i < pending; i++) {
+                    encodeTileChange(&writer, &MAP_CURRENT->changes[client->mapChangesSent++]);
+                }
+                encodeMapDeltaEnd(&writer, (int) pending);
+            } else if (client->capabilities & CAP_COMPACT_MAP) {
+                encodeCompactMap(&writer, MAP_CURRENT->map, MAP_CURRENT->width, MAP_CURRENT->height,
+                                 MAP_CURRENT->width);
+            } else {
+                encodeMap(&writer, MAP_CURRENT->map, MAP_CURRENT->width, MAP_CURRENT->height, MAP_CURRENT->width);
+            }
+            frames[frameCount].iov_base = mapBuffer;
+            frames[frameCount++].iov_len = writer.length;
+
+            // Prepare PLAYERS packet with position, state and type of every active player
+            // The client's own MOVE acknowledgement lets it reconcile its predicted position
+            objectCount = 0;
+            // Stamped with the tick, so clients can interpolate between snapshots by server time
+            moveAck_t ack = {playerData.ackedSequence[client->slot], playerData.ackedTicks[client->slot]};
+            packetWriterInit(&writer, playersBuffer, sizeof(playersBuffer));
+            encodePlayersBegin(&writer, &ack, &tickStamp, client->protocolVersion);
+            if ((client->capabilities & CAP_AREA_OF_INTEREST) && playerData.active[client->slot]) {
+                // Distant players only every AOI_FAR_INTERVAL ticks, the client keeps their last position
+                objectCount = encodeNearbyPlayers(&writer, client->slot, farDue);
+            } else {
+                for (int i = 0; i < MAX_SLOTS; i++) {
+                    if (playerData.active[i]) {
+                        playerEntry_t entry = {playerData.id[i], playerData.x[i], playerData.y[i],
+                                               playerData.state[i], playerData.type[i]};
+                        encodePlayerEntry(&writer, &entry);
+                        objectCount++;
+                    }
+                }
+            }
+            encodePlayersEnd(&writer, objectCount);
+            frames[frameCount].iov_base = playersBuffer;
+            frames[frameCount++].iov_len = writer.length;
 
             clientTicker++;
             pthread_mutex_unlock(&clientArrLock);
             pthread_mutex_unlock(&gameStartedock);
+
+            // Queued packets (START/MESSAGE/JOINED...) and this tick's frames leave in one syscall
+            flushPackets(client, frames, frameCount);
+            size_t snapshotBytes = 0;
+            for (int i = 0; i < frameCount; i++) snapshotBytes += FRAME_HEADER_SIZE + frames[i].iov_len;
+            adaptSendRate(client, snapshotBytes);
+            if (debugLevel >= DEBUG) {
+                for (int i = 0; i < frameCount; i++) {
+                    debugPacket(frames[i].iov_base, frames[i].iov_len, client->protocolVersion, __func__,
+                                strerror(errno));
+                }
+            }
             sleep_ms(TICK_FREQUENCY);
         }
+        // Outside of the game only the queued packets have to be delivered
+        flushPackets(client, NULL, 0);
         sleep_ms(TICK_FREQUENCY);
     }
+    pthread_cleanup_pop(1);
     return 0;
 
 }
@@ -944,59 +2897,199 @@ void *playerSender(void *clientP) {
 /**
  * Function (in a seperate thread) which receives updates from the client (MOVE/MESSAGE/QUIT(PLAYER_DISCONNECTED))
  */
-void *playerReceiver(void *client) {
-    clientInfo_t *clientInfo = (clientInfo_t *) client;
+void *playerReceiver(void *handleP) {
+    clientInfo_t *clientInfo = clientFromHandle((clientHandle_t) (uintptr_t) handleP);
+    if (!clientInfo) return 0;
+    // A packet is always handled to the end, receivePacket allows cancelling while it waits
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
     while (true) {
         char buffer[MAX_PACKET_SIZE];
         memset(buffer, 0, MAX_PACKET_SIZE);
         ssize_t bufferPointer = 0; //Stores received packet size
-        int messageLength = 0;
+        packetReader_t reader;
+        movePacket_t move;
+        messagePacket_t message;
+        mapRequestPacket_t mapRequest;
+        pingPacket_t pong;
         receivePacket(buffer, &bufferPointer, clientInfo);
-        switch (buffer[0]) {
+        packetReaderInit(&reader, buffer, (size_t) bufferPointer);
+        switch (packetType(buffer, (size_t) bufferPointer)) {
             case MOVE:
-                /*
-                 * 1-4 Player ID (Not really required in stateful connection)
-                 * 5 Player Move
-                 */
-                clientInfo->clientMovement = (enum clientMovement_t) buffer[5];
+                // Player ID in the packet isn't really required in stateful connection
+                if (decodeMove(&reader, &move, clientInfo->protocolVersion)) {
+                    if (!acceptMove(clientInfo, &move)) break;
+                    // Locked so that a tick never sees a direction without its sequence
+                    pthread_mutex_lock(&clientArrLock);
+                    playerData.movement[clientInfo->slot] = (uint8_t) move.direction;
+                    playerData.moveSequence[clientInfo->slot] = move.sequence;
+                    pthread_mutex_unlock(&clientArrLock);
+                }
                 break;
             case MESSAGE:
-                /*
-                 * 1-4 Player ID (Not really required in stateful connection)
-                 * 5-8 Message length
-                 * 9-... Message
-                 */
-                memcpy((void *) &messageLength, (void *) &buffer + 5, sizeof(int)); //Read message length
-                if (bufferPointer - 9 > messageLength) {
+                if (!decodeMessage(&reader, &message)) {
                     if (debugLevel >= VERBOSE) {
-                        printf("VERBOSE:\t%s is sending incorrect length messages (they are bigger than messageLength) DISCARDING\n",
+                        printf("VERBOSE:\t%s is sending incorrect length messages (they are bigger than the packet) DISCARDING\n",
                                clientInfo->name);
                     }
                 } else {
-                    sendMessage(clientInfo->id, messageLength, buffer + 9);
+                    sendMessage(clientInfo->id, message.length, message.text);
                 }
                 break;
             case QUIT:
-                /*
-                 * 1-4 Player ID (Not really required in stateful connection)
-                 */
                 processQuit(clientInfo);
                 break;
+            case MAP_REQUEST:
+                // Client doesn't have the START map cached
+                if (decodeMapRequest(&reader, &mapRequest)) {
+                    requestMapChunks(clientInfo, mapRequest.mapHash);
+                }
+                break;
+            case PONG:
+                if (decodePing(&reader, PONG, &pong)) acceptPong(clientInfo, &pong);
+                break;
             default:
                 break;
         }
+    }
+    return 0;
+}
+
+/**
+ * Drops MOVE packets which aren't newer than the last one and measures the input lag of timestamped ones
+ * The client stamps MOVE with its estimate of our clock (from PLAYERS), so the lag is the uplink delay
+ * plus the fastest downlink delay the client has seen
+ */
+bool acceptMove(clientInfo_t *client, const movePacket_t *move) {
+    if (client->protocolVersion >= PROTOCOL_VERSION_MOVE_SEQUENCE) {
+        if ((int32_t) (move->sequence - client->lastMoveSequence) <= 0) {
+            client->staleInputs++;
+            if (debugLevel >= DEBUG) printf("DEBUG:\t%s sent stale MOVE %u\n", client->name, move->sequence);
+            return false;
+        }
+        client->lastMoveSequence = move->sequence;
+    }
+    if (move->time != 0) {
+        int32_t lag = (int32_t) ((uint32_t) clockMs() - move->time);
+        uint32_t sample = lag > 0 ? (uint32_t) lag : 0;
+        client->inputLag = client->inputLag == 0 ? sample : (client->inputLag * 7 + sample) / 8;
+        if (sample > client->inputLagMax) client->inputLagMax = sample;
+    }
+    return true;
+}
 
-        sleep_ms(TICK_FREQUENCY);
+/**
+ * Queues a PING stamped with our clock, it leaves with the next flush and queues behind the snapshots
+ * in the socket buffer like they do, so the round trip includes the delay they see
+ */
+void sendPing(clientInfo_t *client) {
+    char buffer[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    uint64_t now = clockMs();
+    pingPacket_t ping = {++client->pingSequence, now};
+    packetWriterInit(&writer, buffer, sizeof(buffer));
+    encodePing(&writer, PING, &ping);
+    sendPacket(buffer, writer.length, client);
+    client->nextPingTime = now + PING_INTERVAL;
+}
+
+/**
+ * Measures the round trip of a PING the client answered, PONGs which aren't newer than the last one are dropped
+ */
+void acceptPong(clientInfo_t *client, const pingPacket_t *pong) {
+    uint64_t now = clockMs();
+    if ((int32_t) (pong->sequence - client->pongSequence) <= 0 || pong->time > now) return;
+    client->pongSequence = pong->sequence;
+    int sample = (int) (now - pong->time);
+    pthread_mutex_lock(&client->sendLock);
+    client->rtt = client->rtt < 0 ? sample : (client->rtt * 7 + sample) / 8;
+    if (client->rttMin < 0 || sample < client->rttMin) client->rttMin = sample;
+    pthread_mutex_unlock(&client->sendLock);
+    if (debugLevel >= DEBUG) printf("DEBUG:\t%s round trip %d ms\n", client->name, sample);
+}
+
+/**
+ * Measures how much of what was written the client has taken and sets its snapshot interval
+ * Snapshots piling up in the socket buffer or a round trip growing over the fastest one lower the rate,
+ * at least as far as the measured throughput requires. It goes back up a step at a time once the buffer stays drained
+ * Called by playerSender after every snapshot
+ */
+void adaptSendRate(clientInfo_t *client, size_t snapshotBytes) {
+    uint64_t now = clockMs();
+    int queued = 0;
+    if (ioctl(client->sock, SIOCOUTQ, &queued) < 0 || queued < 0) queued = 0;
+    pthread_mutex_lock(&client->sendLock);
+    uint64_t delivered = client->bytesSent - (uint64_t) queued;
+    int rtt = client->rtt;
+    int rttMin = client->rttMin;
+    pthread_mutex_unlock(&client->sendLock);
+
+    if (client->windowStart == 0 || now - client->windowStart >= PING_INTERVAL) {
+        if (client->windowStart != 0) {
+            client->throughput = (uint32_t) ((delivered - client->windowDelivered) * 1000 / (now - client->windowStart));
+        }
+        client->windowStart = now;
+        client->windowDelivered = delivered;
     }
-    return 0;
+
+    int interval = client->sendInterval;
+    bool congested = (size_t) queued > snapshotBytes * RATE_BACKOFF_QUEUE ||
+                     (rtt >= 0 && rtt > rttMin + RATE_BACKOFF_DELAY);
+    if (congested) {
+        client->drainedSince = 0;
+        if (now < client->nextRateChange || interval >= MAX_SEND_INTERVAL) return;
+        interval *= 2;
+        if (client->throughput > 0) {
+            // Snapshots at the full rate have to fit in what the client took
+            uint64_t fullRate = (uint64_t) snapshotBytes * 1000 / TICK_FREQUENCY;
+            int needed = (int) ((fullRate + client->throughput - 1) / client->throughput);
+            if (needed > interval) interval = needed;
+        }
+        if (interval > MAX_SEND_INTERVAL) interval = MAX_SEND_INTERVAL;
+        client->nextRateChange = now + RATE_HOLD_TIME;
+    } else if ((size_t) queued < snapshotBytes && interval > 1) {
+        if (client->drainedSince == 0) client->drainedSince = now;
+        if (now - client->drainedSince < RATE_RECOVER_TIME) return;
+        interval--;
+        client->drainedSince = now;
+    } else {
+        client->drainedSince = 0;
+        return;
+    }
+    if (debugLevel >= VERBOSE) {
+        printf("VERBOSE:\t%s gets a snapshot every %d ticks (%d bytes queued, round trip %d ms, %u B/s)\n",
+               client->name, interval, queued, rtt, client->throughput);
+    }
+    client->sendInterval = interval;
+}
+
+/**
+ * Starts sending the default tiles of the current map as MAP_CHUNK packets if the requested hash matches
+ * playerSender adds MAP_CHUNKS_PER_FLUSH of them to every snapshot, so a client which doesn't read only
+ * blocks its own sender. Requests are ignored while a transfer is still running
+ */
+void requestMapChunks(clientInfo_t *client, uint64_t hash) {
+    pthread_mutex_lock(&gameStartedock);
+    pthread_mutex_lock(&clientArrLock);
+    if (client->mapChunkOffset < 0 && gameStarted && MAP_CURRENT->hash == hash) {
+        client->mapChunkOffset = 0;
+        client->mapChunkHash = hash;
+    }
+    pthread_mutex_unlock(&clientArrLock);
+    pthread_mutex_unlock(&gameStartedock);
 }
 
 
+/**
+ * Tells everyone the client is gone, called with clientArrLock held
+ * The lock is kept from freeing the slot on, so a new owner of the slot (and its player ID) is announced after this
+ */
 void sendPlayerDisconnect(clientInfo_t *client) {
-    char buffer[MAX_PACKET_SIZE] = {0};
-    buffer[0] = PLAYER_DISCONNECTED;
-    memcpy(buffer + PACKET_TYPE_SIZE, &client->id, sizeof(int));
-    sendMassPacket(buffer, PACKET_TYPE_SIZE + sizeof(int), client);
+    char buffer[MAX_PACKET_SIZE];
+    packetWriter_t writer;
+    playerIdPacket_t disconnected = {client->id};
+    packetWriterInit(&writer, buffer, sizeof(buffer));
+    encodePlayerId(&writer, PLAYER_DISCONNECTED, &disconnected);
+    sendMassPacketLocked(buffer, writer.length, client);
 }
 
 
@@ -1005,12 +3098,20 @@ void sendPlayerDisconnect(clientInfo_t *client) {
  */
 void sendMassPacket(char *buffer, ssize_t bufferPointer, clientInfo_t *client) {
     pthread_mutex_lock(&clientArrLock);
+    sendMassPacketLocked(buffer, bufferPointer, client);
+    pthread_mutex_unlock(&clientArrLock);
+}
+
+/**
+ * sendMassPacket for callers holding clientArrLock
+ */
+void sendMassPacketLocked(char *buffer, ssize_t bufferPointer, clientInfo_t *client) {
     for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (clientArr[i] && clientArr[i] != client) {
+        if (clientArr[i] && clientArr[i] != client && !clientArr[i]->suspendedAt) {
             sendPacket(buffer, bufferPointer, clientArr[i]);
         }
     }
-    pthread_mutex_unlock(&clientArrLock);
+    queueBroadcast(buffer, (size_t) bufferPointer);
 }
 
 
@@ -1027,36 +3128,298 @@ void sendMessage(int playerId, int messageLength, char *message) {
     if (playerId != 0) stripSpecialCharacters(&messageLength, message);
 
     //Prepare MESSAGE packet
-    /*
-     * 1-4 Player ID (Not really required in stateful connection)
-     * 5-8 Message length
-     * 9-... Message
-     */
-    buffer[0] = MESSAGE;
-    memcpy(buffer + 1, &playerId, sizeof(int)); // Player ID
-    memcpy(buffer + 5, &messageLength, sizeof(int)); // Message length
-    for (int i = 0; i < messageLength; i++) {
-        buffer[i + 9] = message[i];     // Message
-    }
-    int bufferPointer = PACKET_TYPE_SIZE + sizeof(int) + sizeof(int) + messageLength;
+    messagePacket_t packet = {playerId, messageLength, message};
+    packetWriter_t writer;
+    packetWriterInit(&writer, buffer, sizeof(buffer));
+    if (!encodeMessage(&writer, &packet)) return;
+    size_t bufferPointer = writer.length;
 
     pthread_mutex_lock(&clientArrLock);
     for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (clientArr[i]) {
+        if (clientArr[i] && !clientArr[i]->suspendedAt) {
             sendPacket(buffer, bufferPointer, clientArr[i]);
         }
     }
     pthread_mutex_unlock(&clientArrLock);
+    queueBroadcast(buffer, bufferPointer);
+}
+
+/**
+ * Registers a client which joined with CAP_SPECTATOR. It gets ACK and the names of the players right away,
+ * after that it is only served by spectatorSender. Spectators never get a clientArr slot
+ */
+void processNewSpectator(clientInfo_t *clientInfo) {
+    packetWriter_t writer;
+    joinedPacket_t joined;
+    frameBuffer_t names;
+    int index = -1;
+
+    pthread_mutex_lock(&spectatorLock);
+    for (int i = 0; i < MAX_SPECTATORS && index < 0; i++) {
+        if (spectatorArr[i] == NULL) index = i;
+    }
+    pthread_mutex_unlock(&spectatorLock);
+    if (index < 0) {
+        sendAck(clientInfo, ERROR_SERVER_FULL);
+        threadErrorHandler("INFO:\tNo room for spectators", 4, clientInfo);
+    }
+    sendAck(clientInfo, 0);
+
+    // Names of the players and bots, serialized first so that the socket isn't written with clientArrLock held
+    frameBufferInit(&names);
+    pthread_mutex_lock(&clientArrLock);
+    for (int i = 0; i < MAX_PLAYERS + BOT_COUNT; i++) {
+        if (i < MAX_PLAYERS && clientArr[i] == NULL) continue;
+        joined.id = playerData.id[i];
+        memcpy(joined.name, playerName(i), sizeof(joined.name));
+        packetWriterInit(&writer, broadcastFrame(&names, MAX_PACKET_SIZE), MAX_PACKET_SIZE);
+        encodeJoined(&writer, &joined);
+        frameBufferEnd(&names, writer.length);
+    }
+    pthread_mutex_unlock(&clientArrLock);
+    struct iovec iov = {names.data, names.length};
+    ssize_t written = names.length > 0 ? writeAll(clientInfo->sock, &iov, 1) : 0;
+    frameBufferFree(&names);
+    if (written < 0) {
+        threadErrorHandler("Lost connection with spectator", 10, clientInfo);
+    }
+
+    printf("INFO:\tNew spectator %s from %s\n", clientInfo->name, inet_ntoa(clientInfo->ip));
+    pthread_mutex_lock(&spectatorLock);
+    if (spectatorArr[index] != NULL) {
+        // Taken by another spectator meanwhile
+        index = -1;
+        for (int i = 0; i < MAX_SPECTATORS && index < 0; i++) {
+            if (spectatorArr[i] == NULL) index = i;
+        }
+    }
+    if (index >= 0) spectatorArr[index] = clientInfo;
+    pthread_mutex_unlock(&spectatorLock);
+    if (index < 0) {
+        threadErrorHandler("INFO:\tNo room for spectators", 4, clientInfo);
+    }
+}
+
+/**
+ * Starts a frame in a broadcast buffer, running out of memory is fatal like in safeMalloc
+ */
+char *broadcastFrame(frameBuffer_t *buffer, size_t maxPayload) {
+    char *payload = frameBufferBegin(buffer, maxPayload);
+    if (!payload) exitWithMessage("Failed to allocate broadcast buffer");
+    return payload;
+}
+
+/**
+ * Appends a frame for the spectators to the events of the next tick, events which don't fit are dropped
+ */
+void queueBroadcast(char *buffer, size_t length) {
+    pthread_mutex_lock(&broadcastLock);
+    if (broadcast.queued.length + FRAME_HEADER_SIZE + length <= BROADCAST_EVENTS_SIZE) {
+        memcpy(broadcastFrame(&broadcast.queued, length), buffer, length);
+        frameBufferEnd(&broadcast.queued, length);
+    }
+    pthread_mutex_unlock(&broadcastLock);
+}
+
+/**
+ * Serializes the spectator stream of a tick once, spectatorSender sends the same bytes to every spectator
+ * tick is 1 for the first tick of a game, 0 only publishes the queued events (game end)
+ * Called by gameController, which is the only thread changing the map
+ */
+void publishBroadcast(unsigned long int tick) {
+    packetWriter_t writer;
+    pthread_mutex_lock(&clientArrLock);
+    pthread_mutex_lock(&broadcastLock);
+
+    // Built in a buffer spectatorSender doesn't use, events queued since the last tick are moved into it
+    int next = 0;
+    while (next == broadcast.published || next == broadcast.sending) next++;
+    broadcastTick_t *built = &broadcast.ticks[next];
+    frameBuffer_t events = built->events;
+    built->events = broadcast.queued;
+    broadcast.queued = events;
+    broadcast.queued.length = 0;
+    built->snapshot.length = 0;
+    built->sync.length = 0;
+
+    if (tick > 0) {
+        int width = MAP_CURRENT->width;
+        int height = MAP_CURRENT->height;
+        if (tick == 1) {
+            broadcast.game++;
+            broadcast.changesSent = 0;
+        }
+        if (tick == 1 || broadcast.syncWanted) {
+            // Spectators start in the middle of the map, the MAP holds every change so far
+            size_t mapPacketSize = PACKET_TYPE_SIZE + (size_t) width * height;
+            startPacket_t start = {width, height, width / 2, height / 2, MAP_CURRENT->hash};
+            packetWriterInit(&writer, broadcastFrame(&built->sync, MAX_PACKET_SIZE), MAX_PACKET_SIZE);
+            encodeStart(&writer, &start, PROTOCOL_VERSION);
+            frameBufferEnd(&built->sync, writer.length);
+            packetWriterInit(&writer, broadcastFrame(&built->sync, mapPacketSize), mapPacketSize);
+            encodeCompactMap(&writer, MAP_CURRENT->map, width, height, width);
+            frameBufferEnd(&built->sync, writer.length);
+            broadcast.syncWanted = false;
+        }
+
+        // Tiles changed during the tick
+        while (broadcast.changesSent < MAP_CURRENT->changeCount) {
+            size_t pending = MAP_CURRENT->changeCount - broadcast.changesSent;
+            if (pending > MAP_DELTA_MAX_CHANGES(MAX_PACKET_SIZE)) pending = MAP_DELTA_MAX_CHANGES(MAX_PACKET_SIZE);
+            packetWriterInit(&writer, broadcastFrame(&built->snapshot, MAX_PACKET_SIZE), MAX_PACKET_SIZE);
+            encodeMapDeltaBegin(&writer);
+            for (size_t i = 0; i < pending; i++) {
+                encodeTileChange(&writer, &MAP_CURRENT->changes[broadcast.changesSent++]);
+            }
+            encodeMapDeltaEnd(&writer, (int) pending);
+            frameBufferEnd(&built->snapshot, writer.length);
+        }
+
+        // Scores every 5 ticks like playerSender, positions every tick
+        int objectCount = 0;
+        if ((tick - 1) % 5 == 0) {
+            packetWriterInit(&writer, broadcastFrame(&built->snapshot, SCORE_PACKET_SIZE), SCORE_PACKET_SIZE);
+            encodeScoresBegin(&writer);
+            for (int i = 0; i < MAX_SLOTS; i++) {
+                if (playerData.active[i]) {
+                    scoreEntry_t entry = {playerData.score[i], playerData.id[i]};
+                    encodeScoreEntry(&writer, &entry);
+                    objectCount++;
+                }
+            }
+            encodeScoresEnd(&writer, objectCount);
+            frameBufferEnd(&built->snapshot, writer.length);
+        }
+        moveAck_t ack = {0, 0};
+        objectCount = 0;
+        packetWriterInit(&writer, broadcastFrame(&built->snapshot, PLAYERS_PACKET_SIZE), PLAYERS_PACKET_SIZE);
+        encodePlayersBegin(&writer, &ack, &tickStamp, PROTOCOL_VERSION);
+        for (int i = 0; i < MAX_SLOTS; i++) {
+            if (playerData.active[i]) {
+                playerEntry_t entry = {playerData.id[i], playerData.x[i], playerData.y[i],
+                                       playerData.state[i], playerData.type[i]};
+                encodePlayerEntry(&writer, &entry);
+                objectCount++;
+            }
+        }
+        encodePlayersEnd(&writer, objectCount);
+        frameBufferEnd(&built->snapshot, writer.length);
+    }
+
+    broadcast.published = next;
+    broadcast.serial++;
+    pthread_cond_signal(&broadcastReady);
+    pthread_mutex_unlock(&broadcastLock);
+    pthread_mutex_unlock(&clientArrLock);
+}
+
+/**
+ * Spectator send path, one thread with a lower priority for all spectators
+ * Every published tick is written to the spectators straight from the broadcast buffers without blocking.
+ * A spectator which can't take a whole tick keeps the rest in its backlog and skips ticks until it drains,
+ * then it is synced again with START and the full MAP. Players' locks are never taken here
+ */
+void *spectatorSender(void *unused) {
+    unsigned long int lastSerial = 0;
+    char discard[MAX_PACKET_SIZE];
+
+    // Nice value is per thread on Linux, failing to lower the priority isn't fatal
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), SPECTATOR_NICE);
+
+    while (true) {
+        // Wait for the next tick, spectators which left are also noticed between games
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_mutex_lock(&broadcastLock);
+        while (broadcast.serial == lastSerial &&
+               pthread_cond_timedwait(&broadcastReady, &broadcastLock, &deadline) == 0);
+        bool published = broadcast.serial != lastSerial;
+        bool missed = broadcast.serial - lastSerial > 1;
+        unsigned int game = broadcast.game;
+        // publishBroadcast leaves the tick alone until sending is cleared
+        if (published) broadcast.sending = broadcast.published;
+        broadcastTick_t *tick = &broadcast.ticks[broadcast.published];
+        lastSerial = broadcast.serial;
+        pthread_mutex_unlock(&broadcastLock);
+
+        bool syncWanted = false;
+        pthread_mutex_lock(&spectatorLock);
+        for (int i = 0; i < MAX_SPECTATORS; i++) {
+            clientInfo_t *spectator = spectatorArr[i];
+            if (spectator == NULL) continue;
+
+            // Spectators don't play, anything they send (QUIT) is read away
+            ssize_t readSize = recv(spectator->sock, discard, sizeof(discard), MSG_DONTWAIT);
+            if (readSize == 0 || (readSize < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                dropSpectator(i, "Spectator disconnected");
+                continue;
+            }
+            // Rest of an earlier tick goes first
+            if (!frameBufferSend(&spectator->backlog, spectator->sock, NULL, 0)) {
+                dropSpectator(i, "Lost connection with spectator");
+                continue;
+            }
+            if (!published) continue;
+            if (spectator->backlog.length > 0 || missed) {
+                // The MAP_DELTA packets of the skipped ticks are replaced by a full MAP
+                spectator->spectatorGame = 0;
+                if (spectator->backlog.length > 0) continue;
+            }
+
+            struct iovec frames[3];
+            int frameCount = 0;
+            if (tick->events.length > 0) {
+                frames[frameCount].iov_base = tick->events.data;
+                frames[frameCount++].iov_len = tick->events.length;
+            }
+            if (game != 0 && spectator->spectatorGame != game) {
+                if (tick->sync.length > 0) {
+                    frames[frameCount].iov_base = tick->sync.data;
+                    frames[frameCount++].iov_len = tick->sync.length;
+                    spectator->spectatorGame = game;
+                } else {
+                    syncWanted = true;
+                }
+            }
+            if (game != 0 && spectator->spectatorGame == game && tick->snapshot.length > 0) {
+                frames[frameCount].iov_base = tick->snapshot.data;
+                frames[frameCount++].iov_len = tick->snapshot.length;
+            }
+            if (!frameBufferSend(&spectator->backlog, spectator->sock, frames, frameCount)) {
+                dropSpectator(i, "Lost connection with spectator");
+            }
+        }
+        pthread_mutex_unlock(&spectatorLock);
+
+        if (published || syncWanted) {
+            pthread_mutex_lock(&broadcastLock);
+            broadcast.sending = -1;
+            if (syncWanted) broadcast.syncWanted = true;
+            pthread_mutex_unlock(&broadcastLock);
+        }
+    }
+    return 0;
+}
 
+/**
+ * Disconnects a spectator and gives its record back, called by spectatorSender with spectatorLock held
+ */
+void dropSpectator(int index, char *reason) {
+    clientInfo_t *spectator = spectatorArr[index];
+    printf("INFO: %s: %s\n", inet_ntoa(spectator->ip), reason);
+    spectatorArr[index] = NULL;
+    close(spectator->sock);
+    releaseClient(spectator);
 }
 
 void processQuit(clientInfo_t *client) {
+    // Player left on purpose, its session isn't kept for resuming
+    client->quitting = true;
     //Prepare PLAYER_DISCONNECTED packet
-    char buffer[5];
-    buffer[0] = PLAYER_DISCONNECTED;
-    memcpy(buffer + 1, &client->id, sizeof(int)); // Player ID
-    sendMassPacket(buffer, 5, client);
-
+    pthread_mutex_lock(&clientArrLock);
+    sendPlayerDisconnect(client);
+    pthread_mutex_unlock(&clientArrLock);
 }
 
 
@@ -1074,6 +3437,15 @@ void sleep_ms(int milliseconds) // cross-platform sleep function
 #endif
 }
 
+/**
+ * Returns monotonic clock time in miliseconds, used to timestamp snapshots
+ */
+uint64_t clockMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
 /**
  * Returns count of all connected players, including those which game specific variables HAVEN'T been initialized
  */
@@ -1090,8 +3462,8 @@ unsigned int getPlayerCount() {
  */
 unsigned int getActivePlayerCount() {
     unsigned int players = 0;
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (clientArr[i] != NULL && clientArr[i]->active) players++;
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        if (playerData.active[i]) players++;
     }
     return players;
 }
@@ -1104,162 +3476,164 @@ void sendStartPackets() {
     pthread_mutex_lock(&clientArrLock);
     for (int i = 0; i < MAX_PLAYERS; i++) {
         memset(buffer, 0, MAX_PACKET_SIZE);
-        if (clientArr[i] != NULL) {
-            prepareStartPacket(buffer, clientArr[i]);
+        // Suspended players are placed when they resume, like players who join late
+        if (clientArr[i] != NULL && !clientArr[i]->suspendedAt) {
+            ssize_t bufferPointer = prepareStartPacket(buffer, clientArr[i]);
             if (debugLevel >= DEBUG) printf("DEBUG:\tSending START packet to %s\n", clientArr[i]->name);
-            sendPacket(buffer, 5, clientArr[i]);
+            queueStartPacket(buffer, bufferPointer, clientArr[i]);
         }
     }
+    // Bots are placed after the connected players, so they take the spawn points which are left
+    for (int i = 0; i < BOT_COUNT; i++) {
+        spawnPlayer(MAX_PLAYERS + i, botNames[i]);
+    }
     pthread_mutex_unlock(&clientArrLock);
 }
 
 /**
- * Checks if there is anyone at the given coordinates, returns the client, else NULL
+ * Checks if there is anyone at the given coordinates, returns the player slot, else -1
  */
-clientInfo_t *isSomeoneThere(int x, int y) {
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (clientArr[i] != NULL) {
-            if (clientArr[i]->active && (int) clientArr[i]->x == x && (int) clientArr[i]->y == y) {
-                return clientArr[i];
-            }
+int isSomeoneThere(int x, int y) {
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        if (playerData.active[i] && (int) playerData.x[i] == x && (int) playerData.y[i] == y) {
+            return i;
         }
     }
-    return NULL;
+    return -1;
 }
 
 /**
  * Looks for adequate player spawning position on the map
+ * Candidates are precomputed per map: Pacmans search from the upper left corner, Ghosts from the lower right one
+ * If every candidate is taken or near an enemy the player is placed on a candidate anyway
  */
-void findStartingPosition(clientInfo_t *client) {
-
-    if (client->playerType == Pacman) { // If Pacman start search in the upper left corner
-        int rows = MAP_CURRENT->height;
-        int cols = MAP_CURRENT->width;
-        for (int i = 0; i < rows; i++) {
-            for (int j = 0; j < cols; j++) {
-                if (MAP_CURRENT->map[i][j] != Wall &&
-                    MAP_CURRENT->map[i][j] != None) { //Try to find possible spawn point
-                    // Traverse close blocks to see if there aren't any Ghosts
-                    // We need to make sure that we do not check negative array values
-                    bool enemyFound = false;
-                    //Do not spawn on friendlies
-                    if (isSomeoneThere(i, j) && isSomeoneThere(i, j)->playerType == Pacman) {
-                        continue;
-                    }
-
-                    for (int ii = (i - SPAWNPOINT_TRAVERSAL_RANGE < 0) ? i : i - SPAWNPOINT_TRAVERSAL_RANGE;
-                         ii < i + SPAWNPOINT_TRAVERSAL_RANGE && i + SPAWNPOINT_TRAVERSAL_RANGE <= rows; ii++) {
-                        for (int jj = (j - SPAWNPOINT_TRAVERSAL_RANGE < 0) ? j : j - SPAWNPOINT_TRAVERSAL_RANGE;
-                             jj < j + SPAWNPOINT_TRAVERSAL_RANGE && j + SPAWNPOINT_TRAVERSAL_RANGE <= cols; jj++) {
-                            clientInfo_t *contender = isSomeoneThere(ii, jj);
-
-                            //Make sure that player is not spawned near enemy
-                            if (contender && contender->playerType == Ghost) {
-                                enemyFound = true;
-                                break;
-                            }
-                        }
-                        if (enemyFound) break;
-                    }
-                    if (enemyFound == false) {
-                        client->x = (float) j;
-                        client->y = (float) i;
-                        if (debugLevel >= VERBOSE)
-                            printf("VERBOSE:\t%s will start at (%d:%d)\n", client->name, (int) client->x,
-                                   (int) client->y);
-                        return;
-                    }
-                }
-            }
+void findStartingPosition(int slot, const char *name) {
+    uint32_t *candidates = playerData.type[slot] == Pacman ? MAP_CURRENT->file.pacmanSpawns : MAP_CURRENT->file.ghostSpawns;
+    int candidateCount = playerData.type[slot] == Pacman ? MAP_CURRENT->file.pacmanSpawnCount
+                                                      : MAP_CURRENT->file.ghostSpawnCount;
+    enum playerType_t enemy = playerData.type[slot] == Pacman ? Ghost : Pacman;
+    int cols = MAP_CURRENT->width;
+    if (candidateCount == 0) return;
+
+    for (int c = 0; c < candidateCount; c++) {
+        int x = (int) (candidates[c] % cols);
+        int y = (int) (candidates[c] / cols);
+        //Do not spawn on friendlies
+        int friendly = isSomeoneThere(x, y);
+        if (friendly >= 0 && playerData.type[friendly] == playerData.type[slot]) {
+            continue;
         }
-    } else if (client->playerType == Ghost) { // If Ghost start search in lower right corner
-        int rows = MAP_CURRENT->height;
-        int cols = MAP_CURRENT->width;
-        for (int i = rows; i >= 0; i--) {
-            for (int j = cols; j >= 0; j--) {
-                if (MAP_CURRENT->map[i][j] != Wall &&
-                    MAP_CURRENT->map[i][j] != None) { //Try to find possible spawn point
-                    // Traverse close blocks to see if there aren't any Ghosts
-                    // We need to make sure that we do not check negative array values
-                    bool enemyFound = false;
-                    //Do not spawn on friendlies
-                    if (isSomeoneThere(i, j) && isSomeoneThere(i, j)->playerType == Ghost) {
-                        continue;
-                    }
-                    for (int ii = (i - SPAWNPOINT_TRAVERSAL_RANGE < 0) ? i : i - SPAWNPOINT_TRAVERSAL_RANGE;
-                         ii < i + SPAWNPOINT_TRAVERSAL_RANGE && i + SPAWNPOINT_TRAVERSAL_RANGE <= rows; ii++) {
-                        for (int jj = (j - SPAWNPOINT_TRAVERSAL_RANGE < 0) ? j : j - SPAWNPOINT_TRAVERSAL_RANGE;
-                             jj < j + SPAWNPOINT_TRAVERSAL_RANGE && j + SPAWNPOINT_TRAVERSAL_RANGE <= cols; jj++) {
-                            clientInfo_t *contender = isSomeoneThere(ii, jj);
-
-                            //Make sure that player is not spawned near enemy
-                            if (contender && contender->playerType == Pacman) {
-                                enemyFound = true;
-                                break;
-                            }
-                        }
-                        if (enemyFound) break;
-                    }
-                    if (enemyFound == false) {
-                        client->x = (float) j;
-                        client->y = (float) i;
-                        if (debugLevel >= VERBOSE)
-                            printf("VERBOSE:\t%s will start at (%d:%d)\n", client->name, (int) client->x,
-                                   (int) client->y);
-                        return;
-                    }
-                }
-            }
+        // Make sure that player is not spawned near enemy, one pass over the players instead of one per nearby tile
+        bool enemyFound = false;
+        for (int i = 0; i < MAX_SLOTS && !enemyFound; i++) {
+            int dx = (int) playerData.x[i] - x;
+            int dy = (int) playerData.y[i] - y;
+            enemyFound = playerData.active[i] && playerData.type[i] == enemy &&
+                         dx >= -SPAWNPOINT_TRAVERSAL_RANGE && dx < SPAWNPOINT_TRAVERSAL_RANGE &&
+                         dy >= -SPAWNPOINT_TRAVERSAL_RANGE && dy < SPAWNPOINT_TRAVERSAL_RANGE;
+        }
+        if (enemyFound == false) {
+            playerData.x[slot] = (float) x;
+            playerData.y[slot] = (float) y;
+            if (debugLevel >= VERBOSE) printf("VERBOSE:\t%s will start at (%d:%d)\n", name, x, y);
+            return;
         }
     }
 
+    // Crowded map, spread the rest of the players over the candidates
+    uint32_t tile = candidates[slot % candidateCount];
+    playerData.x[slot] = (float) (tile % cols);
+    playerData.y[slot] = (float) (tile / cols);
+    if (debugLevel >= VERBOSE)
+        printf("VERBOSE:\t%s will start at (%d:%d), no free spawn point\n", name, (int) (tile % cols), (int) (tile / cols));
 }
 
 /**
  * Decides if the player should be Pacman or Ghost
  */
-void pacmanOrGhost(clientInfo_t *client) {
+void pacmanOrGhost(int slot, const char *name) {
     unsigned int state = getActivePlayerCount() % (GHOST_RATIO + PACMAN_RATIO);
     if (state < GHOST_RATIO) {
-        client->playerType = Ghost;
-        if (debugLevel >= VERBOSE) printf("VERBOSE:\t%s will be a GHOST \n", client->name);
+        playerData.type[slot] = Ghost;
+        if (debugLevel >= VERBOSE) printf("VERBOSE:\t%s will be a GHOST \n", name);
     }
     if (state >= GHOST_RATIO) {
-        client->playerType = Pacman;
-        if (debugLevel >= VERBOSE) printf("VERBOSE:\t%s will be a PACMAN \n", client->name);
+        playerData.type[slot] = Pacman;
+        if (debugLevel >= VERBOSE) printf("VERBOSE:\t%s will be a PACMAN \n", name);
     }
 }
 
 /**
- * Prepares start packet for specific client
+ * Puts the player in the slot into the current game: type, state and starting position
  */
-void prepareStartPacket(char *buffer, clientInfo_t *client) {
-    buffer[0] = START;
-    // Prepares map data for client
-    // Map width
-    buffer[1] = (char) MAP_CURRENT->width;
-    // Map height
-    buffer[2] = (char) MAP_CURRENT->height;
-
+void spawnPlayer(int slot, const char *name) {
     // Calculates if player should be Pacman or Ghost
-    pacmanOrGhost(client);
+    pacmanOrGhost(slot, name);
 
     // Make sure that the player is alive at the start of the game
-    client->playerState = NORMAL;
-    client->active = true;
-    client->powerupTick = 0;
+    playerData.state[slot] = NORMAL;
+    playerData.active[slot] = true;
+    playerData.powerupTick[slot] = 0;
 
     // If player is a Pacman start with invincibility
-    if (client->playerType == Pacman) {
-        client->powerupTick = POWERUP_START_Invincibility_TICKS;
-        client->playerState = powerupInvincibility;
+    if (playerData.type[slot] == Pacman) {
+        playerData.powerupTick[slot] = POWERUP_START_Invincibility_TICKS;
+        playerData.state[slot] = powerupInvincibility;
     }
 
     // Finds suitable starting position for client
-    findStartingPosition(client);
+    findStartingPosition(slot, name);
+}
+
+/**
+ * Prepares start packet for specific client, returns the packet length
+ */
+ssize_t prepareStartPacket(char *buffer, clientInfo_t *client) {
+    spawnPlayer(client->slot, client->name);
+    return prepareResumePacket(buffer, client);
+}
+
+/**
+ * START with the player's current position, a resumed player carries on where it was
+ * Returns -1 if the map is too large for the client's protocol version
+ */
+ssize_t prepareResumePacket(char *buffer, clientInfo_t *client) {
+    int slot = client->slot;
+
+    // Map size and the starting position
+    startPacket_t start = {MAP_CURRENT->width, MAP_CURRENT->height, (int) playerData.x[slot], (int) playerData.y[slot],
+                           MAP_CURRENT->hash};
+    client->mapChangesSent = 0; // MAP_DELTA starts from the default map
+    client->mapChunkOffset = -1; // Chunks of an earlier map are useless now, the client asks again
+    packetWriter_t writer;
+    packetWriterInit(&writer, buffer, MAX_PACKET_SIZE);
+    if (!encodeStart(&writer, &start, client->protocolVersion)) return -1;
+    return writer.length;
+}
+
+/**
+ * Queues START prepared for the client, a client whose protocol version can't describe the map is dropped
+ */
+void queueStartPacket(char *buffer, ssize_t bufferPointer, clientInfo_t *client) {
+    if (bufferPointer < 0) {
+        printf("INFO: %s: Map %s is too large for protocol version %d\n", inet_ntoa(client->ip),
+               MAP_CURRENT->filename, client->protocolVersion);
+        shutdown(client->sock, SHUT_RDWR);
+        return;
+    }
+    sendPacket(buffer, bufferPointer, client);
+}
 
-    buffer[3] = (char) client->x;
-    buffer[4] = (char) client->y;
+/**
+ * Returns true if START of the current map can be sent in the protocol version,
+ * before PROTOCOL_VERSION_WIDE_START maps are limited to 255x255
+ */
+bool mapFitsVersion(int version) {
+    pthread_mutex_lock(&gameStartedock);
+    bool fits = version >= PROTOCOL_VERSION_WIDE_START ||
+                (MAP_CURRENT->width <= UINT8_MAX && MAP_CURRENT->height <= UINT8_MAX);
+    pthread_mutex_unlock(&gameStartedock);
+    return fits;
 }
 
 
@@ -1269,39 +3643,374 @@ void prepareStartPacket(char *buffer, clientInfo_t *client) {
  * Function which compares two player coordinates and returns true if both of them are to be
  * considered to be on the same tile
  */
-bool sameTile(clientInfo_t *a, clientInfo_t *b) {
-    return (int) a->x == (int) b->x && (int) a->y == (int) b->y;
+bool sameTile(int a, int b) {
+    return (int) playerData.x[a] == (int) playerData.x[b] && (int) playerData.y[a] == (int) playerData.y[b];
 }
 
 /**
  * Receives client and returns the mapObject client is standing on
  */
-enum mapObjecT_t whichMapObject(clientInfo_t *a) {
-    return (enum mapObjecT_t) MAP_CURRENT->map[(int) a->y][(int) a->x];
+enum mapObjecT_t whichMapObject(int player) {
+    int x = (int) playerData.x[player];
+    int y = (int) playerData.y[player];
+    if (x < 0 || y < 0 || x >= MAP_CURRENT->width || y >= MAP_CURRENT->height) return Wall;
+    return (enum mapObjecT_t) MAP_CURRENT->map[y * MAP_CURRENT->width + x];
 }
 
 /**
  * Resets map object to None on the tile which client is standing on
  */
-void resetMapObject(clientInfo_t *a) {
-    MAP_CURRENT->map[(int) a->y][(int) a->x] = None;
+void resetMapObject(int player) {
+    setMapObject((int) playerData.x[player], (int) playerData.y[player], None);
+}
+
+/**
+ * Changes a tile of the current map and records it in the change journal (sent to clients as MAP_DELTA)
+ * Must be called with clientArrLock held, playerSender reads the journal under it
+ */
+void setMapObject(int x, int y, enum mapObjecT_t mapObject) {
+    char *tile = &MAP_CURRENT->map[y * MAP_CURRENT->width + x];
+    MAP_CURRENT->dotsRemaining += (mapObject == Dot) - (*tile == Dot);
+    *tile = (char) mapObject;
+    if (MAP_CURRENT->changeCount == MAP_CURRENT->changeCapacity) {
+        MAP_CURRENT->changeCapacity = MAP_CURRENT->changeCapacity ? MAP_CURRENT->changeCapacity * 2 : 256;
+        tileChange_t *changes = realloc(MAP_CURRENT->changes, MAP_CURRENT->changeCapacity * sizeof(tileChange_t));
+        if (!changes) {
+            fprintf(stderr, "%s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        MAP_CURRENT->changes = changes;
+    }
+    tileChange_t change = {x, y, mapObject};
+    MAP_CURRENT->changes[MAP_CURRENT->changeCount++] = change;
+}
+
+
+/**
+ * Movement kernel, moves every alive player by TICK_MOVEMENT in its direction
+ * Works in passes over playerData without branches per player: candidate positions, wall bitmap lookups, commit
+ * A candidate outside of the map counts as a wall
+ * Also counts the ticks moved with the last MOVE, clients replay their moves which these ticks don't cover
+ */
+void movePlayers() {
+    const float *stepX = movementStepX;
+    const float *stepY = movementStepY;
+    const uint8_t *walls = MAP_CURRENT->file.walls;
+    const unsigned int width = (unsigned int) MAP_CURRENT->width;
+    const unsigned int height = (unsigned int) MAP_CURRENT->height;
+    float newX[MAX_SLOTS];
+    float newY[MAX_SLOTS];
+    uint8_t blocked[MAX_SLOTS];
+
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        uint32_t alive = (uint32_t) (playerData.active[i] & (playerData.state[i] != DEAD));
+        float moving = (float) alive;
+        newX[i] = playerData.x[i] + stepX[playerData.movement[i] & 3] * moving;
+        newY[i] = playerData.y[i] + stepY[playerData.movement[i] & 3] * moving;
+        uint32_t sameMove = (uint32_t) (playerData.ackedSequence[i] == playerData.moveSequence[i]);
+        playerData.ackedTicks[i] = playerData.ackedTicks[i] * sameMove + alive;
+        playerData.ackedSequence[i] = playerData.moveSequence[i];
+    }
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        unsigned int x = (unsigned int) (int) newX[i];
+        unsigned int y = (unsigned int) (int) newY[i];
+        uint8_t outside = (uint8_t) ((x >= width) | (y >= height));
+        size_t tile = outside ? 0 : (size_t) y * width + x;
+        blocked[i] = (uint8_t) (outside | ((walls[tile >> 3] >> (tile & 7)) & 1));
+    }
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        playerData.x[i] = blocked[i] ? playerData.x[i] : newX[i];
+        playerData.y[i] = blocked[i] ? playerData.y[i] : newY[i];
+    }
+}
+
+/**
+ * Buckets the active players into interestGrid cells and picks the ones whose distant update is due this tick
+ * Called by processTick with clientArrLock held
+ */
+void updateInterestGrid(unsigned long int tick) {
+    int width = (MAP_CURRENT->width + AOI_CELL_SIZE - 1) / AOI_CELL_SIZE;
+    int height = (MAP_CURRENT->height + AOI_CELL_SIZE - 1) / AOI_CELL_SIZE;
+    size_t size = (size_t) width * height;
+    // Readers (playerSender) hold clientArrLock too, so they never see the grid of a reset arena
+    interestGrid.head = scratchAlloc(size * sizeof(int));
+    interestGrid.width = width;
+    interestGrid.height = height;
+    interestGrid.tick = tick;
+    for (size_t i = 0; i < size; i++) interestGrid.head[i] = -1;
+
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        if (!playerData.active[i]) continue;
+        int cellX = (int) playerData.x[i] / AOI_CELL_SIZE;
+        int cellY = (int) playerData.y[i] / AOI_CELL_SIZE;
+        if (cellX < 0 || cellY < 0 || cellX >= width || cellY >= height) continue;
+        int cell = cellY * width + cellX;
+        interestGrid.next[i] = interestGrid.head[cell];
+        interestGrid.head[cell] = i;
+    }
+}
+
+/**
+ * Adds the PLAYERS entries which the player in viewer slot gets this tick: everyone within AOI_RADIUS,
+ * everyone in sight within AOI_SIGHT_RANGE and the others whose update is due. Returns the entry count
+ * farDue holds the viewer's own schedule, a player is due once AOI_FAR_INTERVAL ticks passed since the viewer
+ * last got it, so snapshots skipped by rate adaptation or a late sender never starve anyone
+ * Called by playerSender with clientArrLock held
+ */
+int encodeNearbyPlayers(packetWriter_t *writer, int viewer, unsigned long int *farDue) {
+    int x = (int) playerData.x[viewer];
+    int y = (int) playerData.y[viewer];
+    unsigned long int tick = interestGrid.tick;
+    int objectCount = 0;
+    bool sent[MAX_SLOTS] = {false};
+
+    // Cells which can hold anyone within AOI_SIGHT_RANGE
+    int minX = x - AOI_SIGHT_RANGE < 0 ? 0 : (x - AOI_SIGHT_RANGE) / AOI_CELL_SIZE;
+    int minY = y - AOI_SIGHT_RANGE < 0 ? 0 : (y - AOI_SIGHT_RANGE) / AOI_CELL_SIZE;
+    int maxX = (x + AOI_SIGHT_RANGE) / AOI_CELL_SIZE;
+    int maxY = (y + AOI_SIGHT_RANGE) / AOI_CELL_SIZE;
+    if (maxX >= interestGrid.width) maxX = interestGrid.width - 1;
+    if (maxY >= interestGrid.height) maxY = interestGrid.height - 1;
+
+    for (int cellY = minY; cellY <= maxY; cellY++) {
+        for (int cellX = minX; cellX <= maxX; cellX++) {
+            for (int i = interestGrid.head[cellY * interestGrid.width + cellX]; i >= 0; i = interestGrid.next[i]) {
+                if (!playerData.active[i]) continue; // Left after the grid was built
+                int otherX = (int) playerData.x[i];
+                int otherY = (int) playerData.y[i];
+                bool near = abs(otherX - x) <= AOI_RADIUS && abs(otherY - y) <= AOI_RADIUS;
+                if (!near && (abs(otherX - x) > AOI_SIGHT_RANGE || abs(otherY - y) > AOI_SIGHT_RANGE ||
+                              !inLineOfSight(x, y, otherX, otherY))) {
+                    continue;
+                }
+                playerEntry_t entry = {playerData.id[i], playerData.x[i], playerData.y[i],
+                                       playerData.state[i], playerData.type[i]};
+                encodePlayerEntry(writer, &entry);
+                objectCount++;
+                sent[i] = true;
+            }
+        }
+    }
+
+    // Everyone else only gets the distant updates
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        if (!playerData.active[i]) continue;
+        // Dues from a previous game (TICK starts again from 0) are far ahead
+        bool due = farDue[i] <= tick || farDue[i] > tick + AOI_FAR_INTERVAL;
+        if (!sent[i] && due) {
+            playerEntry_t entry = {playerData.id[i], playerData.x[i], playerData.y[i],
+                                   playerData.state[i], playerData.type[i]};
+            encodePlayerEntry(writer, &entry);
+            objectCount++;
+            sent[i] = true;
+        }
+        if (!sent[i]) continue;
+        // The first update is spread over the interval by slot, so the distant players don't all arrive together
+        farDue[i] = farDue[i] == 0 ? tick + 1 + i % AOI_FAR_INTERVAL : tick + AOI_FAR_INTERVAL;
+    }
+    return objectCount;
+}
+
+/**
+ * Walks the tiles on the line between two tiles (Bresenham), returns false if any of them is a wall
+ */
+bool inLineOfSight(int x0, int y0, int x1, int y1) {
+    const uint8_t *walls = MAP_CURRENT->file.walls;
+    const int width = MAP_CURRENT->width;
+    int dx = abs(x1 - x0);
+    int dy = -abs(y1 - y0);
+    int stepX = x0 < x1 ? 1 : -1;
+    int stepY = y0 < y1 ? 1 : -1;
+    int error = dx + dy;
+    while (x0 != x1 || y0 != y1) {
+        size_t tile = (size_t) y0 * width + x0;
+        if ((walls[tile >> 3] >> (tile & 7)) & 1) return false;
+        int error2 = 2 * error;
+        if (error2 >= dy) {
+            error += dy;
+            x0 += stepX;
+        }
+        if (error2 <= dx) {
+            error += dx;
+            y0 += stepY;
+        }
+    }
+    return true;
+}
+
+/**
+ * Names the bots and gives them player IDs, bots take part in every game from now on
+ */
+void initBots() {
+    for (int i = 0; i < BOT_COUNT; i++) {
+        int slot = MAX_PLAYERS + i;
+        snprintf(botNames[i], sizeof(botNames[i]), "Bot %d", i + 1);
+        playerData.id[slot] = slotPlayerId(slot);
+        playerData.active[slot] = false;
+        playerData.score[slot] = 0;
+        playerData.movement[slot] = UP;
+    }
+    if (BOT_COUNT > 0) printf("INFO:\t%d bots will join every game\n", BOT_COUNT);
+}
+
+/**
+ * Multi-source BFS over the current map, the sources are the first sourceCount tiles in flowFields.queue
+ * field receives the number of steps from every tile to the nearest source, walls and unreachable tiles
+ * are left at MAP_DISTANCE_UNREACHABLE
+ */
+void computeFlowField(uint16_t *field, int sourceCount) {
+    const uint8_t *walls = MAP_CURRENT->file.walls;
+    const uint32_t width = (uint32_t) MAP_CURRENT->width;
+    const size_t size = flowFields.size;
+    uint32_t *queue = flowFields.queue;
+    size_t head = 0;
+    size_t tail = 0;
+
+    memset(field, 0xFF, size * sizeof(uint16_t));
+    for (int i = 0; i < sourceCount; i++) {
+        if (field[queue[i]] != 0) { // Several sources on one tile are queued once
+            field[queue[i]] = 0;
+            queue[tail++] = queue[i];
+        }
+    }
+    while (head < tail) {
+        uint32_t tile = queue[head++];
+        uint32_t x = tile % width;
+        uint16_t distance = field[tile] + 1;
+        if (distance == MAP_DISTANCE_UNREACHABLE) distance--; // Longer paths are capped
+        uint32_t neighbours[4];
+        int neighbourCount = 0;
+        if (tile >= width) neighbours[neighbourCount++] = tile - width;
+        if (tile + width < size) neighbours[neighbourCount++] = tile + width;
+        if (x + 1 < width) neighbours[neighbourCount++] = tile + 1;
+        if (x > 0) neighbours[neighbourCount++] = tile - 1;
+        for (int i = 0; i < neighbourCount; i++) {
+            uint32_t next = neighbours[i];
+            if (field[next] == MAP_DISTANCE_UNREACHABLE && !((walls[next >> 3] >> (next & 7)) & 1)) {
+                field[next] = distance;
+                queue[tail++] = next;
+            }
+        }
+    }
+}
+
+/**
+ * Returns the direction a bot in the slot should take to get closer to (or away from) the field's sources
+ * Only the 4 neighbouring tiles are compared, the current direction wins ties so bots don't turn back and forth
+ */
+enum clientMovement_t followFlowField(const uint16_t *field, int slot, bool away) {
+    static const int stepX[4] = {0, 0, 1, -1};
+    static const int stepY[4] = {-1, 1, 0, 0};
+    int x = (int) playerData.x[slot];
+    int y = (int) playerData.y[slot];
+    int width = MAP_CURRENT->width;
+    enum clientMovement_t current = (enum clientMovement_t) (playerData.movement[slot] & 3);
+    enum clientMovement_t best = current;
+    long bestScore = -1;
+
+    for (int i = 0; i < 4; i++) {
+        enum clientMovement_t direction = (enum clientMovement_t) ((current + i) & 3);
+        int nx = x + stepX[direction];
+        int ny = y + stepY[direction];
+        if (nx < 0 || ny < 0 || nx >= width || ny >= MAP_CURRENT->height) continue;
+        uint16_t distance = field[ny * width + nx];
+        if (distance == MAP_DISTANCE_UNREACHABLE) continue; // Wall or another component
+        long score = away ? distance : MAP_DISTANCE_UNREACHABLE - distance;
+        if (score > bestScore) {
+            bestScore = score;
+            best = direction;
+        }
+    }
+    return best;
 }
 
+/**
+ * Sets the movement of every alive bot, called by processTick with clientArrLock held
+ * Each flow field is computed once per tick for all bots, so the cost is O(map + players) no matter how many bots play
+ *  Ghost bots chase the nearest Pacman which can be killed
+ *  Pacman bots hunt Ghosts while they have PowerPellet, run from Ghosts which are too close and eat otherwise
+ */
+void steerBots() {
+    size_t size = (size_t) MAP_CURRENT->width * MAP_CURRENT->height;
+    int width = MAP_CURRENT->width;
+    bool ghostBots = false;
+    bool pacmanBots = false;
+
+    for (int i = MAX_PLAYERS; i < MAX_PLAYERS + BOT_COUNT; i++) {
+        if (playerData.active[i] && playerData.state[i] != DEAD) {
+            if (playerData.type[i] == Ghost) ghostBots = true;
+            else pacmanBots = true;
+        }
+    }
+    if (!ghostBots && !pacmanBots) return;
+
+    // Only the fields some bot follows this tick are taken
+    flowFields.size = size;
+    flowFields.queue = scratchAlloc(size * sizeof(uint32_t));
+    flowFields.toPacman = ghostBots ? scratchAlloc(size * sizeof(uint16_t)) : NULL;
+    flowFields.toGhost = pacmanBots ? scratchAlloc(size * sizeof(uint16_t)) : NULL;
+    flowFields.toFood = pacmanBots ? scratchAlloc(size * sizeof(uint16_t)) : NULL;
+
+    // Players stand inside the map (movePlayers keeps them there), their tiles are the sources
+    int pacmanCount = 0;
+    int ghostCount = 0;
+    if (ghostBots) {
+        for (int i = 0; i < MAX_SLOTS; i++) {
+            if (playerData.active[i] && playerData.type[i] == Pacman &&
+                playerData.state[i] != DEAD && playerData.state[i] != powerupPowerPellet) {
+                flowFields.queue[pacmanCount++] = (uint32_t) ((int) playerData.y[i] * width + (int) playerData.x[i]);
+            }
+        }
+        computeFlowField(flowFields.toPacman, pacmanCount);
+    }
+    if (pacmanBots) {
+        for (int i = 0; i < MAX_SLOTS; i++) {
+            if (playerData.active[i] && playerData.type[i] == Ghost && playerData.state[i] != DEAD) {
+                flowFields.queue[ghostCount++] = (uint32_t) ((int) playerData.y[i] * width + (int) playerData.x[i]);
+            }
+        }
+        computeFlowField(flowFields.toGhost, ghostCount);
+
+        int foodCount = 0;
+        for (size_t tile = 0; tile < size; tile++) {
+            char mapObject = MAP_CURRENT->map[tile];
+            if (mapObject == Dot || mapObject == Score || mapObject == PowerPellet || mapObject == Invincibility) {
+                flowFields.queue[foodCount++] = (uint32_t) tile;
+            }
+        }
+        computeFlowField(flowFields.toFood, foodCount);
+    }
+
+    for (int i = MAX_PLAYERS; i < MAX_PLAYERS + BOT_COUNT; i++) {
+        if (!playerData.active[i] || playerData.state[i] == DEAD) continue;
+        if (playerData.type[i] == Ghost) {
+            if (pacmanCount > 0) playerData.movement[i] = followFlowField(flowFields.toPacman, i, false);
+        } else if (playerData.state[i] == powerupPowerPellet && ghostCount > 0) {
+            playerData.movement[i] = followFlowField(flowFields.toGhost, i, false);
+        } else if (ghostCount > 0 && playerData.state[i] != powerupInvincibility &&
+                   flowFields.toGhost[(int) playerData.y[i] * width + (int) playerData.x[i]] < BOT_FLEE_DISTANCE) {
+            playerData.movement[i] = followFlowField(flowFields.toGhost, i, true);
+        } else {
+            playerData.movement[i] = followFlowField(flowFields.toFood, i, false);
+        }
+    }
+}
 
 /**
  * Collision detection, powerup and player movement function executed once per tick
  */
 void processTick(unsigned long int *TICK) {
     pthread_mutex_lock(&clientArrLock);
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        clientInfo_t *player = clientArr[i];
-        if (player && player->active && player->playerState != DEAD) {
+    // Temporary data of the last tick (bot fields, interest grid) isn't needed anymore
+    scratchReset();
+    for (int player = 0; player < MAX_SLOTS; player++) {
+        if (playerData.active[player] && playerData.state[player] != DEAD) {
 
             // Check if player has any powerups and if there are decrease their tick
-            if (player->playerState != NORMAL) {
-                player->powerupTick--; //Decrease tick
-                if (player->powerupTick == 0)
-                    player->playerState = NORMAL; //If the tick is at 0 make sure that playerState is NORMAL
+            if (playerData.state[player] != NORMAL) {
+                playerData.powerupTick[player]--; //Decrease tick
+                if (playerData.powerupTick[player] == 0)
+                    playerData.state[player] = NORMAL; //If the tick is at 0 make sure that playerState is NORMAL
             }
 
             // Check if player has a collision with something
@@ -1311,16 +4020,14 @@ void processTick(unsigned long int *TICK) {
              * Ghost -> Pacman
              * Pacman DEAD if he does not have invincibility or powerpellet
              */
-            if (player->playerType == Ghost) {
-                for (int j = 0; j < MAX_PLAYERS; j++) {
-                    if (clientArr[j] && clientArr[j]->active &&
-                        clientArr[j]->playerType == Pacman) { //Find all Pacmans
-                        clientInfo_t *pacman = clientArr[j];
-                        if (pacman->playerState == NORMAL) { //Make sure that Pacman doesn't have any powerups
+            if (playerData.type[player] == Ghost) {
+                for (int pacman = 0; pacman < MAX_SLOTS; pacman++) {
+                    if (playerData.active[pacman] && playerData.type[pacman] == Pacman) { //Find all Pacmans
+                        if (playerData.state[pacman] == NORMAL) { //Make sure that Pacman doesn't have any powerups
                             if (sameTile(pacman,
                                          player)) { //If both of them are on the same tile kill pacman and increase Ghost score
-                                pacman->playerState = DEAD;
-                                player->score += SCORE_GHOST_KILL;
+                                playerData.state[pacman] = DEAD;
+                                playerData.score[player] += SCORE_GHOST_KILL;
                             }
                         }
                     }
@@ -1336,31 +4043,34 @@ void processTick(unsigned long int *TICK) {
              * If it is DOT increase players score
              * Remove mapObject from tile -> (None)
              */
-            if (player->playerType == Pacman) {
-                if (whichMapObject(player) == PowerPellet) {
+            if (playerData.type[player] == Pacman) {
+                enum mapObjecT_t mapObject = whichMapObject(player);
+                if (mapObject == PowerPellet) {
                     if (debugLevel >= DEBUG)
-                        printf("DEBUG:\t%s ate powerPellet at (%d:%d)\n", player->name, (int) player->x,
-                               (int) player->y);
-                    player->playerState = powerupPowerPellet;
-                    player->powerupTick = POWERUP_PowerPellet_TICKS;
+                        printf("DEBUG:\t%s ate powerPellet at (%d:%d)\n", playerName(player),
+                               (int) playerData.x[player], (int) playerData.y[player]);
+                    playerData.state[player] = powerupPowerPellet;
+                    playerData.powerupTick[player] = POWERUP_PowerPellet_TICKS;
                     resetMapObject(player);
 
-                } else if (whichMapObject(player) == Invincibility) {
+                } else if (mapObject == Invincibility) {
                     if (debugLevel >= DEBUG)
-                        printf("DEBUG:\t%s ate Invincibility at (%d:%d)\n", player->name, (int) player->x,
-                               (int) player->y);
-                    player->playerState = powerupInvincibility;
-                    player->powerupTick = POWERUP_Invincibility_TICKS;
+                        printf("DEBUG:\t%s ate Invincibility at (%d:%d)\n", playerName(player),
+                               (int) playerData.x[player], (int) playerData.y[player]);
+                    playerData.state[player] = powerupInvincibility;
+                    playerData.powerupTick[player] = POWERUP_Invincibility_TICKS;
                     resetMapObject(player);
-                } else if (whichMapObject(player) == SCORE) {
+                } else if (mapObject == Score) {
                     if (debugLevel >= DEBUG)
-                        printf("DEBUG:\t%s ate SCORE at (%d:%d)\n", player->name, (int) player->x, (int) player->y);
-                    player->score += SCORE_POINTS;
+                        printf("DEBUG:\t%s ate SCORE at (%d:%d)\n", playerName(player),
+                               (int) playerData.x[player], (int) playerData.y[player]);
+                    playerData.score[player] += SCORE_POINTS;
                     resetMapObject(player);
-                } else if (whichMapObject(player) == Dot) {
+                } else if (mapObject == Dot) {
                     if (debugLevel >= DEBUG)
-                        printf("DEBUG:\t%s ate Dot at (%d:%d)\n", player->name, (int) player->x, (int) player->y);
-                    player->score += DOT_POINTS;
+                        printf("DEBUG:\t%s ate Dot at (%d:%d)\n", playerName(player),
+                               (int) playerData.x[player], (int) playerData.y[player]);
+                    playerData.score[player] += DOT_POINTS;
                     resetMapObject(player);
                 }
 
@@ -1376,14 +4086,13 @@ void processTick(unsigned long int *TICK) {
              * Pacman -> Ghost
              * If Pacman has PowerPellet and they are on the same tile GHOST=DEAD
              */
-            if (player->playerType == Pacman) {
-                if (player->playerState == powerupPowerPellet) {
-                    for (int j = 0; j < MAX_PLAYERS; j++) {
-                        if (clientArr[j] && clientArr[j]->active && clientArr[j]->playerType == Ghost) {
-                            clientInfo_t *ghost = clientArr[j];
+            if (playerData.type[player] == Pacman) {
+                if (playerData.state[player] == powerupPowerPellet) {
+                    for (int ghost = 0; ghost < MAX_SLOTS; ghost++) {
+                        if (playerData.active[ghost] && playerData.type[ghost] == Ghost) {
                             if (sameTile(player, ghost)) {
-                                ghost->playerState = DEAD;
-                                player->score += SCORE_PACMAN_KILL;
+                                playerData.state[ghost] = DEAD;
+                                playerData.score[player] += SCORE_PACMAN_KILL;
                             }
                         }
                     }
@@ -1391,58 +4100,42 @@ void processTick(unsigned long int *TICK) {
             }
 
 
-            /* Both -> Wall
-             * Move the player by TICK_MOVEMENT
-             * If the player is standing on a wall move him back
-             */
-            if (player->clientMovement == UP) {
-                player->y -= TICK_MOVEMENT;
-                if (whichMapObject(player) == Wall) {
-                    player->y += TICK_MOVEMENT;
-                }
-            } else if (player->clientMovement == DOWN) {
-                player->y += TICK_MOVEMENT;
-                if (whichMapObject(player) == Wall) {
-                    player->y -= TICK_MOVEMENT;
-                }
-            } else if (player->clientMovement == LEFT) {
-                player->x -= TICK_MOVEMENT;
-                if (whichMapObject(player) == Wall) {
-                    player->x += TICK_MOVEMENT;
-                }
-            } else if (player->clientMovement == RIGHT) {
-                player->x += TICK_MOVEMENT;
-                if (whichMapObject(player) == Wall) {
-                    player->x -= TICK_MOVEMENT;
-                }
-            }
-
         }
     }
-    pthread_mutex_unlock(&clientArrLock);
+
+    // Bots pick their direction before everyone is moved
+    if (BOT_COUNT > 0) steerBots();
+
+    /* Both -> Wall
+     * Move the players by TICK_MOVEMENT, moves into a wall are undone
+     */
+    movePlayers();
+    tickStamp.tick = (uint32_t) *TICK;
+    tickStamp.time = clockMs();
+    updateInterestGrid(*TICK);
 
     //Spawn a powerup in almost random position
-    srand((unsigned int) time(0)); //Seed PRNG
     int x, y;
     enum mapObjecT_t mapObject;
     if ((*TICK % POWERUP_Invincibility_SPAWN_TICKS) == 0) {
         do {
             x = rand() % MAP_CURRENT->width;
             y = rand() % MAP_CURRENT->height;
-            mapObject = (enum mapObjecT_t) MAP_CURRENT->map[y][x];
+            mapObject = (enum mapObjecT_t) MAP_CURRENT->map[y * MAP_CURRENT->width + x];
         } while (mapObject != Score && mapObject != None && mapObject != Dot);
-        MAP_CURRENT->map[y][x] = Invincibility;
+        setMapObject(x, y, Invincibility);
         if (debugLevel >= DEBUG) printf("DEBUG:\tSpawned Invincibility at (%d:%d)\n", x, y);
     }
     if ((*TICK % POWERUP_PowerPellet_SPAWN_TICKS) == 0) {
         do {
             x = rand() % MAP_CURRENT->width;
             y = rand() % MAP_CURRENT->height;
-            mapObject = (enum mapObjecT_t) MAP_CURRENT->map[y][x];
+            mapObject = (enum mapObjecT_t) MAP_CURRENT->map[y * MAP_CURRENT->width + x];
         } while (mapObject != Score && mapObject != None && mapObject != Dot);
-        MAP_CURRENT->map[y][x] = powerupPowerPellet;
+        setMapObject(x, y, PowerPellet);
         if (debugLevel >= DEBUG) printf("DEBUG:\tSpawned powerPellet at (%d:%d)\n", x, y);
     }
+    pthread_mutex_unlock(&clientArrLock);
 
 }
 
@@ -0,0 +1,282 @@
+/*
+ * LSP Kursa projekts
+ * Kopīgais kods - TCP plūsmas sadalīšana paketēs
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "framing.h"
+
+/**
+ * Initializes an empty reassembly buffer, memory is allocated on the first read
+ * Peers which announce a frame larger than maxPayload (at most FRAME_MAX_PAYLOAD_SIZE) break the stream
+ */
+void frameStreamInit(frameStream_t *stream, size_t maxPayload) {
+    stream->data = NULL;
+    stream->length = 0;
+    stream->offset = 0;
+    stream->capacity = 0;
+    stream->maxPayload = maxPayload < FRAME_MAX_PAYLOAD_SIZE ? maxPayload : FRAME_MAX_PAYLOAD_SIZE;
+}
+
+/**
+ * Releases memory held by the reassembly buffer, it can be used again with the same limit
+ */
+void frameStreamFree(frameStream_t *stream) {
+    free(stream->data);
+    frameStreamInit(stream, stream->maxPayload);
+}
+
+/**
+ * Reads whatever is available from the socket (single recv call) into the reassembly buffer
+ * Already returned frames are discarded first, so payload pointers from frameStreamNext become invalid
+ * Returns the recv result: bytes read, 0 if the peer closed the connection, -1 on error
+ */
+ssize_t frameStreamRead(frameStream_t *stream, int sock) {
+    // Move the unfinished frame to the start of the buffer
+    if (stream->offset > 0) {
+        memmove(stream->data, stream->data + stream->offset, stream->length - stream->offset);
+        stream->length -= stream->offset;
+        stream->offset = 0;
+    }
+
+    // Make sure there is room for the pending frame or at least FRAME_READ_SIZE bytes
+    size_t needed = stream->length + FRAME_READ_SIZE;
+    if (stream->length >= FRAME_HEADER_SIZE) {
+        uint32_t payloadLength;
+        memcpy(&payloadLength, stream->data, FRAME_HEADER_SIZE);
+        payloadLength = ntohl(payloadLength);
+        if (payloadLength <= stream->maxPayload && FRAME_HEADER_SIZE + payloadLength > needed) {
+            needed = FRAME_HEADER_SIZE + payloadLength;
+        }
+    }
+    if (needed > stream->capacity) {
+        char *data = realloc(stream->data, needed);
+        if (data == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        stream->data = data;
+        stream->capacity = needed;
+    }
+
+    ssize_t readSize;
+    do {
+        readSize = recv(sock, stream->data + stream->length, stream->capacity - stream->length, 0);
+    } while (readSize < 0 && errno == EINTR);
+    if (readSize > 0) stream->length += readSize;
+    return readSize;
+}
+
+/**
+ * Appends bytes which were received elsewhere (i.e. by another process before a handoff) to the buffer
+ * Returns false if there is not enough memory
+ */
+bool frameStreamAppend(frameStream_t *stream, const char *data, size_t length) {
+    if (stream->length + length > stream->capacity) {
+        char *grown = realloc(stream->data, stream->length + length);
+        if (grown == NULL) return false;
+        stream->data = grown;
+        stream->capacity = stream->length + length;
+    }
+    memcpy(stream->data + stream->length, data, length);
+    stream->length += length;
+    return true;
+}
+
+/**
+ * Returns true if frameStreamNext won't wait for more data: a complete frame (or an invalid one) is buffered
+ */
+bool frameStreamReady(const frameStream_t *stream) {
+    size_t available = stream->length - stream->offset;
+    if (available < FRAME_HEADER_SIZE) return false;
+
+    uint32_t payloadLength;
+    memcpy(&payloadLength, stream->data + stream->offset, FRAME_HEADER_SIZE);
+    payloadLength = ntohl(payloadLength);
+    return payloadLength > stream->maxPayload || available >= FRAME_HEADER_SIZE + payloadLength;
+}
+
+/**
+ * Returns the next complete frame from the reassembly buffer
+ *  1 - frame found, payload and length point to it (valid until the next frameStreamRead)
+ *  0 - more data has to be read
+ *  -1 - frame is larger than the stream's maxPayload, the stream can not be trusted anymore
+ */
+int frameStreamNext(frameStream_t *stream, char **payload, size_t *length) {
+    size_t available = stream->length - stream->offset;
+    if (available < FRAME_HEADER_SIZE) return 0;
+
+    uint32_t payloadLength;
+    memcpy(&payloadLength, stream->data + stream->offset, FRAME_HEADER_SIZE);
+    payloadLength = ntohl(payloadLength);
+    if (payloadLength > stream->maxPayload) return -1;
+    if (available < FRAME_HEADER_SIZE + payloadLength) return 0;
+
+    *payload = stream->data + stream->offset + FRAME_HEADER_SIZE;
+    *length = payloadLength;
+    stream->offset += FRAME_HEADER_SIZE + payloadLength;
+    return 1;
+}
+
+/**
+ * Writes length prefix for a payload of the given size into header (FRAME_HEADER_SIZE bytes)
+ */
+void frameHeader(char *header, size_t length) {
+    uint32_t payloadLength = htonl((uint32_t) length);
+    memcpy(header, &payloadLength, FRAME_HEADER_SIZE);
+}
+
+/**
+ * Writes all iovec buffers to the socket, retrying on partial writes
+ * The iovec array is modified while writing
+ */
+ssize_t writeAll(int sock, struct iovec *iov, int iovCount) {
+    ssize_t total = 0;
+    while (iovCount > 0) {
+        ssize_t written = writev(sock, iov, iovCount);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += written;
+        // Skip the buffers which were written completely and advance into the partially written one
+        while (iovCount > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovCount--;
+        }
+        if (iovCount > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return total;
+}
+
+/**
+ * Sends a single length prefixed frame
+ */
+ssize_t frameSend(int sock, char *payload, size_t length) {
+    char header[FRAME_HEADER_SIZE];
+    frameHeader(header, length);
+    struct iovec iov[2] = {{header,  FRAME_HEADER_SIZE},
+                           {payload, length}};
+    return writeAll(sock, iov, 2);
+}
+
+/**
+ * Initializes an empty frame buffer, memory is allocated when the first frame is added
+ */
+void frameBufferInit(frameBuffer_t *buffer) {
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->size = 0;
+}
+
+/**
+ * Releases memory held by the frame buffer
+ */
+void frameBufferFree(frameBuffer_t *buffer) {
+    free(buffer->data);
+    frameBufferInit(buffer);
+}
+
+/**
+ * Grows the buffer so that extra more bytes fit in it, returns false if there is no memory
+ */
+bool frameBufferReserve(frameBuffer_t *buffer, size_t extra) {
+    if (buffer->length + extra <= buffer->size) return true;
+    size_t size = buffer->size ? buffer->size : FRAME_READ_SIZE;
+    while (size < buffer->length + extra) size *= 2;
+    char *data = realloc(buffer->data, size);
+    if (data == NULL) return false;
+    buffer->data = data;
+    buffer->size = size;
+    return true;
+}
+
+/**
+ * Starts a frame with up to maxPayload bytes at the end of the buffer
+ * Returns where its payload goes (finished with frameBufferEnd), NULL if there is no memory
+ */
+char *frameBufferBegin(frameBuffer_t *buffer, size_t maxPayload) {
+    if (!frameBufferReserve(buffer, FRAME_HEADER_SIZE + maxPayload)) return NULL;
+    return buffer->data + buffer->length + FRAME_HEADER_SIZE;
+}
+
+/**
+ * Finishes the frame started with frameBufferBegin once its payload has been written
+ */
+void frameBufferEnd(frameBuffer_t *buffer, size_t payloadLength) {
+    frameHeader(buffer->data + buffer->length, payloadLength);
+    buffer->length += FRAME_HEADER_SIZE + payloadLength;
+}
+
+/**
+ * Appends bytes which are already framed, returns false if there is no memory
+ */
+bool frameBufferAppend(frameBuffer_t *buffer, const char *data, size_t length) {
+    if (length == 0) return true;
+    if (!frameBufferReserve(buffer, length)) return false;
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+/**
+ * Writes the backlog followed by the frames without blocking, as far as the socket buffer takes them
+ * Whatever isn't written is kept in the backlog, which is sent first the next time
+ * Returns false if the connection failed
+ */
+bool frameBufferSend(frameBuffer_t *backlog, int sock, struct iovec *frames, int frameCount) {
+    struct iovec iov[frameCount + 1];
+    int iovCount = 0;
+    bool backlogged = backlog->length > 0;
+    if (backlogged) {
+        iov[iovCount].iov_base = backlog->data;
+        iov[iovCount++].iov_len = backlog->length;
+    }
+    for (int i = 0; i < frameCount; i++) {
+        iov[iovCount++] = frames[i];
+    }
+    if (iovCount == 0) return true;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = (size_t) iovCount;
+    ssize_t written = sendmsg(sock, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+        written = 0;
+    }
+
+    // Unwritten bytes move to the front of the backlog, the backlog itself is always the first buffer
+    size_t skip = (size_t) written;
+    size_t kept = 0;
+    for (int i = 0; i < iovCount; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        char *rest = (char *) iov[i].iov_base + skip;
+        size_t restLength = iov[i].iov_len - skip;
+        skip = 0;
+        if (i == 0 && backlogged) {
+            memmove(backlog->data, rest, restLength);
+        } else {
+            backlog->length = kept;
+            if (!frameBufferAppend(backlog, rest, restLength)) return false;
+        }
+        kept += restLength;
+    }
+    backlog->length = kept;
+    return true;
+}
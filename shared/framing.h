@@ -0,0 +1,80 @@
+/*
+ * LSP Kursa projekts
+ * Kopīgais kods - TCP plūsmas sadalīšana paketēs
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#ifndef LSP_P1_FRAMING_H
+#define LSP_P1_FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Every packet on the wire is prefixed with its length:
+ *  0-3 Payload length (uint32_t, network byte order)
+ *  4-... Payload (packet type followed by packet data)
+ */
+#define FRAME_HEADER_SIZE 4
+#define FRAME_MAX_PAYLOAD_SIZE (4 * 1024 * 1024) // Largest frame a stream may accept, i.e. a full MAP packet
+#define FRAME_READ_SIZE 16384                    // Minimum free space requested from recv per read
+
+/*
+ * Per connection reassembly buffer
+ * Holds bytes received from the socket until they form complete frames
+ */
+typedef struct frameStream {
+    char *data;         // Received bytes
+    size_t length;      // Bytes used in data
+    size_t offset;      // Start of the first frame which hasn't been returned yet
+    size_t capacity;    // Allocated size of data
+    size_t maxPayload;  // Frames larger than this are treated as a broken stream
+} frameStream_t;
+
+/*
+ * Growable buffer of outgoing frames, written to sockets as it is
+ * Also holds what a non-blocking socket didn't take (frameBufferSend)
+ */
+typedef struct frameBuffer {
+    char *data;
+    size_t length;      // Bytes used
+    size_t size;        // Allocated size of data
+} frameBuffer_t;
+
+void frameStreamInit(frameStream_t *, size_t);
+
+void frameStreamFree(frameStream_t *);
+
+ssize_t frameStreamRead(frameStream_t *, int);
+
+bool frameStreamAppend(frameStream_t *, const char *, size_t);
+
+bool frameStreamReady(const frameStream_t *);
+
+int frameStreamNext(frameStream_t *, char **, size_t *);
+
+void frameHeader(char *, size_t);
+
+ssize_t writeAll(int, struct iovec *, int);
+
+ssize_t frameSend(int, char *, size_t);
+
+void frameBufferInit(frameBuffer_t *);
+
+void frameBufferFree(frameBuffer_t *);
+
+bool frameBufferReserve(frameBuffer_t *, size_t);
+
+char *frameBufferBegin(frameBuffer_t *, size_t);
+
+void frameBufferEnd(frameBuffer_t *, size_t);
+
+bool frameBufferAppend(frameBuffer_t *, const char *, size_t);
+
+bool frameBufferSend(frameBuffer_t *, int, struct iovec *, int);
+
+#endif //LSP_P1_FRAMING_H
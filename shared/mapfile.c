@@ -0,0 +1,642 @@
+/*
+ * LSP Kursa projekts
+ * Kopīgais kods - karšu failu ielāde
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mapfile.h"
+
+/**
+ * Fills the error position and message
+ */
+static void mapError(mapFileError_t *error, int line, int column, const char *message) {
+    error->line = line;
+    error->column = column;
+    snprintf(error->message, MAP_ERROR_SIZE, "%s", message);
+}
+
+/**
+ * Returns the length of the row starting at data (without the line ending) and the start of the next row
+ */
+static size_t nextRow(const char *data, const char *end, const char **next) {
+    const char *newline = memchr(data, '\n', (size_t) (end - data));
+    size_t length;
+    if (newline) {
+        length = (size_t) (newline - data);
+        *next = newline + 1;
+    } else {
+        length = (size_t) (end - data);
+        *next = end;
+    }
+    if (length > 0 && data[length - 1] == '\r') length--;
+    return length;
+}
+
+/**
+ * Converts a row of ASCII digits to mapObjecT_t values
+ * Returns the index of the first character which isn't a map object, or length if the whole row is valid
+ */
+static size_t convertRow(const char *row, char *tiles, size_t length) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // 16 tiles per step: subtract '0' and check that every byte is <= Score as unsigned
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i limit = _mm_set1_epi8(Score);
+    for (; i + 16 <= length; i += 16) {
+        __m128i tile = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (row + i)), zero);
+        __m128i valid = _mm_cmpeq_epi8(_mm_max_epu8(tile, limit), limit);
+        if (_mm_movemask_epi8(valid) != 0xFFFF) break; // Scalar loop finds the exact position
+        _mm_storeu_si128((__m128i *) (tiles + i), tile);
+    }
+#endif
+    for (; i < length; i++) {
+        unsigned char tile = (unsigned char) (row[i] - '0');
+        if (tile > Score) return i;
+        tiles[i] = (char) tile;
+    }
+    return length;
+}
+
+/**
+ * Parses a text map from memory
+ * The first pass splits rows to find the map size, the second one converts the rows into the allocated tiles
+ */
+bool parseMapText(const char *data, size_t size, mapFile_t *map, mapFileError_t *error) {
+    const char *end = data + size;
+    const char *row;
+    const char *next;
+    size_t width = 0;
+    size_t height = 0;
+
+    memset(map, 0, sizeof(mapFile_t));
+    for (row = data; row < end; row = next) {
+        size_t length = nextRow(row, end, &next);
+        if (length > width) width = length;
+        height++;
+    }
+
+    if (width == 0) {
+        mapError(error, 0, 0, "Map is empty");
+        return false;
+    }
+    if (width > MAX_MAP_WIDTH || height > MAX_MAP_HEIGHT || width * height > MAX_MAP_SIZE) {
+        char message[MAP_ERROR_SIZE];
+        snprintf(message, MAP_ERROR_SIZE, "Map is too large (%zux%zu)", width, height);
+        mapError(error, 0, 0, message);
+        return false;
+    }
+
+    map->width = (int) width;
+    map->height = (int) height;
+    if ((map->tiles = malloc(width * height)) == NULL) {
+        mapError(error, 0, 0, strerror(errno));
+        return false;
+    }
+
+    char *tiles = map->tiles;
+    for (row = data; row < end; row = next, tiles += width) {
+        size_t length = nextRow(row, end, &next);
+        size_t bad = convertRow(row, tiles, length);
+        if (bad < length) {
+            mapError(error, (int) ((tiles - map->tiles) / width) + 1, (int) bad + 1, "Incorrect character");
+            freeMapFile(map);
+            return false;
+        }
+        memset(tiles + length, None, width - length);
+    }
+    return true;
+}
+
+/**
+ * Loads a text map file, the file is mapped into memory instead of being read
+ */
+bool loadMapText(const char *path, mapFile_t *map, mapFileError_t *error) {
+    struct stat info;
+    bool loaded;
+
+    memset(map, 0, sizeof(mapFile_t));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        mapError(error, 0, 0, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &info) < 0) {
+        mapError(error, 0, 0, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        mapError(error, 0, 0, "Map is empty");
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        mapError(error, 0, 0, strerror(errno));
+        return false;
+    }
+    madvise(data, (size_t) info.st_size, MADV_SEQUENTIAL);
+    loaded = parseMapText(data, (size_t) info.st_size, map, error);
+    munmap(data, (size_t) info.st_size);
+    return loaded;
+}
+
+/**
+ * Allocates zeroed memory for a metadata array, fills the error on failure
+ */
+static void *allocMetadata(size_t count, size_t size, mapFileError_t *error) {
+    void *data = calloc(count ? count : 1, size);
+    if (!data) mapError(error, 0, 0, strerror(errno));
+    return data;
+}
+
+/**
+ * Breadth first search from start over tiles of the same component, fills walking distance to every tile
+ * Tiles which can't be reached are left at UINT32_MAX
+ */
+static void walkComponent(const mapFile_t *map, uint32_t start, uint32_t *queue, uint32_t *distances) {
+    size_t size = (size_t) map->width * map->height;
+    size_t head = 0;
+    size_t tail = 0;
+    int32_t component = map->components[start];
+
+    for (size_t i = 0; i < size; i++) distances[i] = UINT32_MAX;
+    distances[start] = 0;
+    queue[tail++] = start;
+    while (head < tail) {
+        uint32_t tile = queue[head++];
+        int x = (int) (tile % map->width);
+        int y = (int) (tile / map->width);
+        uint32_t neighbours[4];
+        int count = 0;
+        if (x > 0) neighbours[count++] = tile - 1;
+        if (x < map->width - 1) neighbours[count++] = tile + 1;
+        if (y > 0) neighbours[count++] = tile - map->width;
+        if (y < map->height - 1) neighbours[count++] = tile + map->width;
+        for (int i = 0; i < count; i++) {
+            if (map->components[neighbours[i]] == component && distances[neighbours[i]] == UINT32_MAX) {
+                distances[neighbours[i]] = distances[tile] + 1;
+                queue[tail++] = neighbours[i];
+            }
+        }
+    }
+}
+
+/**
+ * Tile counts, wall bitmap and spawnable tiles (same rule as the old spawn search: not Wall or None)
+ */
+static bool computeTileMetadata(mapFile_t *map, mapFileError_t *error) {
+    size_t size = (size_t) map->width * map->height;
+    if (!(map->walls = allocMetadata(MAP_WALL_BITMAP_SIZE(size), 1, error)) ||
+        !(map->spawnable = allocMetadata(size, sizeof(uint32_t), error))) {
+        return false;
+    }
+    map->dotCount = map->scoreCount = map->spawnableCount = 0;
+    for (size_t i = 0; i < size; i++) {
+        switch (map->tiles[i]) {
+            case Wall:
+                map->walls[i / 8] |= (uint8_t) (1 << (i % 8));
+                break;
+            case Dot:
+                map->dotCount++;
+                break;
+            case Score:
+                map->scoreCount++;
+                break;
+            default:
+                break;
+        }
+        if (map->tiles[i] != Wall && map->tiles[i] != None) map->spawnable[map->spawnableCount++] = (uint32_t) i;
+    }
+    return true;
+}
+
+/**
+ * Connected components, labelled by flooding from every unlabelled walkable tile
+ */
+static bool computeComponents(mapFile_t *map, uint32_t *queue, mapFileError_t *error) {
+    size_t size = (size_t) map->width * map->height;
+    if (!(map->components = allocMetadata(size, sizeof(int32_t), error))) {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) map->components[i] = MAP_NO_COMPONENT;
+
+    map->componentCount = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (map->tiles[i] == Wall || map->components[i] != MAP_NO_COMPONENT) continue;
+        size_t head = 0;
+        size_t tail = 0;
+        map->components[i] = map->componentCount;
+        queue[tail++] = (uint32_t) i;
+        while (head < tail) {
+            uint32_t tile = queue[head++];
+            int x = (int) (tile % map->width);
+            int y = (int) (tile / map->width);
+            uint32_t neighbours[4];
+            int count = 0;
+            if (x > 0) neighbours[count++] = tile - 1;
+            if (x < map->width - 1) neighbours[count++] = tile + 1;
+            if (y > 0) neighbours[count++] = tile - map->width;
+            if (y < map->height - 1) neighbours[count++] = tile + map->width;
+            for (int j = 0; j < count; j++) {
+                if (map->tiles[neighbours[j]] != Wall && map->components[neighbours[j]] == MAP_NO_COMPONENT) {
+                    map->components[neighbours[j]] = map->componentCount;
+                    queue[tail++] = neighbours[j];
+                }
+            }
+        }
+        map->componentCount++;
+    }
+    return true;
+}
+
+/**
+ * Spawn candidates: players only spawn in the component with most spawnable tiles, so nobody starts in a sealed pocket
+ * Pacmans search from the top left corner, Ghosts from the bottom right one
+ */
+static bool computeSpawns(mapFile_t *map, mapFileError_t *error) {
+    int *componentSizes = allocMetadata((size_t) map->componentCount, sizeof(int), error);
+    if (!componentSizes) {
+        return false;
+    }
+    int largest = MAP_NO_COMPONENT;
+    for (int i = 0; i < map->spawnableCount; i++) {
+        int32_t component = map->components[map->spawnable[i]];
+        componentSizes[component]++;
+        if (largest == MAP_NO_COMPONENT || componentSizes[component] > componentSizes[largest]) largest = component;
+    }
+    int spawnCount = largest == MAP_NO_COMPONENT ? 0 : componentSizes[largest];
+    free(componentSizes);
+
+    if (!(map->pacmanSpawns = allocMetadata((size_t) spawnCount, sizeof(uint32_t), error)) ||
+        !(map->ghostSpawns = allocMetadata((size_t) spawnCount, sizeof(uint32_t), error))) {
+        return false;
+    }
+    map->pacmanSpawnCount = map->ghostSpawnCount = spawnCount;
+    for (int i = 0, j = 0; i < map->spawnableCount; i++) {
+        if (map->components[map->spawnable[i]] == largest) {
+            map->pacmanSpawns[j] = map->spawnable[i];
+            map->ghostSpawns[spawnCount - 1 - j] = map->spawnable[i];
+            j++;
+        }
+    }
+    return true;
+}
+
+/**
+ * Landmark distance tables over the spawn component, each landmark is the tile farthest from the ones before it
+ */
+static bool computeLandmarks(mapFile_t *map, uint32_t *queue, uint32_t *distances, mapFileError_t *error) {
+    size_t size = (size_t) map->width * map->height;
+    map->landmarkCount = map->pacmanSpawnCount < MAP_MAX_LANDMARKS ? map->pacmanSpawnCount : MAP_MAX_LANDMARKS;
+    if (!(map->landmarks = allocMetadata((size_t) map->landmarkCount, sizeof(uint32_t), error)) ||
+        !(map->landmarkDistances = allocMetadata((size_t) map->landmarkCount * size, sizeof(uint16_t), error))) {
+        return false;
+    }
+    if (map->landmarkCount == 0) {
+        return true;
+    }
+
+    int32_t component = map->components[map->pacmanSpawns[0]];
+    uint32_t next = map->pacmanSpawns[0];
+    for (int i = 0; i < map->landmarkCount; i++) {
+        uint16_t *table = map->landmarkDistances + (size_t) i * size;
+        map->landmarks[i] = next;
+        walkComponent(map, next, queue, distances);
+        for (size_t j = 0; j < size; j++) {
+            table[j] = distances[j] == UINT32_MAX ? MAP_DISTANCE_UNREACHABLE :
+                       distances[j] >= MAP_DISTANCE_UNREACHABLE ? MAP_DISTANCE_UNREACHABLE - 1 : (uint16_t) distances[j];
+        }
+        uint16_t best = 0;
+        for (size_t j = 0; j < size; j++) {
+            if (map->components[j] != component) continue;
+            uint16_t nearest = MAP_DISTANCE_UNREACHABLE;
+            for (int k = 0; k <= i; k++) {
+                uint16_t distance = map->landmarkDistances[(size_t) k * size + j];
+                if (distance < nearest) nearest = distance;
+            }
+            if (nearest > best) {
+                best = nearest;
+                next = (uint32_t) j;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Computes what the game uses besides the tiles: hash, tile counts, wall bitmap and spawn tiles
+ * Spawnable tiles and components are only needed to find the spawns, they are freed again and only the counts stay
+ */
+static bool computeGameMetadata(mapFile_t *map, mapFileError_t *error) {
+    size_t size = (size_t) map->width * map->height;
+    uint32_t *queue = allocMetadata(size, sizeof(uint32_t), error);
+
+    map->hash = mapHash(map->tiles, map->width, map->height, map->width);
+    bool computed = queue &&
+                    computeTileMetadata(map, error) &&
+                    computeComponents(map, queue, error) &&
+                    computeSpawns(map, error);
+    free(queue);
+    free(map->spawnable);
+    free(map->components);
+    map->spawnable = NULL;
+    map->components = NULL;
+    return computed;
+}
+
+/**
+ * Computes everything a compiled map stores besides the tiles, used by the map compiler
+ */
+bool computeMapMetadata(mapFile_t *map, mapFileError_t *error) {
+    size_t size = (size_t) map->width * map->height;
+    uint32_t *queue = allocMetadata(size, sizeof(uint32_t), error);
+    uint32_t *distances = allocMetadata(size, sizeof(uint32_t), error);
+
+    map->hash = mapHash(map->tiles, map->width, map->height, map->width);
+    bool computed = queue && distances &&
+                    computeTileMetadata(map, error) &&
+                    computeComponents(map, queue, error) &&
+                    computeSpawns(map, error) &&
+                    computeLandmarks(map, queue, distances, error);
+    free(queue);
+    free(distances);
+    return computed;
+}
+
+/**
+ * Little endian helpers for the compiled map file
+ */
+static void putU16(uint8_t *data, uint16_t value) {
+    data[0] = (uint8_t) value;
+    data[1] = (uint8_t) (value >> 8);
+}
+
+static void putU32(uint8_t *data, uint32_t value) {
+    for (int i = 0; i < 4; i++) data[i] = (uint8_t) (value >> (8 * i));
+}
+
+static void putU64(uint8_t *data, uint64_t value) {
+    for (int i = 0; i < 8; i++) data[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint32_t getU32(const uint8_t *data) {
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static uint64_t getU64(const uint8_t *data) {
+    return (uint64_t) getU32(data) | (uint64_t) getU32(data + 4) << 32;
+}
+
+/**
+ * Size of a compiled map file with the given metadata counts
+ */
+static size_t mapBinarySize(const mapFile_t *map) {
+    size_t size = (size_t) map->width * map->height;
+    return MAP_BINARY_HEADER_SIZE + size + MAP_WALL_BITMAP_SIZE(size) +
+           ((size_t) map->spawnableCount + map->pacmanSpawnCount + map->ghostSpawnCount) * sizeof(uint32_t) +
+           size * sizeof(int32_t) + (size_t) map->landmarkCount * sizeof(uint32_t) +
+           (size_t) map->landmarkCount * size * sizeof(uint16_t);
+}
+
+/**
+ * Writes a compiled map, the file is written under a temporary name and renamed once complete
+ */
+bool saveMapBinary(const char *path, const mapFile_t *map, mapFileError_t *error) {
+    size_t size = (size_t) map->width * map->height;
+    size_t fileSize = mapBinarySize(map);
+    uint8_t *data = allocMetadata(fileSize, 1, error);
+    if (!data) return false;
+
+    uint8_t *p = data;
+    memcpy(p, MAP_BINARY_MAGIC, 4);
+    putU32(p + 4, MAP_BINARY_VERSION);
+    putU32(p + 8, (uint32_t) map->width);
+    putU32(p + 12, (uint32_t) map->height);
+    putU64(p + 16, map->hash);
+    putU32(p + 24, (uint32_t) map->dotCount);
+    putU32(p + 28, (uint32_t) map->scoreCount);
+    putU32(p + 32, (uint32_t) map->spawnableCount);
+    putU32(p + 36, (uint32_t) map->pacmanSpawnCount);
+    putU32(p + 40, (uint32_t) map->ghostSpawnCount);
+    putU32(p + 44, (uint32_t) map->componentCount);
+    putU32(p + 48, (uint32_t) map->landmarkCount);
+    p += MAP_BINARY_HEADER_SIZE;
+
+    memcpy(p, map->tiles, size);
+    p += size;
+    memcpy(p, map->walls, MAP_WALL_BITMAP_SIZE(size));
+    p += MAP_WALL_BITMAP_SIZE(size);
+    for (int i = 0; i < map->spawnableCount; i++, p += 4) putU32(p, map->spawnable[i]);
+    for (int i = 0; i < map->pacmanSpawnCount; i++, p += 4) putU32(p, map->pacmanSpawns[i]);
+    for (int i = 0; i < map->ghostSpawnCount; i++, p += 4) putU32(p, map->ghostSpawns[i]);
+    for (size_t i = 0; i < size; i++, p += 4) putU32(p, (uint32_t) map->components[i]);
+    for (int i = 0; i < map->landmarkCount; i++, p += 4) putU32(p, map->landmarks[i]);
+    for (size_t i = 0; i < (size_t) map->landmarkCount * size; i++, p += 2) putU16(p, map->landmarkDistances[i]);
+
+    char tmpPath[FILENAME_MAX];
+    snprintf(tmpPath, FILENAME_MAX, "%s.%d", path, (int) getpid());
+    FILE *file = fopen(tmpPath, "wb");
+    bool saved = file && fwrite(data, 1, fileSize, file) == fileSize;
+    if (!saved) mapError(error, 0, 0, strerror(errno));
+    if (file && fclose(file) != 0 && saved) {
+        mapError(error, 0, 0, strerror(errno));
+        saved = false;
+    }
+    if (saved && rename(tmpPath, path) < 0) {
+        mapError(error, 0, 0, strerror(errno));
+        saved = false;
+    }
+    if (!saved) unlink(tmpPath);
+    free(data);
+    return saved;
+}
+
+/**
+ * Checks what the server uses from a compiled map against its tiles: hash, wall bitmap, tile counts and spawn tiles
+ */
+static bool verifyTileMetadata(const mapFile_t *map) {
+    size_t size = (size_t) map->width * map->height;
+    int dots = 0;
+    int scores = 0;
+
+    if (mapHash(map->tiles, map->width, map->height, map->width) != map->hash) return false;
+    for (size_t i = 0; i < size; i++) {
+        bool wall = (map->walls[i / 8] >> (i % 8)) & 1;
+        if (wall != (map->tiles[i] == Wall)) return false;
+        dots += map->tiles[i] == Dot;
+        scores += map->tiles[i] == Score;
+    }
+    if (dots != map->dotCount || scores != map->scoreCount) return false;
+    for (int i = 0; i < map->pacmanSpawnCount; i++) {
+        if (map->tiles[map->pacmanSpawns[i]] == Wall || map->tiles[map->pacmanSpawns[i]] == None) return false;
+    }
+    for (int i = 0; i < map->ghostSpawnCount; i++) {
+        if (map->tiles[map->ghostSpawns[i]] == Wall || map->tiles[map->ghostSpawns[i]] == None) return false;
+    }
+    return true;
+}
+
+/**
+ * Copies the sections of a mapped compiled map which the game uses into mapFile_t, every count and index is checked
+ * against the file. Spawnable tiles, components and landmark tables are skipped, only their counts are kept
+ */
+static bool readMapBinary(const uint8_t *data, size_t fileSize, mapFile_t *map, mapFileError_t *error) {
+    if (fileSize < MAP_BINARY_HEADER_SIZE || memcmp(data, MAP_BINARY_MAGIC, 4) != 0) {
+        mapError(error, 0, 0, "Not a compiled map");
+        return false;
+    }
+    if (getU32(data + 4) != MAP_BINARY_VERSION) {
+        mapError(error, 0, 0, "Unsupported compiled map version, run lsp_p1_mapc again");
+        return false;
+    }
+    uint32_t width = getU32(data + 8);
+    uint32_t height = getU32(data + 12);
+    if (width == 0 || height == 0 || width > MAX_MAP_WIDTH || height > MAX_MAP_HEIGHT ||
+        (size_t) width * height > MAX_MAP_SIZE) {
+        mapError(error, 0, 0, "Incorrect map size");
+        return false;
+    }
+    size_t size = (size_t) width * height;
+    map->width = (int) width;
+    map->height = (int) height;
+    map->hash = getU64(data + 16);
+    map->dotCount = (int) getU32(data + 24);
+    map->scoreCount = (int) getU32(data + 28);
+    uint32_t counts[5];
+    for (int i = 0; i < 5; i++) counts[i] = getU32(data + 32 + 4 * i);
+    if (counts[0] > size || counts[1] > size || counts[2] > size || counts[3] > size ||
+        counts[4] > MAP_MAX_LANDMARKS) {
+        mapError(error, 0, 0, "Incorrect metadata size");
+        return false;
+    }
+    map->spawnableCount = (int) counts[0];
+    map->pacmanSpawnCount = (int) counts[1];
+    map->ghostSpawnCount = (int) counts[2];
+    map->componentCount = (int) counts[3];
+    map->landmarkCount = (int) counts[4];
+    if (mapBinarySize(map) != fileSize) {
+        mapError(error, 0, 0, "Truncated compiled map");
+        return false;
+    }
+
+    if (!(map->tiles = allocMetadata(size, 1, error)) ||
+        !(map->walls = allocMetadata(MAP_WALL_BITMAP_SIZE(size), 1, error)) ||
+        !(map->pacmanSpawns = allocMetadata((size_t) map->pacmanSpawnCount, sizeof(uint32_t), error)) ||
+        !(map->ghostSpawns = allocMetadata((size_t) map->ghostSpawnCount, sizeof(uint32_t), error))) {
+        return false;
+    }
+
+    const uint8_t *p = data + MAP_BINARY_HEADER_SIZE;
+    bool valid = true;
+    memcpy(map->tiles, p, size);
+    for (size_t i = 0; i < size; i++) valid &= (unsigned char) map->tiles[i] <= Score;
+    p += size;
+    memcpy(map->walls, p, MAP_WALL_BITMAP_SIZE(size));
+    p += MAP_WALL_BITMAP_SIZE(size);
+    p += (size_t) map->spawnableCount * sizeof(uint32_t);
+    for (int i = 0; i < map->pacmanSpawnCount; i++, p += 4) valid &= (map->pacmanSpawns[i] = getU32(p)) < size;
+    for (int i = 0; i < map->ghostSpawnCount; i++, p += 4) valid &= (map->ghostSpawns[i] = getU32(p)) < size;
+    if (!valid) {
+        mapError(error, 0, 0, "Incorrect tile index or value");
+        return false;
+    }
+    if (!verifyTileMetadata(map)) {
+        mapError(error, 0, 0, "Stored metadata doesn't match the tiles, run lsp_p1_mapc again");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Loads a compiled map file for the game, the file is mapped into memory and its sections are copied without any parsing
+ */
+bool loadMapBinary(const char *path, mapFile_t *map, mapFileError_t *error) {
+    struct stat info;
+    bool loaded;
+
+    memset(map, 0, sizeof(mapFile_t));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        mapError(error, 0, 0, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &info) < 0) {
+        mapError(error, 0, 0, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        mapError(error, 0, 0, "Map is empty");
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        mapError(error, 0, 0, strerror(errno));
+        return false;
+    }
+    loaded = readMapBinary(data, (size_t) info.st_size, map, error);
+    munmap(data, (size_t) info.st_size);
+    if (!loaded) freeMapFile(map);
+    return loaded;
+}
+
+/**
+ * True if the path has the compiled map extension
+ */
+bool isMapBinary(const char *path) {
+    size_t length = strlen(path);
+    size_t extension = strlen(MAP_BINARY_EXTENSION);
+    return length > extension && strcmp(path + length - extension, MAP_BINARY_EXTENSION) == 0;
+}
+
+/**
+ * Loads a compiled map, or a text map and computes the metadata the game uses
+ */
+bool loadMapFile(const char *path, mapFile_t *map, mapFileError_t *error) {
+    if (isMapBinary(path)) {
+        return loadMapBinary(path, map, error);
+    }
+    if (!loadMapText(path, map, error)) {
+        return false;
+    }
+    if (!computeGameMetadata(map, error)) {
+        freeMapFile(map);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Releases tiles and metadata allocated by the loader
+ */
+void freeMapFile(mapFile_t *map) {
+    free(map->tiles);
+    free(map->walls);
+    free(map->spawnable);
+    free(map->pacmanSpawns);
+    free(map->ghostSpawns);
+    free(map->components);
+    free(map->landmarks);
+    free(map->landmarkDistances);
+    memset(map, 0, sizeof(mapFile_t));
+}
@@ -0,0 +1,91 @@
+/*
+ * LSP Kursa projekts
+ * Kopīgais kods - karšu failu ielāde
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#ifndef LSP_P1_MAPFILE_H
+#define LSP_P1_MAPFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "framing.h"
+#include "protocol.h"
+
+/*
+ * Text map file: one row per line, one mapObjecT_t digit ('0'-'5') per tile
+ * Rows shorter than the widest one are padded with None, "\r\n" line endings are accepted
+ */
+#define MAX_MAP_HEIGHT 65535                // Map size is sent as 16 bit fields in START
+#define MAX_MAP_WIDTH 65535
+#define MAX_MAP_SIZE (FRAME_MAX_PAYLOAD_SIZE - PACKET_TYPE_SIZE) // Tiles, a full MAP packet must fit in one frame
+#define MAP_ERROR_SIZE 128
+
+/*
+ * Compiled map file (lsp_p1_mapc), all numbers are little endian:
+ *  0-3 "LMAP", 4-7 version, 8-11 width, 12-15 height, 16-23 mapHash,
+ *  24-27 dots, 28-31 score tiles, 32-35 spawnable tiles, 36-39 Pacman spawns, 40-43 Ghost spawns,
+ *  44-47 components, 48-51 landmarks
+ * Followed by: tiles (width*height), wall bitmap, spawnable tile indexes (u32), Pacman spawn indexes (u32),
+ *  Ghost spawn indexes (u32), component of every tile (i32), landmark indexes (u32),
+ *  distance from every landmark to every tile (u16, landmarks*width*height)
+ * Tile index is y*width+x
+ */
+#define MAP_BINARY_EXTENSION ".lmap"
+#define MAP_BINARY_MAGIC "LMAP"
+#define MAP_BINARY_VERSION 1
+#define MAP_BINARY_HEADER_SIZE 52
+#define MAP_MAX_LANDMARKS 8                 // Tiles with precomputed distance tables
+#define MAP_DISTANCE_UNREACHABLE 0xFFFF     // Landmark distance of walls and other components, longer paths are capped below it
+#define MAP_NO_COMPONENT (-1)               // Component of wall tiles
+#define MAP_WALL_BITMAP_SIZE(tiles) (((size_t) (tiles) + 7) / 8)
+
+typedef struct mapFile {
+    int width;
+    int height;
+    char *tiles;                            // Row-major width*height mapObjecT_t values, allocated by the loader
+    uint64_t hash;                          // mapHash of tiles
+    // Precomputed by loadMapFile and computeMapMetadata or loaded from a compiled map
+    uint8_t *walls;                         // Bit (index % 8) of byte (index / 8) is set for Wall tiles
+    int dotCount;                           // Dot tiles
+    int scoreCount;                         // Score tiles
+    uint32_t *pacmanSpawns;                 // Spawnable tiles of the largest component, top left first
+    int pacmanSpawnCount;
+    uint32_t *ghostSpawns;                  // Spawnable tiles of the largest component, bottom right first
+    int ghostSpawnCount;
+    // Only computeMapMetadata (lsp_p1_mapc) fills these arrays, loadMapFile leaves them NULL and keeps the counts
+    uint32_t *spawnable;                    // Tiles which aren't Wall or None
+    int spawnableCount;
+    int32_t *components;                    // Connected component (4 neighbours, anything but Wall) of every tile
+    int componentCount;
+    uint32_t *landmarks;                    // Tiles spread over the largest component
+    int landmarkCount;
+    uint16_t *landmarkDistances;            // [landmark * width * height + tile] walking distance
+} mapFile_t;
+
+typedef struct mapFileError {
+    int line;                               // 1 based position of the error, 0 if it isn't about a character
+    int column;
+    char message[MAP_ERROR_SIZE];
+} mapFileError_t;
+
+bool parseMapText(const char *, size_t, mapFile_t *, mapFileError_t *);
+
+bool loadMapText(const char *, mapFile_t *, mapFileError_t *);
+
+bool computeMapMetadata(mapFile_t *, mapFileError_t *);
+
+bool loadMapBinary(const char *, mapFile_t *, mapFileError_t *);
+
+bool saveMapBinary(const char *, const mapFile_t *, mapFileError_t *);
+
+bool loadMapFile(const char *, mapFile_t *, mapFileError_t *);
+
+bool isMapBinary(const char *);
+
+void freeMapFile(mapFile_t *);
+
+#endif //LSP_P1_MAPFILE_H
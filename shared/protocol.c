@@ -0,0 +1,653 @@
+/*
+ * LSP Kursa projekts
+ * Kopīgais kods - protokola pakešu kodēšana un dekodēšana
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#include <string.h>
+
+#include "protocol.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define OBJECT_COUNT_OFFSET PACKET_TYPE_SIZE
+
+/*
+ * Position change per tick for every clientMovement_t: UP, DOWN, RIGHT, LEFT
+ * The server moves players and the client predicts its own movement with the same steps
+ */
+const float movementStepX[4] = {0, 0, TICK_MOVEMENT, -TICK_MOVEMENT};
+const float movementStepY[4] = {-TICK_MOVEMENT, TICK_MOVEMENT, 0, 0};
+
+/*
+ * Cursor helpers
+ */
+
+/**
+ * Starts writing a packet into buffer
+ */
+void packetWriterInit(packetWriter_t *writer, char *buffer, size_t capacity) {
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->length = 0;
+    writer->overflow = false;
+}
+
+/**
+ * Starts reading a received packet of the given length
+ */
+void packetReaderInit(packetReader_t *reader, char *buffer, size_t length) {
+    reader->buffer = buffer;
+    reader->length = length;
+    reader->offset = 0;
+    reader->overflow = false;
+}
+
+/**
+ * Returns the packet type or -1 for an empty packet
+ */
+int packetType(char *buffer, size_t length) {
+    if (length < PACKET_TYPE_SIZE) return -1;
+    return (unsigned char) buffer[0];
+}
+
+/**
+ * Returns pointer to the next size bytes of the packet being written or NULL if they don't fit
+ */
+static char *writeReserve(packetWriter_t *writer, size_t size) {
+    if (writer->overflow || writer->capacity - writer->length < size) {
+        writer->overflow = true;
+        return NULL;
+    }
+    char *p = writer->buffer + writer->length;
+    writer->length += size;
+    return p;
+}
+
+/**
+ * Returns pointer to the next size bytes of the packet being read or NULL if the packet is too short
+ */
+static char *readReserve(packetReader_t *reader, size_t size) {
+    if (reader->overflow || reader->length - reader->offset < size) {
+        reader->overflow = true;
+        return NULL;
+    }
+    char *p = reader->buffer + reader->offset;
+    reader->offset += size;
+    return p;
+}
+
+static void writeBytes(packetWriter_t *writer, const void *data, size_t size) {
+    char *p = writeReserve(writer, size);
+    if (p) memcpy(p, data, size);
+}
+
+static void readBytes(packetReader_t *reader, void *data, size_t size) {
+    char *p = readReserve(reader, size);
+    if (p) memcpy(data, p, size);
+    else memset(data, 0, size);
+}
+
+static void writeU8(packetWriter_t *writer, int value) {
+    char *p = writeReserve(writer, 1);
+    if (p) *p = (char) value;
+}
+
+static int readU8(packetReader_t *reader) {
+    char *p = readReserve(reader, 1);
+    return p ? (unsigned char) *p : 0;
+}
+
+static void writeU16(packetWriter_t *writer, int value) {
+    uint16_t v = (uint16_t) value;
+    writeBytes(writer, &v, sizeof(v));
+}
+
+static int readU16(packetReader_t *reader) {
+    uint16_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static void writeU32(packetWriter_t *writer, uint32_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static uint32_t readU32(packetReader_t *reader) {
+    uint32_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static void writeU64(packetWriter_t *writer, uint64_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static uint64_t readU64(packetReader_t *reader) {
+    uint64_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+/**
+ * Returns true if the packet has unread bytes, used for fields added in later protocol versions
+ */
+static bool hasMore(packetReader_t *reader) {
+    return !reader->overflow && reader->offset < reader->length;
+}
+
+static void writeInt(packetWriter_t *writer, int value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static int readInt(packetReader_t *reader) {
+    int value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static void writeFloat(packetWriter_t *writer, float value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static float readFloat(packetReader_t *reader) {
+    float value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+/**
+ * Writes the packet type, every encoder starts with it
+ */
+static void writeType(packetWriter_t *writer, enum packet_t type) {
+    writeU8(writer, type);
+}
+
+/**
+ * Reads the packet type and marks the reader as failed if it isn't the expected one
+ */
+static void readType(packetReader_t *reader, enum packet_t type) {
+    if (readU8(reader) != (int) type) reader->overflow = true;
+}
+
+/**
+ * Reads a fixed size nickname field and null terminates it
+ */
+static void readName(packetReader_t *reader, char name[MAX_NICK_SIZE + 1]) {
+    readBytes(reader, name, MAX_NICK_SIZE);
+    name[MAX_NICK_SIZE] = '\0';
+}
+
+/**
+ * Writes a fixed size nickname field, shorter names are zero padded
+ */
+static void writeName(packetWriter_t *writer, const char *name) {
+    char *p = writeReserve(writer, MAX_NICK_SIZE);
+    if (p) strncpy(p, name, MAX_NICK_SIZE);
+}
+
+/*
+ * JOIN
+ */
+bool encodeJoin(packetWriter_t *writer, const joinPacket_t *packet) {
+    writeType(writer, JOIN);
+    writeName(writer, packet->name);
+    writeU16(writer, packet->version);
+    writeU32(writer, packet->capabilities);
+    if (packet->version >= PROTOCOL_VERSION_RESUME) writeU64(writer, packet->resumeToken);
+    return !writer->overflow;
+}
+
+/**
+ * Version 0 clients only send the nickname, they get version 0 and no capabilities
+ */
+bool decodeJoin(packetReader_t *reader, joinPacket_t *packet) {
+    readType(reader, JOIN);
+    readName(reader, packet->name);
+    packet->version = 0;
+    packet->capabilities = 0;
+    packet->resumeToken = 0;
+    if (hasMore(reader)) {
+        packet->version = readU16(reader);
+        packet->capabilities = readU32(reader);
+    }
+    if (packet->version >= PROTOCOL_VERSION_RESUME && hasMore(reader)) {
+        packet->resumeToken = readU64(reader);
+    }
+    return !reader->overflow;
+}
+
+/*
+ * ACK
+ */
+bool encodeAck(packetWriter_t *writer, const ackPacket_t *packet) {
+    writeType(writer, ACK);
+    writeInt(writer, packet->id);
+    writeU16(writer, packet->version);
+    writeU32(writer, packet->capabilities);
+    if (packet->version >= PROTOCOL_VERSION_RESUME) writeU64(writer, packet->resumeToken);
+    return !writer->overflow;
+}
+
+/**
+ * Version 0 servers only send the ID, which means no capabilities
+ */
+bool decodeAck(packetReader_t *reader, ackPacket_t *packet) {
+    readType(reader, ACK);
+    packet->id = readInt(reader);
+    packet->version = 0;
+    packet->capabilities = 0;
+    packet->resumeToken = 0;
+    if (hasMore(reader)) {
+        packet->version = readU16(reader);
+        packet->capabilities = readU32(reader);
+    }
+    if (packet->version >= PROTOCOL_VERSION_RESUME && hasMore(reader)) {
+        packet->resumeToken = readU64(reader);
+    }
+    return !reader->overflow;
+}
+
+/*
+ * START
+ */
+/**
+ * Size and position fields are encoded for the protocol version agreed with the receiver
+ * Fails (writer overflow) if the map is too large for the 1 byte fields of older versions
+ */
+bool encodeStart(packetWriter_t *writer, const startPacket_t *packet, int version) {
+    void (*writeField)(packetWriter_t *, int) = version >= PROTOCOL_VERSION_WIDE_START ? writeU16 : writeU8;
+    if (version < PROTOCOL_VERSION_WIDE_START && (packet->width > UINT8_MAX || packet->height > UINT8_MAX)) {
+        writer->overflow = true;
+        return false;
+    }
+    writeType(writer, START);
+    writeField(writer, packet->width);
+    writeField(writer, packet->height);
+    writeField(writer, packet->x);
+    writeField(writer, packet->y);
+    writeU64(writer, packet->mapHash);
+    return !writer->overflow;
+}
+
+bool decodeStart(packetReader_t *reader, startPacket_t *packet, int version) {
+    int (*readField)(packetReader_t *) = version >= PROTOCOL_VERSION_WIDE_START ? readU16 : readU8;
+    readType(reader, START);
+    packet->width = readField(reader);
+    packet->height = readField(reader);
+    packet->x = readField(reader);
+    packet->y = readField(reader);
+    packet->mapHash = hasMore(reader) ? readU64(reader) : 0;
+    return !reader->overflow;
+}
+
+/*
+ * END
+ */
+bool encodeEnd(packetWriter_t *writer) {
+    writeType(writer, END);
+    return !writer->overflow;
+}
+
+/*
+ * MAP
+ * Map size isn't sent, it is known from the START packet
+ */
+
+/**
+ * Encodes width*height tiles, rows in tiles are stride bytes apart
+ */
+bool encodeMap(packetWriter_t *writer, const char *tiles, int width, int height, int stride) {
+    writeType(writer, MAP);
+    for (int i = 0; i < height; i++) {
+        writeBytes(writer, tiles + (size_t) i * stride, (size_t) width);
+    }
+    return !writer->overflow;
+}
+
+/**
+ * Points tiles to width*height tile bytes (row-major) inside the packet, nothing is copied
+ */
+bool decodeMap(packetReader_t *reader, int width, int height, char **tiles) {
+    readType(reader, MAP);
+    *tiles = readReserve(reader, (size_t) width * height);
+    return !reader->overflow;
+}
+
+/**
+ * Encodes width*height tiles packed two per byte (CAP_COMPACT_MAP), first tile in the low nibble
+ */
+bool encodeCompactMap(packetWriter_t *writer, const char *tiles, int width, int height, int stride) {
+    writeType(writer, MAP);
+    char *packed = writeReserve(writer, ((size_t) width * height + 1) / 2);
+    if (packed == NULL) return false;
+    size_t index = 0;
+    for (int i = 0; i < height; i++) {
+        const char *row = tiles + (size_t) i * stride;
+        for (int j = 0; j < width; j++, index++) {
+            if (index & 1) packed[index >> 1] |= (char) ((row[j] & 0x0F) << 4);
+            else packed[index >> 1] = (char) (row[j] & 0x0F);
+        }
+    }
+    return !writer->overflow;
+}
+
+/**
+ * Unpacks width*height tiles (row-major) into tiles
+ */
+bool decodeCompactMap(packetReader_t *reader, int width, int height, char *tiles) {
+    readType(reader, MAP);
+    size_t count = (size_t) width * height;
+    char *packed = readReserve(reader, (count + 1) / 2);
+    if (packed == NULL) return false;
+    for (size_t i = 0; i < count; i++) {
+        tiles[i] = (char) ((packed[i >> 1] >> ((i & 1) * 4)) & 0x0F);
+    }
+    return !reader->overflow;
+}
+
+/**
+ * FNV-1a hash of map size and tiles, identifies map contents in START and the client map cache
+ */
+uint64_t mapHash(const char *tiles, int width, int height, int stride) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint32_t size[2] = {(uint32_t) width, (uint32_t) height};
+    for (int i = 0; i < 2; i++) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            hash = (hash ^ ((size[i] >> shift) & 0xFF)) * FNV_PRIME;
+        }
+    }
+    for (int i = 0; i < height; i++) {
+        const unsigned char *row = (const unsigned char *) tiles + (size_t) i * stride;
+        for (int j = 0; j < width; j++) {
+            hash = (hash ^ row[j]) * FNV_PRIME;
+        }
+    }
+    return hash;
+}
+
+/*
+ * MAP_REQUEST, sent by CAP_MAP_CACHE clients which don't have the START map cached
+ */
+bool encodeMapRequest(packetWriter_t *writer, const mapRequestPacket_t *packet) {
+    writeType(writer, MAP_REQUEST);
+    writeU64(writer, packet->mapHash);
+    return !writer->overflow;
+}
+
+bool decodeMapRequest(packetReader_t *reader, mapRequestPacket_t *packet) {
+    readType(reader, MAP_REQUEST);
+    packet->mapHash = readU64(reader);
+    return !reader->overflow;
+}
+
+/*
+ * MAP_CHUNK, part of the map's default tiles (row-major)
+ */
+bool encodeMapChunk(packetWriter_t *writer, const mapChunkPacket_t *packet) {
+    writeType(writer, MAP_CHUNK);
+    writeU64(writer, packet->mapHash);
+    writeU32(writer, packet->totalSize);
+    writeU32(writer, packet->offset);
+    writeU16(writer, packet->length);
+    writeBytes(writer, packet->tiles, (size_t) packet->length);
+    return !writer->overflow;
+}
+
+/**
+ * Chunk tiles are not copied, packet->tiles points into the packet buffer
+ */
+bool decodeMapChunk(packetReader_t *reader, mapChunkPacket_t *packet) {
+    readType(reader, MAP_CHUNK);
+    packet->mapHash = readU64(reader);
+    packet->totalSize = readU32(reader);
+    packet->offset = readU32(reader);
+    packet->length = readU16(reader);
+    packet->tiles = readReserve(reader, (size_t) packet->length);
+    if (packet->offset > packet->totalSize || packet->totalSize - packet->offset < (uint32_t) packet->length) {
+        reader->overflow = true;
+    }
+    return !reader->overflow;
+}
+
+/*
+ * MAP_DELTA
+ * 0 - type, 1-4 - object count, then a tileChange_t for each changed tile
+ */
+bool encodeMapDeltaBegin(packetWriter_t *writer) {
+    writeType(writer, MAP_DELTA);
+    writeInt(writer, 0); // Object count is filled in by encodeMapDeltaEnd
+    return !writer->overflow;
+}
+
+bool encodeTileChange(packetWriter_t *writer, const tileChange_t *change) {
+    writeU16(writer, change->x);
+    writeU16(writer, change->y);
+    writeU8(writer, change->tile);
+    return !writer->overflow;
+}
+
+bool encodeMapDeltaEnd(packetWriter_t *writer, int count) {
+    if (!writer->overflow) memcpy(writer->buffer + OBJECT_COUNT_OFFSET, &count, sizeof(count));
+    return !writer->overflow;
+}
+
+bool decodeMapDeltaBegin(packetReader_t *reader, int *count) {
+    readType(reader, MAP_DELTA);
+    *count = readInt(reader);
+    if (*count < 0 || (size_t) *count > (reader->length - reader->offset) / TILE_CHANGE_SIZE) {
+        reader->overflow = true;
+    }
+    if (reader->overflow) *count = 0;
+    return !reader->overflow;
+}
+
+bool decodeTileChange(packetReader_t *reader, tileChange_t *change) {
+    change->x = readU16(reader);
+    change->y = readU16(reader);
+    change->tile = readU8(reader);
+    return !reader->overflow;
+}
+
+/*
+ * PLAYERS
+ * 0 - type, 1-4 - object count, (5-12 - moveAck_t), (13-24 - snapshotStamp_t), then a playerEntry_t for each player
+ */
+bool encodePlayersBegin(packetWriter_t *writer, const moveAck_t *ack, const snapshotStamp_t *stamp, int version) {
+    writeType(writer, PLAYERS);
+    writeInt(writer, 0); // Object count is filled in by encodePlayersEnd
+    if (version >= PROTOCOL_VERSION_MOVE_SEQUENCE) {
+        writeU32(writer, ack->sequence);
+        writeU32(writer, ack->ticks);
+    }
+    if (version >= PROTOCOL_VERSION_SNAPSHOT_TIME) {
+        writeU32(writer, stamp->tick);
+        writeU64(writer, stamp->time);
+    }
+    return !writer->overflow;
+}
+
+bool encodePlayerEntry(packetWriter_t *writer, const playerEntry_t *entry) {
+    writeInt(writer, entry->id);
+    writeFloat(writer, entry->x);
+    writeFloat(writer, entry->y);
+    writeU8(writer, entry->playerState);
+    writeU8(writer, entry->playerType);
+    return !writer->overflow;
+}
+
+bool encodePlayersEnd(packetWriter_t *writer, int count) {
+    if (!writer->overflow) memcpy(writer->buffer + OBJECT_COUNT_OFFSET, &count, sizeof(count));
+    return !writer->overflow;
+}
+
+/**
+ * Reads the player count, entries are then read one by one with decodePlayerEntry
+ */
+bool decodePlayersBegin(packetReader_t *reader, int *count, moveAck_t *ack, snapshotStamp_t *stamp, int version) {
+    readType(reader, PLAYERS);
+    *count = readInt(reader);
+    ack->sequence = version >= PROTOCOL_VERSION_MOVE_SEQUENCE ? readU32(reader) : 0;
+    ack->ticks = version >= PROTOCOL_VERSION_MOVE_SEQUENCE ? readU32(reader) : 0;
+    stamp->tick = version >= PROTOCOL_VERSION_SNAPSHOT_TIME ? readU32(reader) : 0;
+    stamp->time = version >= PROTOCOL_VERSION_SNAPSHOT_TIME ? readU64(reader) : 0;
+    if (*count < 0 || (size_t) *count > (reader->length - reader->offset) / PLAYER_ENTRY_SIZE) {
+        reader->overflow = true;
+    }
+    if (reader->overflow) *count = 0;
+    return !reader->overflow;
+}
+
+bool decodePlayerEntry(packetReader_t *reader, playerEntry_t *entry) {
+    entry->id = readInt(reader);
+    entry->x = readFloat(reader);
+    entry->y = readFloat(reader);
+    entry->playerState = (enum playerState_t) readU8(reader);
+    entry->playerType = (enum playerType_t) readU8(reader);
+    return !reader->overflow;
+}
+
+/*
+ * SCORE
+ * 0 - type, 1-4 - object count, then a scoreEntry_t for each player
+ */
+bool encodeScoresBegin(packetWriter_t *writer) {
+    writeType(writer, SCORE);
+    writeInt(writer, 0); // Object count is filled in by encodeScoresEnd
+    return !writer->overflow;
+}
+
+bool encodeScoreEntry(packetWriter_t *writer, const scoreEntry_t *entry) {
+    writeInt(writer, entry->score);
+    writeInt(writer, entry->id);
+    return !writer->overflow;
+}
+
+bool encodeScoresEnd(packetWriter_t *writer, int count) {
+    if (!writer->overflow) memcpy(writer->buffer + OBJECT_COUNT_OFFSET, &count, sizeof(count));
+    return !writer->overflow;
+}
+
+bool decodeScoresBegin(packetReader_t *reader, int *count) {
+    readType(reader, SCORE);
+    *count = readInt(reader);
+    if (*count < 0 || (size_t) *count > (reader->length - reader->offset) / SCORE_ENTRY_SIZE) {
+        reader->overflow = true;
+    }
+    if (reader->overflow) *count = 0;
+    return !reader->overflow;
+}
+
+bool decodeScoreEntry(packetReader_t *reader, scoreEntry_t *entry) {
+    entry->score = readInt(reader);
+    entry->id = readInt(reader);
+    return !reader->overflow;
+}
+
+/*
+ * MOVE
+ */
+bool encodeMove(packetWriter_t *writer, const movePacket_t *packet, int version) {
+    writeType(writer, MOVE);
+    if (version >= PROTOCOL_VERSION_MOVE_TIME) {
+        writeU32(writer, packet->sequence);
+        writeU8(writer, packet->direction);
+        writeU32(writer, packet->time);
+        return !writer->overflow;
+    }
+    writeInt(writer, packet->id);
+    writeU8(writer, packet->direction);
+    if (version >= PROTOCOL_VERSION_MOVE_SEQUENCE) writeU32(writer, packet->sequence);
+    return !writer->overflow;
+}
+
+bool decodeMove(packetReader_t *reader, movePacket_t *packet, int version) {
+    readType(reader, MOVE);
+    if (version >= PROTOCOL_VERSION_MOVE_TIME) {
+        packet->id = -1;
+        packet->sequence = readU32(reader);
+        packet->direction = (enum clientMovement_t) readU8(reader);
+        packet->time = readU32(reader);
+    } else {
+        packet->id = readInt(reader);
+        packet->direction = (enum clientMovement_t) readU8(reader);
+        packet->sequence = version >= PROTOCOL_VERSION_MOVE_SEQUENCE ? readU32(reader) : 0;
+        packet->time = 0;
+    }
+    if (packet->direction > LEFT) reader->overflow = true;
+    return !reader->overflow;
+}
+
+/*
+ * MESSAGE
+ */
+bool encodeMessage(packetWriter_t *writer, const messagePacket_t *packet) {
+    writeType(writer, MESSAGE);
+    writeInt(writer, packet->id);
+    writeInt(writer, packet->length);
+    writeBytes(writer, packet->text, (size_t) packet->length);
+    return !writer->overflow;
+}
+
+/**
+ * Message text is not copied, packet->text points into the packet buffer
+ */
+bool decodeMessage(packetReader_t *reader, messagePacket_t *packet) {
+    readType(reader, MESSAGE);
+    packet->id = readInt(reader);
+    packet->length = readInt(reader);
+    packet->text = NULL;
+    if (packet->length < 0) reader->overflow = true;
+    else packet->text = readReserve(reader, (size_t) packet->length);
+    return !reader->overflow;
+}
+
+/*
+ * JOINED
+ */
+bool encodeJoined(packetWriter_t *writer, const joinedPacket_t *packet) {
+    writeType(writer, JOINED);
+    writeInt(writer, packet->id);
+    writeName(writer, packet->name);
+    return !writer->overflow;
+}
+
+bool decodeJoined(packetReader_t *reader, joinedPacket_t *packet) {
+    readType(reader, JOINED);
+    packet->id = readInt(reader);
+    readName(reader, packet->name);
+    return !reader->overflow;
+}
+
+/*
+ * QUIT and PLAYER_DISCONNECTED, both only carry a player ID
+ */
+bool encodePlayerId(packetWriter_t *writer, enum packet_t type, const playerIdPacket_t *packet) {
+    writeType(writer, type);
+    writeInt(writer, packet->id);
+    return !writer->overflow;
+}
+
+bool decodePlayerId(packetReader_t *reader, enum packet_t type, playerIdPacket_t *packet) {
+    readType(reader, type);
+    packet->id = readInt(reader);
+    return !reader->overflow;
+}
+
+/*
+ * PING and PONG, the client answers PING with a PONG carrying the same sequence and time
+ */
+bool encodePing(packetWriter_t *writer, enum packet_t type, const pingPacket_t *packet) {
+    writeType(writer, type);
+    writeU32(writer, packet->sequence);
+    writeU64(writer, packet->time);
+    return !writer->overflow;
+}
+
+bool decodePing(packetReader_t *reader, enum packet_t type, pingPacket_t *packet) {
+    readType(reader, type);
+    packet->sequence = readU32(reader);
+    packet->time = readU64(reader);
+    return !reader->overflow;
+}
@@ -0,0 +1,300 @@
+/*
+ * LSP Kursa projekts
+ * Kopīgais kods - protokola pakešu kodēšana un dekodēšana
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#ifndef LSP_P1_PROTOCOL_H
+#define LSP_P1_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PACKET_TYPE_SIZE 1
+#define MAX_NICK_SIZE 20
+#define PROTOCOL_VERSION 7                 // Version 0 clients send JOIN without version and capabilities
+#define PROTOCOL_VERSION_WIDE_START 2      // First version with 16 bit map size and position in START
+#define PROTOCOL_VERSION_MOVE_SEQUENCE 3   // First version with MOVE sequence numbers acknowledged in PLAYERS
+#define PROTOCOL_VERSION_SNAPSHOT_TIME 4   // First version with the tick number and server time in PLAYERS
+#define PROTOCOL_VERSION_MOVE_TIME 5       // First version with the client timestamp and without the player ID in MOVE
+#define PROTOCOL_VERSION_PING 6            // First version with PING/PONG
+#define PROTOCOL_VERSION_RESUME 7          // First version with the resume token in JOIN and ACK
+
+/*
+ * Game rules which the client needs to predict its own movement
+ */
+#define TICK_FREQUENCY 50                  // Time between ticks in miliseconds
+#define TICK_MOVEMENT 0.5f                 // Player movement per each tick
+
+/*
+ * Capabilities announced in JOIN, ACK carries the ones both sides support
+ * Bits 1-3 are reserved (delta snapshots, UDP, compression), they are not implemented and never granted
+ */
+#define CAP_COMPACT_MAP (1u << 0)           // MAP tiles are packed two per byte
+#define CAP_MAP_CACHE (1u << 4)             // Client keeps maps by START hash, gets MAP_DELTA instead of MAP
+#define CAP_SPECTATOR (1u << 5)             // Client only watches: never plays, gets the shared spectator stream
+                                            // (START at the map center, compact MAP, MAP_DELTA, PLAYERS without ack)
+#define CAP_AREA_OF_INTEREST (1u << 6)      // PLAYERS may leave out distant players, the client keeps their last position
+
+#define MAP_CHUNK_SIZE 1024                 // Tile bytes per MAP_CHUNK packet
+#define TILE_CHANGE_SIZE (2 + 2 + 1)        // Encoded size of a MAP_DELTA entry
+#define PLAYER_ENTRY_SIZE (sizeof(int) + sizeof(float) + sizeof(float) + 1 + 1) // Encoded size of a PLAYERS entry
+#define PLAYERS_HEADER_SIZE (PACKET_TYPE_SIZE + sizeof(int) + 3 * sizeof(uint32_t) + sizeof(uint64_t)) // PLAYERS before the entries
+#define SCORE_ENTRY_SIZE (sizeof(int) + sizeof(int)) // Encoded size of a SCORE entry
+#define MAP_DELTA_MAX_CHANGES(packetSize) (((packetSize) - PACKET_TYPE_SIZE - sizeof(int)) / TILE_CHANGE_SIZE)
+
+/*
+ * Enumerations shared by the server and the client
+ */
+// Packet type enumerations
+enum packet_t {
+    JOIN, ACK, START, END, MAP, PLAYERS, SCORE, MOVE, MESSAGE, QUIT, JOINED, PLAYER_DISCONNECTED,
+    MAP_REQUEST, MAP_CHUNK, MAP_DELTA, PING, PONG
+};
+
+// Connection error enumerations (sent in ACK instead of the player ID)
+enum connectionError_t {
+    ERROR_NAME_IN_USE = -1, ERROR_SERVER_FULL = -2, ERROR_OTHER = -3, ERROR_SESSION_EXPIRED = -4
+};
+
+//Map object enumerations
+enum mapObjecT_t {
+    None, Dot, Wall, PowerPellet, Invincibility, Score
+};
+
+// Client movement enumerations
+enum clientMovement_t {
+    UP, DOWN, RIGHT, LEFT
+};
+
+// Player state enumerations
+enum playerState_t {
+    NORMAL, DEAD, powerupPowerPellet = 3, powerupInvincibility = 4
+};
+
+// Player type enumerations
+enum playerType_t {
+    Pacman, Ghost
+};
+
+/*
+ * Bounds checked cursors over a packet buffer
+ * Once a read or write doesn't fit, overflow is set and every following access is ignored
+ */
+typedef struct packetWriter {
+    char *buffer;       // Packet being written
+    size_t capacity;    // Size of buffer
+    size_t length;      // Bytes written so far
+    bool overflow;      // Set if a write did not fit
+} packetWriter_t;
+
+typedef struct packetReader {
+    char *buffer;       // Packet being read
+    size_t length;      // Size of the packet
+    size_t offset;      // Bytes read so far
+    bool overflow;      // Set if a read went past the end of the packet
+} packetReader_t;
+
+/*
+ * Decoded packet contents
+ */
+typedef struct joinPacket {             // JOIN: 0 - type, 1-20 - nickname, 21-22 - version, 23-26 - capabilities, 27-34 - resume token
+    char name[MAX_NICK_SIZE + 1];
+    int version;                        // 0 if the client didn't send it
+    uint32_t capabilities;
+    uint64_t resumeToken;               // Token from the ACK of a dropped connection, 0 to join as a new player
+} joinPacket_t;
+
+typedef struct ackPacket {              // ACK: 0 - type, 1-4 - player ID or connectionError_t, 5-6 - version, 7-10 - capabilities,
+    int id;                             //  11-18 - resume token (since PROTOCOL_VERSION_RESUME)
+    int version;                        // Version both sides speak, 0 if the server didn't send it
+    uint32_t capabilities;              // Capabilities both sides support
+    uint64_t resumeToken;               // Takes the player back after a dropped connection, 0 if the server keeps no session
+} ackPacket_t;
+
+/*
+ * START: 0 - type, 1-2 - map width, 3-4 - map height, 5-6 - x, 7-8 - y, 9-16 - map hash
+ * Before PROTOCOL_VERSION_WIDE_START size and position fields are 1 byte each (maps up to 255x255)
+ */
+typedef struct startPacket {
+    int width;
+    int height;
+    int x;
+    int y;
+    uint64_t mapHash;                   // mapHash of the map's default tiles, 0 if the server didn't send it
+} startPacket_t;
+
+typedef struct mapRequestPacket {       // MAP_REQUEST: 0 - type, 1-8 - map hash
+    uint64_t mapHash;
+} mapRequestPacket_t;
+
+typedef struct mapChunkPacket {         // MAP_CHUNK: 0 - type, 1-8 - hash, 9-12 - total size, 13-16 - offset, 17-18 - length, 19-... - tiles
+    uint64_t mapHash;
+    uint32_t totalSize;                 // Size of the whole map (width*height)
+    uint32_t offset;                    // Offset of this chunk in the row-major tiles
+    int length;
+    char *tiles;                        // Points into the packet buffer when decoded
+} mapChunkPacket_t;
+
+typedef struct tileChange {             // MAP_DELTA entry: x(2), y(2), tile(1)
+    int x;
+    int y;
+    int tile;
+} tileChange_t;
+
+typedef struct playerEntry {            // PLAYERS entry: id(4), x(4), y(4), state(1), type(1)
+    int id;
+    float x;
+    float y;
+    enum playerState_t playerState;
+    enum playerType_t playerType;
+} playerEntry_t;
+
+typedef struct scoreEntry {             // SCORE entry: score(4), id(4)
+    int score;
+    int id;
+} scoreEntry_t;
+
+/*
+ * MOVE: 0 - type, 1-4 - sequence, 5 - direction, 6-9 - time
+ * Before PROTOCOL_VERSION_MOVE_TIME: 0 - type, 1-4 - player ID, 5 - direction, 6-9 - sequence,
+ * before PROTOCOL_VERSION_MOVE_SEQUENCE the packet ends after the direction
+ */
+typedef struct movePacket {
+    int id;                             // Ignored by the server, not sent since PROTOCOL_VERSION_MOVE_TIME
+    enum clientMovement_t direction;
+    uint32_t sequence;                  // Increased with every MOVE, 0 before PROTOCOL_VERSION_MOVE_SEQUENCE
+    uint32_t time;                      // Client's estimate of the server clock (miliseconds, wraps), 0 if unknown
+} movePacket_t;
+
+/*
+ * PLAYERS: 0 - type, 1-4 - player count, 5-8 - MOVE sequence, 9-12 - ticks, 13-16 - tick number,
+ *  17-24 - server time, 25-... - playerEntry_t
+ * Before PROTOCOL_VERSION_SNAPSHOT_TIME the entries follow the ticks,
+ * before PROTOCOL_VERSION_MOVE_SEQUENCE they follow the player count
+ */
+typedef struct moveAck {
+    uint32_t sequence;                  // Last MOVE of the receiving client which the server has applied
+    uint32_t ticks;                     // Ticks the server has moved the player since applying it
+} moveAck_t;
+
+typedef struct snapshotStamp {
+    uint32_t tick;                      // Game tick the positions are from, 0 if the server didn't send it
+    uint64_t time;                      // Server clock (miliseconds) at that tick
+} snapshotStamp_t;
+
+typedef struct messagePacket {          // MESSAGE: 0 - type, 1-4 - player ID, 5-8 - length, 9-... - text
+    int id;
+    int length;
+    char *text;                         // Not null terminated, points into the packet buffer when decoded
+} messagePacket_t;
+
+typedef struct joinedPacket {           // JOINED: 0 - type, 1-4 - player ID, 5-24 - nickname
+    int id;
+    char name[MAX_NICK_SIZE + 1];
+} joinedPacket_t;
+
+typedef struct playerIdPacket {         // QUIT/PLAYER_DISCONNECTED: 0 - type, 1-4 - player ID
+    int id;
+} playerIdPacket_t;
+
+typedef struct pingPacket {             // PING/PONG: 0 - type, 1-4 - sequence, 5-12 - server time, PONG echoes PING
+    uint32_t sequence;
+    uint64_t time;                      // Server clock (miliseconds) when the PING was sent
+} pingPacket_t;
+
+void packetWriterInit(packetWriter_t *, char *, size_t);
+
+void packetReaderInit(packetReader_t *, char *, size_t);
+
+int packetType(char *, size_t);
+
+bool encodeJoin(packetWriter_t *, const joinPacket_t *);
+
+bool decodeJoin(packetReader_t *, joinPacket_t *);
+
+bool encodeAck(packetWriter_t *, const ackPacket_t *);
+
+bool decodeAck(packetReader_t *, ackPacket_t *);
+
+bool encodeStart(packetWriter_t *, const startPacket_t *, int);
+
+bool decodeStart(packetReader_t *, startPacket_t *, int);
+
+bool encodeEnd(packetWriter_t *);
+
+bool encodeMap(packetWriter_t *, const char *, int, int, int);
+
+bool decodeMap(packetReader_t *, int, int, char **);
+
+bool encodeCompactMap(packetWriter_t *, const char *, int, int, int);
+
+bool decodeCompactMap(packetReader_t *, int, int, char *);
+
+bool encodeMapRequest(packetWriter_t *, const mapRequestPacket_t *);
+
+bool decodeMapRequest(packetReader_t *, mapRequestPacket_t *);
+
+bool encodeMapChunk(packetWriter_t *, const mapChunkPacket_t *);
+
+bool decodeMapChunk(packetReader_t *, mapChunkPacket_t *);
+
+bool encodeMapDeltaBegin(packetWriter_t *);
+
+bool encodeTileChange(packetWriter_t *, const tileChange_t *);
+
+bool encodeMapDeltaEnd(packetWriter_t *, int);
+
+bool decodeMapDeltaBegin(packetReader_t *, int *);
+
+bool decodeTileChange(packetReader_t *, tileChange_t *);
+
+uint64_t mapHash(const char *, int, int, int);
+
+bool encodePlayersBegin(packetWriter_t *, const moveAck_t *, const snapshotStamp_t *, int);
+
+bool encodePlayerEntry(packetWriter_t *, const playerEntry_t *);
+
+bool encodePlayersEnd(packetWriter_t *, int);
+
+bool decodePlayersBegin(packetReader_t *, int *, moveAck_t *, snapshotStamp_t *, int);
+
+bool decodePlayerEntry(packetReader_t *, playerEntry_t *);
+
+bool encodeScoresBegin(packetWriter_t *);
+
+bool encodeScoreEntry(packetWriter_t *, const scoreEntry_t *);
+
+bool encodeScoresEnd(packetWriter_t *, int);
+
+bool decodeScoresBegin(packetReader_t *, int *);
+
+bool decodeScoreEntry(packetReader_t *, scoreEntry_t *);
+
+bool encodeMove(packetWriter_t *, const movePacket_t *, int);
+
+bool decodeMove(packetReader_t *, movePacket_t *, int);
+
+extern const float movementStepX[4];
+
+extern const float movementStepY[4];
+
+bool encodeMessage(packetWriter_t *, const messagePacket_t *);
+
+bool decodeMessage(packetReader_t *, messagePacket_t *);
+
+bool encodeJoined(packetWriter_t *, const joinedPacket_t *);
+
+bool decodeJoined(packetReader_t *, joinedPacket_t *);
+
+bool encodePlayerId(packetWriter_t *, enum packet_t, const playerIdPacket_t *);
+
+bool decodePlayerId(packetReader_t *, enum packet_t, playerIdPacket_t *);
+
+bool encodePing(packetWriter_t *, enum packet_t, const pingPacket_t *);
+
+bool decodePing(packetReader_t *, enum packet_t, pingPacket_t *);
+
+#endif //LSP_P1_PROTOCOL_H
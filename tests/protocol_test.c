@@ -0,0 +1,695 @@
+/*
+ * LSP Kursa projekts
+ * Protokola pakešu kodēšanas testi
+ * Alberts Saulitis
+ * Viesturs Ružāns
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "protocol.h"
+
+/*
+ * Round trips every encoder through its decoder, then checks that truncated packets, packets which don't fit
+ * the writer and packets with counts or lengths larger than the data are refused. Ends with a timed
+ * encode/decode loop of the packets the server sends every tick: lsp_p1_protocol_test [iterations]
+ */
+
+#define TEST_BUFFER_SIZE 4096
+#define GUARD_BYTE 0x5A                     // Fills the writer buffer past its capacity, must stay untouched
+#define SAMPLE_WIDTH 7                      // Odd size, the last compact MAP byte holds one tile
+#define SAMPLE_HEIGHT 5
+#define SAMPLE_STRIDE 9                     // Rows of the sample map are further apart than the width
+#define SAMPLE_PLAYERS 3
+#define SAMPLE_CHANGES 4
+#define BENCHMARK_ITERATIONS 20000
+#define BENCHMARK_PLAYERS 240               // Entries of the timed PLAYERS, fits in TEST_BUFFER_SIZE
+#define MAX_OPTIONAL_LENGTHS 2
+
+typedef struct packetCase {
+    const char *name;
+    bool (*encode)(packetWriter_t *);
+    bool (*decode)(char *, size_t, bool *); // Returns what the decoder returned, sets whether the sample came back
+    size_t optional[MAX_OPTIONAL_LENGTHS];  // Shorter lengths which are complete packets of older versions, 0 if none
+} packetCase_t;
+
+int failures;
+char sampleMap[SAMPLE_HEIGHT * SAMPLE_STRIDE];
+char chunkTiles[MAP_CHUNK_SIZE];
+char messageText[] = "Labdien!";
+const tileChange_t sampleChanges[SAMPLE_CHANGES] = {{0, 0, None}, {6, 4, Score}, {65535, 1, Wall}, {3, 65535, Dot}};
+const playerEntry_t samplePlayers[SAMPLE_PLAYERS] = {
+        {1, 0.5f, 1.0f, NORMAL, Pacman}, {17, 299.5f, 199.0f, powerupPowerPellet, Ghost}, {240, -1.0f, 0, DEAD, Pacman}
+};
+const scoreEntry_t sampleScores[SAMPLE_PLAYERS] = {{0, 1}, {-5, 17}, {2147483647, 240}};
+const moveAck_t sampleAck = {4000000000u, 3};
+const snapshotStamp_t sampleStamp = {123456789u, 0x0123456789ABCDEFULL};
+
+/**
+ * Counts and reports a failed check
+ */
+void check(bool passed, const char *name, const char *what) {
+    if (passed) return;
+    printf("FAIL:\t%s: %s\n", name, what);
+    failures++;
+}
+
+/*
+ * Encoders of the sample packets
+ */
+bool encodeSampleJoin(packetWriter_t *writer) {
+    joinPacket_t packet = {"Pacman", PROTOCOL_VERSION, CAP_COMPACT_MAP, 0xFEDCBA9876543210ULL};
+    return encodeJoin(writer, &packet);
+}
+
+bool encodeSampleOldJoin(packetWriter_t *writer) {
+    joinPacket_t packet = {"Exactly20CharactersX", PROTOCOL_VERSION_PING, CAP_SPECTATOR, 77};
+    return encodeJoin(writer, &packet);
+}
+
+bool encodeSampleAck(packetWriter_t *writer) {
+    ackPacket_t packet = {42, PROTOCOL_VERSION, CAP_COMPACT_MAP, 0x1122334455667788ULL};
+    return encodeAck(writer, &packet);
+}
+
+bool encodeSampleRefusal(packetWriter_t *writer) {
+    ackPacket_t packet = {ERROR_SESSION_EXPIRED, PROTOCOL_VERSION, 0, 0};
+    return encodeAck(writer, &packet);
+}
+
+bool encodeSampleStart(packetWriter_t *writer) {
+    startPacket_t packet = {65535, 300, 299, 1, 0xDEADBEEFCAFEF00DULL};
+    return encodeStart(writer, &packet, PROTOCOL_VERSION);
+}
+
+bool encodeSampleNarrowStart(packetWriter_t *writer) {
+    startPacket_t packet = {255, 20, 254, 0, 99};
+    return encodeStart(writer, &packet, PROTOCOL_VERSION_WIDE_START - 1);
+}
+
+bool encodeSampleEnd(packetWriter_t *writer) {
+    return encodeEnd(writer);
+}
+
+bool encodeSampleMap(packetWriter_t *writer) {
+    return encodeMap(writer, sampleMap, SAMPLE_WIDTH, SAMPLE_HEIGHT, SAMPLE_STRIDE);
+}
+
+bool encodeSampleCompactMap(packetWriter_t *writer) {
+    return encodeCompactMap(writer, sampleMap, SAMPLE_WIDTH, SAMPLE_HEIGHT, SAMPLE_STRIDE);
+}
+
+bool encodeSampleMapRequest(packetWriter_t *writer) {
+    mapRequestPacket_t packet = {0x0102030405060708ULL};
+    return encodeMapRequest(writer, &packet);
+}
+
+bool encodeSampleMapChunk(packetWriter_t *writer) {
+    mapChunkPacket_t packet = {0xA5A5A5A5A5A5A5A5ULL, 3 * MAP_CHUNK_SIZE, 2 * MAP_CHUNK_SIZE, MAP_CHUNK_SIZE, chunkTiles};
+    return encodeMapChunk(writer, &packet);
+}
+
+bool encodeSampleMapDelta(packetWriter_t *writer) {
+    encodeMapDeltaBegin(writer);
+    for (int i = 0; i < SAMPLE_CHANGES; i++) encodeTileChange(writer, &sampleChanges[i]);
+    return encodeMapDeltaEnd(writer, SAMPLE_CHANGES);
+}
+
+/**
+ * Encodes the sample PLAYERS in the layout of the given version
+ */
+bool encodeSamplePlayersVersion(packetWriter_t *writer, int version) {
+    encodePlayersBegin(writer, &sampleAck, &sampleStamp, version);
+    for (int i = 0; i < SAMPLE_PLAYERS; i++) encodePlayerEntry(writer, &samplePlayers[i]);
+    return encodePlayersEnd(writer, SAMPLE_PLAYERS);
+}
+
+bool encodeSamplePlayers(packetWriter_t *writer) {
+    return encodeSamplePlayersVersion(writer, PROTOCOL_VERSION);
+}
+
+bool encodeSampleNoStampPlayers(packetWriter_t *writer) {
+    return encodeSamplePlayersVersion(writer, PROTOCOL_VERSION_SNAPSHOT_TIME - 1);
+}
+
+bool encodeSampleOldPlayers(packetWriter_t *writer) {
+    return encodeSamplePlayersVersion(writer, PROTOCOL_VERSION_MOVE_SEQUENCE - 1);
+}
+
+bool encodeSampleScores(packetWriter_t *writer) {
+    encodeScoresBegin(writer);
+    for (int i = 0; i < SAMPLE_PLAYERS; i++) encodeScoreEntry(writer, &sampleScores[i]);
+    return encodeScoresEnd(writer, SAMPLE_PLAYERS);
+}
+
+/**
+ * Encodes the sample MOVE in the layout of the given version, fields the version doesn't have are left out
+ */
+bool encodeSampleMoveVersion(packetWriter_t *writer, int version) {
+    movePacket_t packet = {version >= PROTOCOL_VERSION_MOVE_TIME ? -1 : 9, DOWN,
+                           version >= PROTOCOL_VERSION_MOVE_SEQUENCE ? 4294967295u : 0,
+                           version >= PROTOCOL_VERSION_MOVE_TIME ? 86400000u : 0};
+    return encodeMove(writer, &packet, version);
+}
+
+bool encodeSampleMove(packetWriter_t *writer) {
+    return encodeSampleMoveVersion(writer, PROTOCOL_VERSION);
+}
+
+bool encodeSampleSequenceMove(packetWriter_t *writer) {
+    return encodeSampleMoveVersion(writer, PROTOCOL_VERSION_MOVE_TIME - 1);
+}
+
+bool encodeSampleOldMove(packetWriter_t *writer) {
+    return encodeSampleMoveVersion(writer, PROTOCOL_VERSION_MOVE_SEQUENCE - 1);
+}
+
+bool encodeSampleMessage(packetWriter_t *writer) {
+    messagePacket_t packet = {5, (int) strlen(messageText), messageText};
+    return encodeMessage(writer, &packet);
+}
+
+bool encodeSampleJoined(packetWriter_t *writer) {
+    joinedPacket_t packet = {240, "Bot 224"};
+    return encodeJoined(writer, &packet);
+}
+
+bool encodeSampleDisconnected(packetWriter_t *writer) {
+    playerIdPacket_t packet = {16};
+    return encodePlayerId(writer, PLAYER_DISCONNECTED, &packet);
+}
+
+bool encodeSamplePing(packetWriter_t *writer) {
+    pingPacket_t packet = {7, 0xFFFFFFFFFFFFFFFFULL};
+    return encodePing(writer, PING, &packet);
+}
+
+bool encodeSamplePong(packetWriter_t *writer) {
+    pingPacket_t packet = {0, 1};
+    return encodePing(writer, PONG, &packet);
+}
+
+/*
+ * Decoders of the sample packets
+ */
+bool decodeSampleJoin(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    joinPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeJoin(&reader, &packet);
+    *matches = strcmp(packet.name, "Pacman") == 0 && packet.version == PROTOCOL_VERSION &&
+               packet.capabilities == CAP_COMPACT_MAP && packet.resumeToken == 0xFEDCBA9876543210ULL;
+    return decoded;
+}
+
+bool decodeSampleOldJoin(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    joinPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeJoin(&reader, &packet);
+    *matches = strcmp(packet.name, "Exactly20CharactersX") == 0 && packet.version == PROTOCOL_VERSION_PING &&
+               packet.capabilities == CAP_SPECTATOR && packet.resumeToken == 0;
+    return decoded;
+}
+
+bool decodeSampleAck(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    ackPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeAck(&reader, &packet);
+    *matches = packet.id == 42 && packet.version == PROTOCOL_VERSION && packet.capabilities == CAP_COMPACT_MAP &&
+               packet.resumeToken == 0x1122334455667788ULL;
+    return decoded;
+}
+
+bool decodeSampleRefusal(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    ackPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeAck(&reader, &packet);
+    *matches = packet.id == ERROR_SESSION_EXPIRED && packet.version == PROTOCOL_VERSION && packet.resumeToken == 0;
+    return decoded;
+}
+
+bool decodeSampleStart(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    startPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeStart(&reader, &packet, PROTOCOL_VERSION);
+    *matches = packet.width == 65535 && packet.height == 300 && packet.x == 299 && packet.y == 1 &&
+               packet.mapHash == 0xDEADBEEFCAFEF00DULL;
+    return decoded;
+}
+
+bool decodeSampleNarrowStart(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    startPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeStart(&reader, &packet, PROTOCOL_VERSION_WIDE_START - 1);
+    *matches = packet.width == 255 && packet.height == 20 && packet.x == 254 && packet.y == 0 && packet.mapHash == 99;
+    return decoded;
+}
+
+bool decodeSampleEnd(char *buffer, size_t length, bool *matches) {
+    *matches = packetType(buffer, length) == END;
+    return *matches;
+}
+
+/**
+ * True if tiles (row-major, SAMPLE_WIDTH wide) are the sample map
+ */
+bool isSampleMap(const char *tiles) {
+    for (int i = 0; i < SAMPLE_HEIGHT; i++) {
+        if (memcmp(tiles + i * SAMPLE_WIDTH, sampleMap + i * SAMPLE_STRIDE, SAMPLE_WIDTH) != 0) return false;
+    }
+    return true;
+}
+
+bool decodeSampleMap(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    char *tiles;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeMap(&reader, SAMPLE_WIDTH, SAMPLE_HEIGHT, &tiles);
+    *matches = decoded && isSampleMap(tiles);
+    return decoded;
+}
+
+bool decodeSampleCompactMap(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    char tiles[SAMPLE_WIDTH * SAMPLE_HEIGHT];
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeCompactMap(&reader, SAMPLE_WIDTH, SAMPLE_HEIGHT, tiles);
+    *matches = decoded && isSampleMap(tiles);
+    return decoded;
+}
+
+bool decodeSampleMapRequest(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    mapRequestPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeMapRequest(&reader, &packet);
+    *matches = packet.mapHash == 0x0102030405060708ULL;
+    return decoded;
+}
+
+bool decodeSampleMapChunk(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    mapChunkPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeMapChunk(&reader, &packet);
+    *matches = decoded && packet.mapHash == 0xA5A5A5A5A5A5A5A5ULL && packet.totalSize == 3 * MAP_CHUNK_SIZE &&
+               packet.offset == 2 * MAP_CHUNK_SIZE && packet.length == MAP_CHUNK_SIZE &&
+               memcmp(packet.tiles, chunkTiles, MAP_CHUNK_SIZE) == 0;
+    return decoded;
+}
+
+bool decodeSampleMapDelta(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    tileChange_t change;
+    int count;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeMapDeltaBegin(&reader, &count);
+    *matches = count == SAMPLE_CHANGES;
+    for (int i = 0; i < count; i++) {
+        decoded &= decodeTileChange(&reader, &change);
+        *matches &= change.x == sampleChanges[i].x && change.y == sampleChanges[i].y &&
+                    change.tile == sampleChanges[i].tile;
+    }
+    return decoded;
+}
+
+/**
+ * Decodes PLAYERS of the given version, the move ack and stamp are only compared if the version has them
+ */
+bool decodeSamplePlayersVersion(char *buffer, size_t length, bool *matches, int version) {
+    packetReader_t reader;
+    moveAck_t ack;
+    snapshotStamp_t stamp;
+    playerEntry_t entry;
+    int count;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodePlayersBegin(&reader, &count, &ack, &stamp, version);
+    bool acked = version >= PROTOCOL_VERSION_MOVE_SEQUENCE;
+    bool stamped = version >= PROTOCOL_VERSION_SNAPSHOT_TIME;
+    *matches = count == SAMPLE_PLAYERS && ack.sequence == (acked ? sampleAck.sequence : 0) &&
+               ack.ticks == (acked ? sampleAck.ticks : 0) && stamp.tick == (stamped ? sampleStamp.tick : 0) &&
+               stamp.time == (stamped ? sampleStamp.time : 0);
+    for (int i = 0; i < count; i++) {
+        decoded &= decodePlayerEntry(&reader, &entry);
+        *matches &= entry.id == samplePlayers[i].id && entry.x == samplePlayers[i].x &&
+                    entry.y == samplePlayers[i].y && entry.playerState == samplePlayers[i].playerState &&
+                    entry.playerType == samplePlayers[i].playerType;
+    }
+    return decoded;
+}
+
+bool decodeSamplePlayers(char *buffer, size_t length, bool *matches) {
+    return decodeSamplePlayersVersion(buffer, length, matches, PROTOCOL_VERSION);
+}
+
+bool decodeSampleNoStampPlayers(char *buffer, size_t length, bool *matches) {
+    return decodeSamplePlayersVersion(buffer, length, matches, PROTOCOL_VERSION_SNAPSHOT_TIME - 1);
+}
+
+bool decodeSampleOldPlayers(char *buffer, size_t length, bool *matches) {
+    return decodeSamplePlayersVersion(buffer, length, matches, PROTOCOL_VERSION_MOVE_SEQUENCE - 1);
+}
+
+bool decodeSampleScores(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    scoreEntry_t entry;
+    int count;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeScoresBegin(&reader, &count);
+    *matches = count == SAMPLE_PLAYERS;
+    for (int i = 0; i < count; i++) {
+        decoded &= decodeScoreEntry(&reader, &entry);
+        *matches &= entry.score == sampleScores[i].score && entry.id == sampleScores[i].id;
+    }
+    return decoded;
+}
+
+/**
+ * Decodes MOVE of the given version, fields the version doesn't have must come back as their defaults
+ */
+bool decodeSampleMoveVersion(char *buffer, size_t length, bool *matches, int version) {
+    packetReader_t reader;
+    movePacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeMove(&reader, &packet, version);
+    *matches = packet.id == (version >= PROTOCOL_VERSION_MOVE_TIME ? -1 : 9) && packet.direction == DOWN &&
+               packet.sequence == (version >= PROTOCOL_VERSION_MOVE_SEQUENCE ? 4294967295u : 0) &&
+               packet.time == (version >= PROTOCOL_VERSION_MOVE_TIME ? 86400000u : 0);
+    return decoded;
+}
+
+bool decodeSampleMove(char *buffer, size_t length, bool *matches) {
+    return decodeSampleMoveVersion(buffer, length, matches, PROTOCOL_VERSION);
+}
+
+bool decodeSampleSequenceMove(char *buffer, size_t length, bool *matches) {
+    return decodeSampleMoveVersion(buffer, length, matches, PROTOCOL_VERSION_MOVE_TIME - 1);
+}
+
+bool decodeSampleOldMove(char *buffer, size_t length, bool *matches) {
+    return decodeSampleMoveVersion(buffer, length, matches, PROTOCOL_VERSION_MOVE_SEQUENCE - 1);
+}
+
+bool decodeSampleMessage(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    messagePacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeMessage(&reader, &packet);
+    *matches = decoded && packet.id == 5 && packet.length == (int) strlen(messageText) &&
+               memcmp(packet.text, messageText, strlen(messageText)) == 0;
+    return decoded;
+}
+
+bool decodeSampleJoined(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    joinedPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodeJoined(&reader, &packet);
+    *matches = packet.id == 240 && strcmp(packet.name, "Bot 224") == 0;
+    return decoded;
+}
+
+bool decodeSampleDisconnected(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    playerIdPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodePlayerId(&reader, PLAYER_DISCONNECTED, &packet);
+    *matches = packet.id == 16;
+    return decoded;
+}
+
+bool decodeSamplePing(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    pingPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodePing(&reader, PING, &packet);
+    *matches = packet.sequence == 7 && packet.time == 0xFFFFFFFFFFFFFFFFULL;
+    return decoded;
+}
+
+bool decodeSamplePong(char *buffer, size_t length, bool *matches) {
+    packetReader_t reader;
+    pingPacket_t packet;
+    packetReaderInit(&reader, buffer, length);
+    bool decoded = decodePing(&reader, PONG, &packet);
+    *matches = packet.sequence == 0 && packet.time == 1;
+    return decoded;
+}
+
+/*
+ * JOIN and ACK of version 0 peers end after the name or ID, newer ones may end before the resume token,
+ * START of old servers ends before the map hash (after 4 or 8 bytes of size and position)
+ */
+const packetCase_t packetCases[] = {
+        {"JOIN",                encodeSampleJoin,           decodeSampleJoin,           {1 + MAX_NICK_SIZE, 1 + MAX_NICK_SIZE + 6}},
+        {"JOIN version 6",      encodeSampleOldJoin,        decodeSampleOldJoin,        {1 + MAX_NICK_SIZE}},
+        {"ACK",                 encodeSampleAck,            decodeSampleAck,            {5, 11}},
+        {"ACK refusal",         encodeSampleRefusal,        decodeSampleRefusal,        {5, 11}},
+        {"START",               encodeSampleStart,          decodeSampleStart,          {9}},
+        {"START version 1",     encodeSampleNarrowStart,    decodeSampleNarrowStart,    {5}},
+        {"END",                 encodeSampleEnd,            decodeSampleEnd,            {0}},
+        {"MAP",                 encodeSampleMap,            decodeSampleMap,            {0}},
+        {"MAP compact",         encodeSampleCompactMap,     decodeSampleCompactMap,     {0}},
+        {"MAP_REQUEST",         encodeSampleMapRequest,     decodeSampleMapRequest,     {0}},
+        {"MAP_CHUNK",           encodeSampleMapChunk,       decodeSampleMapChunk,       {0}},
+        {"MAP_DELTA",           encodeSampleMapDelta,       decodeSampleMapDelta,       {0}},
+        {"PLAYERS",             encodeSamplePlayers,        decodeSamplePlayers,        {0}},
+        {"PLAYERS version 3",   encodeSampleNoStampPlayers, decodeSampleNoStampPlayers, {0}},
+        {"PLAYERS version 2",   encodeSampleOldPlayers,     decodeSampleOldPlayers,     {0}},
+        {"SCORE",               encodeSampleScores,         decodeSampleScores,         {0}},
+        {"MOVE",                encodeSampleMove,           decodeSampleMove,           {0}},
+        {"MOVE version 4",      encodeSampleSequenceMove,   decodeSampleSequenceMove,   {0}},
+        {"MOVE version 2",      encodeSampleOldMove,        decodeSampleOldMove,        {0}},
+        {"MESSAGE",             encodeSampleMessage,        decodeSampleMessage,        {0}},
+        {"JOINED",              encodeSampleJoined,         decodeSampleJoined,         {0}},
+        {"PLAYER_DISCONNECTED", encodeSampleDisconnected,   decodeSampleDisconnected,   {0}},
+        {"PING",                encodeSamplePing,           decodeSamplePing,           {0}},
+        {"PONG",                encodeSamplePong,           decodeSamplePong,           {0}},
+};
+
+/**
+ * True if length is one of the shorter complete packets of the case
+ */
+bool isOptionalLength(const packetCase_t *packetCase, size_t length) {
+    for (int i = 0; i < MAX_OPTIONAL_LENGTHS; i++) {
+        if (packetCase->optional[i] != 0 && packetCase->optional[i] == length) return true;
+    }
+    return false;
+}
+
+/**
+ * Round trip, every truncated length and every writer capacity smaller than the packet
+ */
+void testPacketCase(const packetCase_t *packetCase) {
+    char packet[TEST_BUFFER_SIZE];
+    char buffer[TEST_BUFFER_SIZE];
+    packetWriter_t writer;
+    bool matches;
+
+    packetWriterInit(&writer, packet, sizeof(packet));
+    check(packetCase->encode(&writer), packetCase->name, "encoding failed");
+    size_t length = writer.length;
+    check(packetType(packet, length) >= JOIN && packetType(packet, length) <= PONG, packetCase->name, "no packet type");
+    check(packetCase->decode(packet, length, &matches) && matches, packetCase->name, "round trip changed the packet");
+
+    for (size_t cut = 0; cut < length; cut++) {
+        // The truncated packet is copied so a decoder reading past it would show up in sanitizer builds
+        char *truncated = malloc(cut ? cut : 1);
+        memcpy(truncated, packet, cut);
+        bool decoded = packetCase->decode(truncated, cut, &matches);
+        free(truncated);
+        if (isOptionalLength(packetCase, cut)) {
+            check(decoded, packetCase->name, "complete older packet refused");
+        } else {
+            check(!decoded, packetCase->name, "truncated packet accepted");
+        }
+    }
+
+    for (size_t capacity = 0; capacity < length; capacity++) {
+        memset(buffer, GUARD_BYTE, sizeof(buffer));
+        packetWriterInit(&writer, buffer, capacity);
+        check(!packetCase->encode(&writer), packetCase->name, "packet larger than the writer encoded");
+        bool untouched = true;
+        for (size_t i = capacity; i < length; i++) untouched &= buffer[i] == (char) GUARD_BYTE;
+        check(untouched, packetCase->name, "encoder wrote past the writer capacity");
+    }
+    memset(buffer, GUARD_BYTE, sizeof(buffer));
+    packetWriterInit(&writer, buffer, length);
+    check(packetCase->encode(&writer) && memcmp(buffer, packet, length) == 0, packetCase->name,
+          "packet of exactly the writer capacity differs");
+}
+
+/**
+ * Counts and lengths claiming more data than the packet has, packets of another type
+ * and values which the agreed protocol version can't carry
+ */
+void testOversizedFields() {
+    char packet[TEST_BUFFER_SIZE];
+    packetWriter_t writer;
+    packetReader_t reader;
+    int count;
+    int hugeCount = 0x7FFFFFFF;
+    int negativeCount = -1;
+
+    // PLAYERS, SCORE and MAP_DELTA counts are checked against the remaining bytes
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeSamplePlayers(&writer);
+    memcpy(packet + PACKET_TYPE_SIZE, &hugeCount, sizeof(hugeCount));
+    moveAck_t ack;
+    snapshotStamp_t stamp;
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodePlayersBegin(&reader, &count, &ack, &stamp, PROTOCOL_VERSION) && count == 0, "PLAYERS",
+          "player count past the packet accepted");
+    memcpy(packet + PACKET_TYPE_SIZE, &negativeCount, sizeof(negativeCount));
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodePlayersBegin(&reader, &count, &ack, &stamp, PROTOCOL_VERSION), "PLAYERS", "negative count accepted");
+
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeSampleScores(&writer);
+    int oneTooMany = SAMPLE_PLAYERS + 1;
+    memcpy(packet + PACKET_TYPE_SIZE, &oneTooMany, sizeof(oneTooMany));
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodeScoresBegin(&reader, &count), "SCORE", "score count past the packet accepted");
+
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeSampleMapDelta(&writer);
+    memcpy(packet + PACKET_TYPE_SIZE, &hugeCount, sizeof(hugeCount));
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodeMapDeltaBegin(&reader, &count) && count == 0, "MAP_DELTA", "change count past the packet accepted");
+
+    // START of a map larger than 255x255 for a version 1 client
+    startPacket_t start = {256, 20, 1, 1, 0};
+    packetWriterInit(&writer, packet, sizeof(packet));
+    check(!encodeStart(&writer, &start, PROTOCOL_VERSION_WIDE_START - 1), "START", "width 256 encoded in one byte");
+
+    // MESSAGE length larger than the text, and negative
+    messagePacket_t message;
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeSampleMessage(&writer);
+    int longer = (int) strlen(messageText) + 1;
+    memcpy(packet + PACKET_TYPE_SIZE + sizeof(int), &longer, sizeof(longer));
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodeMessage(&reader, &message), "MESSAGE", "length past the packet accepted");
+    memcpy(packet + PACKET_TYPE_SIZE + sizeof(int), &negativeCount, sizeof(negativeCount));
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodeMessage(&reader, &message) && message.text == NULL, "MESSAGE", "negative length accepted");
+
+    // MAP_CHUNK which ends past the map
+    mapChunkPacket_t chunk = {1, MAP_CHUNK_SIZE, 1, MAP_CHUNK_SIZE, chunkTiles};
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeMapChunk(&writer, &chunk);
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodeMapChunk(&reader, &chunk), "MAP_CHUNK", "chunk past the end of the map accepted");
+    chunk.offset = 2 * MAP_CHUNK_SIZE;
+    chunk.length = 0;
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeMapChunk(&writer, &chunk);
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodeMapChunk(&reader, &chunk), "MAP_CHUNK", "offset past the end of the map accepted");
+
+    // MOVE with a direction which doesn't exist, the direction follows the sequence
+    movePacket_t move = {0, LEFT, 1, 1};
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeMove(&writer, &move, PROTOCOL_VERSION);
+    packet[PACKET_TYPE_SIZE + sizeof(uint32_t)] = LEFT + 1;
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodeMove(&reader, &move, PROTOCOL_VERSION), "MOVE", "unknown direction accepted");
+
+    // Every decoder checks the type byte, including types above 127
+    playerIdPacket_t player;
+    packetWriterInit(&writer, packet, sizeof(packet));
+    encodeSampleDisconnected(&writer);
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodePlayerId(&reader, QUIT, &player), "PLAYER_DISCONNECTED", "decoded as QUIT");
+    packet[0] = (char) (PLAYER_DISCONNECTED | 0x80);
+    packetReaderInit(&reader, packet, writer.length);
+    check(!decodePlayerId(&reader, PLAYER_DISCONNECTED, &player), "PLAYER_DISCONNECTED",
+          "type byte with the high bit set accepted");
+    check(packetType(packet, writer.length) == (PLAYER_DISCONNECTED | 0x80), "PLAYER_DISCONNECTED",
+          "packetType isn't unsigned");
+    check(packetType(packet, 0) == -1, "packetType", "type of an empty packet");
+}
+
+/**
+ * Nanoseconds between two clock readings
+ */
+double elapsedNs(const struct timespec *start, const struct timespec *end) {
+    return (double) (end->tv_sec - start->tv_sec) * 1e9 + (double) (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Encodes and decodes a full PLAYERS and a MAP_CHUNK the given number of times and prints the time per packet
+ */
+void benchmark(int iterations) {
+    static char packet[TEST_BUFFER_SIZE];
+    packetWriter_t writer;
+    packetReader_t reader;
+    playerEntry_t entry;
+    moveAck_t ack;
+    snapshotStamp_t stamp = sampleStamp;
+    mapChunkPacket_t chunk = {1, 64 * MAP_CHUNK_SIZE, 0, MAP_CHUNK_SIZE, chunkTiles};
+    struct timespec start, end;
+    int count;
+    long checksum = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        stamp.tick = (uint32_t) i;
+        packetWriterInit(&writer, packet, sizeof(packet));
+        encodePlayersBegin(&writer, &sampleAck, &stamp, PROTOCOL_VERSION);
+        for (int j = 0; j < BENCHMARK_PLAYERS; j++) {
+            playerEntry_t player = {j + 1, (float) (i + j), (float) j, NORMAL, j & 1 ? Ghost : Pacman};
+            encodePlayerEntry(&writer, &player);
+        }
+        encodePlayersEnd(&writer, BENCHMARK_PLAYERS);
+        packetReaderInit(&reader, packet, writer.length);
+        decodePlayersBegin(&reader, &count, &ack, &stamp, PROTOCOL_VERSION);
+        for (int j = 0; j < count && decodePlayerEntry(&reader, &entry); j++) checksum += entry.id;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("INFO:\tPLAYERS with %d entries: %.0f ns per encode and decode\n", BENCHMARK_PLAYERS,
+           elapsedNs(&start, &end) / iterations);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        chunk.offset = (uint32_t) (i % 64) * MAP_CHUNK_SIZE;
+        packetWriterInit(&writer, packet, sizeof(packet));
+        encodeMapChunk(&writer, &chunk);
+        packetReaderInit(&reader, packet, writer.length);
+        if (decodeMapChunk(&reader, &chunk)) checksum += chunk.tiles[i % MAP_CHUNK_SIZE];
+        chunk.tiles = chunkTiles;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("INFO:\tMAP_CHUNK of %d tiles: %.0f ns per encode and decode\n", MAP_CHUNK_SIZE,
+           elapsedNs(&start, &end) / iterations);
+    check(checksum != 0, "benchmark", "decoded nothing");
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : BENCHMARK_ITERATIONS;
+    // Bytes between the rows of the sample map must not end up in MAP
+    for (int i = 0; i < SAMPLE_HEIGHT * SAMPLE_STRIDE; i++) {
+        sampleMap[i] = (char) (i % SAMPLE_STRIDE < SAMPLE_WIDTH ? i % (Score + 1) : 0x0F);
+    }
+    for (int i = 0; i < MAP_CHUNK_SIZE; i++) chunkTiles[i] = (char) (i * 7 % (Score + 1));
+
+    for (size_t i = 0; i < sizeof(packetCases) / sizeof(packetCases[0]); i++) testPacketCase(&packetCases[i]);
+    testOversizedFields();
+    if (iterations > 0) benchmark(iterations);
+
+    if (failures > 0) {
+        printf("FAIL:\t%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("INFO:\tAll protocol checks passed\n");
+    return EXIT_SUCCESS;
+}